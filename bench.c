@@ -0,0 +1,560 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The microbenchmarks of the paths every request goes through, run by
+ * meson test --benchmark.  Every case is timed five times over as many
+ * iterations as fill the time given with -t, and printed as a line of
+ * JSON with the median and the best time per operation, so that two
+ * runs can be compared by a script.
+ */
+
+#include "crest.h"
+
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS	5
+
+const char *prgname = "crest-bench";
+const char *prompt;
+int force_interactive;
+int single_process;
+int nthreads = 1;
+
+struct bench {
+	const char	*name;
+	uint64_t	(*run)(const struct bench*, size_t);
+	const char	*s;
+	size_t		 n;
+	size_t		 bytes;		/* per operation, for the throughput */
+};
+
+static long	budget = 100;		/* milliseconds per run */
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+cmd_free(struct cmd *cmd)
+{
+	switch (cmd->type) {
+	case CMD_REQ:
+	case CMD_RATE:
+		free(cmd->req.path);
+		free(cmd->req.payload);
+		break;
+	case CMD_SET:
+		if (cmd->opt.dirty)
+			free(cmd->opt.value);
+		break;
+	default:
+		break;
+	}
+}
+
+static uint64_t
+run_parse(const struct bench *b, size_t n)
+{
+	struct cmd cmd;
+	uint64_t t;
+
+	t = nsec();
+	while (n-- > 0) {
+		memset(&cmd, 0, sizeof(cmd));
+		if (!parse(b->s, &cmd))
+			errx(1, "can't parse %s", b->s);
+		cmd_free(&cmd);
+	}
+	return nsec() - t;
+}
+
+/* the header lines for the svec cases */
+static char **
+header_set(size_t n)
+{
+	static char **set;
+	static size_t len;
+	size_t i;
+
+	if (n <= len)
+		return set;
+	if ((set = reallocarray(set, n, sizeof(*set))) == NULL)
+		err(1, "reallocarray");
+	for (i = len; i < n; ++i)
+		if (asprintf(&set[i], "X-Header-%zu: value-%zu", i, i) == -1)
+			err(1, "asprintf");
+	len = n;
+	return set;
+}
+
+static struct svec *
+svec_fill(char **set, size_t n)
+{
+	struct svec *v;
+	size_t i;
+
+	for (v = NULL, i = 0; i < n; ++i)
+		if ((v = svec_add(v, set[i], 0)) == NULL)
+			err(1, "svec_add");
+	return v;
+}
+
+static uint64_t
+run_svec_add(const struct bench *b, size_t n)
+{
+	char **set;
+	uint64_t t;
+
+	set = header_set(b->n);
+	t = nsec();
+	while (n-- > 0)
+		svec_free(svec_fill(set, b->n));
+	return nsec() - t;
+}
+
+/* delete every header, in the order they were added */
+static uint64_t
+run_svec_del(const struct bench *b, size_t n)
+{
+	struct svec *v;
+	char **set, name[32];
+	uint64_t t, tot;
+	size_t i;
+
+	set = header_set(b->n);
+	for (tot = 0; n-- > 0; ) {
+		v = svec_fill(set, b->n);
+		t = nsec();
+		for (i = 0; i < b->n; ++i) {
+			snprintf(name, sizeof(name), "X-Header-%zu", i);
+			if (!svec_del(v, name))
+				errx(1, "svec_del: %s not found", name);
+		}
+		tot += nsec() - t;
+		svec_free(v);
+	}
+	return tot;
+}
+
+static uint64_t
+run_svec_to_curl(const struct bench *b, size_t n)
+{
+	struct svec *v;
+	uint64_t t;
+
+	v = svec_fill(header_set(b->n), b->n);
+	t = nsec();
+	while (n-- > 0)
+		curl_slist_free_all(svec_to_curl(v));
+	t = nsec() - t;
+	svec_free(v);
+	return t;
+}
+
+static char *
+body_of(size_t len)
+{
+	static char *body;
+	static size_t blen;
+	size_t i;
+
+	if (len <= blen)
+		return body;
+	if ((body = realloc(body, len)) == NULL)
+		err(1, "realloc");
+	for (i = blen; i < len; ++i)
+		body[i] = i % 61 == 60 ? '\n' : 'a' + i % 26;
+	blen = len;
+	return body;
+}
+
+/* a response of b->bytes in the chunks of b->n curl gives */
+static uint64_t
+run_write_res(const struct bench *b, size_t n)
+{
+	struct write_result res;
+	const char *body;
+	uint64_t t;
+	size_t off, l;
+
+	body = body_of(b->bytes);
+	t = nsec();
+	while (n-- > 0) {
+		init_res(&res);
+		for (off = 0; off < b->bytes; off += l) {
+			l = b->bytes - off < b->n ? b->bytes - off : b->n;
+			if (write_res((char *)body + off, 1, l, &res) != l)
+				errx(1, "write_res failed");
+		}
+		free(res.data);
+	}
+	return nsec() - t;
+}
+
+/* a block of headers, a line at a time as curl gives them */
+static uint64_t
+run_write_res_header(const struct bench *b, size_t n)
+{
+	static const char *lines[] = {
+		"HTTP/1.1 200 OK\r\n",
+		"Date: Mon, 19 Oct 2026 12:00:00 GMT\r\n",
+		"Content-Type: application/json; charset=utf-8\r\n",
+		"Content-Length: 1432\r\n",
+		"Connection: keep-alive\r\n",
+		"Cache-Control: private, max-age=0, must-revalidate\r\n",
+		"ETag: \"33a64df551425fcc55e4d42a148795d9f25f89d4\"\r\n",
+		"Vary: Accept-Encoding, Authorization\r\n",
+		"Set-Cookie: session=38afes7a8; Path=/; Secure; HttpOnly; "
+		    "SameSite=Lax; Max-Age=3600\r\n",
+		"Strict-Transport-Security: max-age=63072000; "
+		    "includeSubDomains; preload\r\n",
+		"X-Request-Id: 5f0c6a0e-8c3a-4d3b-9b7e-2f1d6e9a0c11\r\n",
+	};
+	struct write_result res;
+	uint64_t t;
+	size_t i, j, nl;
+
+	nl = sizeof(lines) / sizeof(lines[0]);
+	t = nsec();
+	while (n-- > 0) {
+		init_res(&res);
+		for (i = 0; i < b->n; ++i) {
+			j = i == 0 ? 0 : 1 + (i - 1) % (nl - 1);
+			if (write_res_header((char *)lines[j], 1,
+			    strlen(lines[j]), &res) == 0)
+				errx(1, "write_res_header failed");
+		}
+		write_res_header("\r\n", 1, 2, &res);
+		free(res.data);
+	}
+	return nsec() - t;
+}
+
+/* a text with a control character now and then, for vis to do */
+static char *
+text_of(size_t len)
+{
+	static char *text;
+	size_t i;
+
+	if ((text = realloc(text, len + 1)) == NULL)
+		err(1, "realloc");
+	for (i = 0; i < len; ++i)
+		text[i] = i % 97 == 96 ? '\t' : ' ' + i % 94;
+	text[len] = '\0';
+	return text;
+}
+
+static uint64_t
+run_safe_println(const struct bench *b, size_t n)
+{
+	const char *text;
+	uint64_t t;
+	int fd, saved;
+
+	text = text_of(b->n);
+
+	fflush(stdout);
+	if ((fd = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+	if ((saved = dup(1)) == -1 || dup2(fd, 1) == -1)
+		err(1, "dup");
+	close(fd);
+
+	t = nsec();
+	while (n-- > 0)
+		safe_println(text, b->n);
+	t = nsec() - t;
+
+	if (dup2(saved, 1) == -1)
+		err(1, "dup2");
+	close(saved);
+	return t;
+}
+
+static uint64_t
+run_strnvis(const struct bench *b, size_t n)
+{
+	const char *text;
+	char *s;
+	uint64_t t;
+
+	text = text_of(b->n);
+	if ((s = malloc(b->n * 4 + 1)) == NULL)
+		err(1, "malloc");
+
+	t = nsec();
+	while (n-- > 0)
+		if (strnvis(s, text, b->n * 4 + 1, VIS_CSTYLE) == -1)
+			err(1, "strnvis");
+	t = nsec() - t;
+
+	free(s);
+	return t;
+}
+
+/* extract .a from the body, copied so it ends where the heap does */
+static uint64_t
+run_json_extract(const struct bench *b, size_t n)
+{
+	char *body, *val;
+	size_t len, vlen;
+	uint64_t t;
+
+	len = strlen(b->s);
+	if ((body = malloc(len)) == NULL)
+		err(1, "malloc");
+	memcpy(body, b->s, len);
+
+	t = nsec();
+	while (n-- > 0) {
+		if (json_extract(body, len, ".a", &val, &vlen) == 1)
+			free(val);
+	}
+	t = nsec() - t;
+
+	free(body);
+	return t;
+}
+
+/* the other end of the socketpair sends back what it gets */
+static void *
+echo(void *arg)
+{
+	struct imsgbuf ibuf;
+	struct imsg imsg;
+	ssize_t n;
+
+	imsg_init(&ibuf, *(int *)arg);
+	for (;;) {
+		if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+			err(1, "imsg_read");
+		if (n == 0)
+			break;
+		while ((n = imsg_get(&ibuf, &imsg)) > 0) {
+			if (imsg_compose(&ibuf, imsg.hdr.type, 0, 0, -1,
+			    imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE) == -1)
+				err(1, "imsg_compose");
+			imsg_free(&imsg);
+		}
+		if (n == -1)
+			err(1, "imsg_get");
+		if (imsg_flush(&ibuf) == -1)
+			err(1, "imsg_flush");
+	}
+	imsg_clear(&ibuf);
+	close(ibuf.fd);
+	return NULL;
+}
+
+static uint64_t
+run_imsg(const struct bench *b, size_t n)
+{
+	static struct imsgbuf ibuf;
+	static pthread_t th;
+	static int fds[2] = { -1, -1 };
+	struct imsg imsg;
+	const char *data;
+	uint64_t t;
+	ssize_t r;
+
+	if (fds[0] == -1) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) == -1)
+			err(1, "socketpair");
+		imsg_init(&ibuf, fds[0]);
+		if (pthread_create(&th, NULL, echo, &fds[1]) != 0)
+			errx(1, "pthread_create");
+	}
+
+	data = body_of(b->n);
+	t = nsec();
+	while (n-- > 0) {
+		if (imsg_compose(&ibuf, 1, 0, 0, -1, data, b->n) == -1)
+			err(1, "imsg_compose");
+		if (imsg_flush(&ibuf) == -1)
+			err(1, "imsg_flush");
+		while ((r = imsg_get(&ibuf, &imsg)) == 0) {
+			if ((r = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+				err(1, "imsg_read");
+			if (r == 0)
+				errx(1, "echo vanished");
+		}
+		if (r == -1)
+			err(1, "imsg_get");
+		imsg_free(&imsg);
+	}
+	return nsec() - t;
+}
+
+static const struct bench benches[] = {
+	{ "parse/get", run_parse, "get /api/v1/items?page=2&limit=50",
+	    0, 0 },
+	{ "parse/get-timeout", run_parse,
+	    "get timeout=500ms connect-timeout=100ms /api/v1/slow", 0, 0 },
+	{ "parse/post-json", run_parse,
+	    "post /login {\"user\": \"op\", \"password\": \"secret\"}", 0, 0 },
+	{ "parse/add", run_parse, "add Authorization: Bearer eyJhbGciOiJIUz"
+	    "I1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIn0", 0, 0 },
+	{ "parse/set-prefix", run_parse,
+	    "set prefix http://localhost:8080/api/v1/", 0, 0 },
+	{ "parse/rate", run_parse, "rate 2000/s for 60s get /items", 0, 0 },
+
+	{ "svec/add/16",	run_svec_add,		NULL, 16,	0 },
+	{ "svec/add/256",	run_svec_add,		NULL, 256,	0 },
+	{ "svec/del/16",	run_svec_del,		NULL, 16,	0 },
+	{ "svec/del/256",	run_svec_del,		NULL, 256,	0 },
+	{ "svec/to_curl/16",	run_svec_to_curl,	NULL, 16,	0 },
+	{ "svec/to_curl/256",	run_svec_to_curl,	NULL, 256,	0 },
+
+	{ "write_res/1m/64",	run_write_res, NULL, 64,	1 << 20 },
+	{ "write_res/1m/1k",	run_write_res, NULL, 1024,	1 << 20 },
+	{ "write_res/1m/16k",	run_write_res, NULL, 16384,	1 << 20 },
+	{ "write_res/1m/256k",	run_write_res, NULL, 262144,	1 << 20 },
+	{ "write_res_header/8",	 run_write_res_header, NULL, 8,	0 },
+	{ "write_res_header/64", run_write_res_header, NULL, 64,	0 },
+
+	{ "safe_println/80",	run_safe_println, NULL, 80,	80 },
+	{ "safe_println/4k",	run_safe_println, NULL, 4096,	4096 },
+	{ "safe_println/64k",	run_safe_println, NULL, 65536,	65536 },
+	{ "strnvis/80",		run_strnvis,	NULL, 80,	80 },
+	{ "strnvis/4k",		run_strnvis,	NULL, 4096,	4096 },
+	{ "strnvis/64k",	run_strnvis,	NULL, 65536,	65536 },
+
+	{ "json/extract", run_json_extract, "{\"id\": 1, \"name\": "
+	    "\"a \\\"quoted\\\" name\", \"tags\": [\"x\", {\"y\": \"]\"}], "
+	    "\"a\": [1, 2, 3]}", 0, 0 },
+	{ "json/extract/truncated", run_json_extract, "{\"a\":\"\\", 0, 0 },
+
+	{ "imsg/0",		run_imsg,	NULL, 0,	0 },
+	{ "imsg/1k",		run_imsg,	NULL, 1024,	1024 },
+	{ "imsg/16000",		run_imsg,	NULL, 16000,	16000 },
+};
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* print s as a JSON string */
+static void
+print_str(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; ++s) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static void
+measure(const struct bench *b)
+{
+	uint64_t ns[RUNS], t, want;
+	double med;
+	size_t n;
+	int i;
+
+	/* how many iterations fill a run */
+	want = (uint64_t)budget * 1000000;
+	for (n = 1; (t = b->run(b, n)) < want / 10; n *= 2)
+		;
+	n = (double)n * want / (t ? t : 1);
+	if (n == 0)
+		n = 1;
+
+	for (i = 0; i < RUNS; ++i)
+		ns[i] = b->run(b, n);
+	qsort(ns, RUNS, sizeof(*ns), cmp);
+
+	med = (double)ns[RUNS / 2] / n;
+	printf("{\"name\": ");
+	print_str(b->name);
+	printf(", \"iterations\": %zu, \"runs\": %d, \"ns_per_op\": %.1f, "
+	    "\"best_ns_per_op\": %.1f", n, RUNS, med, (double)ns[0] / n);
+	if (b->bytes != 0)
+		printf(", \"mb_per_s\": %.1f", b->bytes / med * 1000);
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-t ms] [name ...]\n", prgname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *errstr;
+	size_t i;
+	int ch, j;
+
+	while ((ch = getopt(argc, argv, "t:")) != -1) {
+		switch (ch) {
+		case 't':
+			budget = strtonum(optarg, 1, 60000, &errstr);
+			if (errstr != NULL)
+				errx(1, "time is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	settings.bufsize = 256 * 1024;
+	if (curl_global_init(CURL_GLOBAL_ALL) != 0)
+		errx(1, "curl_global_init failed");
+
+	/* the cases whose name starts with one of the arguments */
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+		for (j = 0; j < argc; ++j)
+			if (strsw(benches[i].name, argv[j]))
+				break;
+		if (argc == 0 || j != argc)
+			measure(&benches[i]);
+	}
+
+	curl_global_cleanup();
+	return 0;
+}
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An in-memory LRU cache for the GET responses, shared by the threads
+ * of a child.  The entries are looked up by URL and by the values of
+ * the request headers named in their Vary.  They're refcounted, so an
+ * entry can be evicted while a thread is still sending it.
+ */
+
+#include "crest.h"
+
+#include <sys/mman.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static TAILQ_HEAD(centryq, centry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static size_t used;
+static size_t hits, revalidated, misses;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+xstrndup(const char *s, size_t len)
+{
+	char *t;
+
+	if ((t = malloc(len + 1)) == NULL)
+		err(1, "malloc");
+	memcpy(t, s, len);
+	t[len] = '\0';
+	return t;
+}
+
+/* the value of the last header with the given name or, with join, the
+ * values of all of them joined with commas as RFC 9110 section 5.3
+ * allows for the lists.  NULL if there's none */
+static char *
+hdr_get(const char *h, size_t len, const char *name, int join)
+{
+	const char *end, *nl, *v, *ve;
+	char *val, *t;
+	size_t l, vlen;
+
+	l = strlen(name);
+	end = h + len;
+	val = NULL;
+	vlen = 0;
+
+	for (; h < end; h = nl + 1) {
+		if ((nl = memchr(h, '\n', end - h)) == NULL)
+			nl = end;
+
+		if ((size_t)(nl - h) <= l || h[l] != ':' ||
+		    strncasecmp(h, name, l) != 0)
+			continue;
+
+		for (v = h + l + 1; v < nl && isspace((unsigned char)*v); ++v)
+			;
+		for (ve = nl; ve > v && isspace((unsigned char)ve[-1]); --ve)
+			;
+
+		if (val == NULL || !join) {
+			free(val);
+			val = xstrndup(v, ve - v);
+			vlen = ve - v;
+			continue;
+		}
+
+		if ((t = realloc(val, vlen + 2 + (ve - v) + 1)) == NULL)
+			err(1, "realloc");
+		val = t;
+		memcpy(val + vlen, ", ", 2);
+		memcpy(val + vlen + 2, v, ve - v);
+		vlen += 2 + (ve - v);
+		val[vlen] = '\0';
+	}
+
+	return val;
+}
+
+/* return the value of the last header with the given name, or NULL */
+char *
+hdr_value(const char *h, size_t len, const char *name)
+{
+	return hdr_get(h, len, name, 0);
+}
+
+/* the values of all the headers with the given name, for the lists */
+static char *
+hdr_list(const char *h, size_t len, const char *name)
+{
+	return hdr_get(h, len, name, 1);
+}
+
+/* the value of the request header name, or "" */
+static const char *
+req_header(struct svec *headers, const char *name, size_t len)
+{
+	const char *h;
+	size_t i;
+
+	for (i = 0; headers != NULL && i < headers->len; ++i) {
+		h = headers->d[i].s;
+		if (strncasecmp(h, name, len) == 0 && h[len] == ':') {
+			for (h += len + 1; isspace((unsigned char)*h); ++h)
+				;
+			return h;
+		}
+	}
+	return "";
+}
+
+/* the values of the request headers named in vary, one per line */
+char *
+vary_values(const char *vary, struct svec *headers)
+{
+	const char *n, *e, *v;
+	char *s, *t;
+	size_t len, l;
+
+	if ((s = strdup("")) == NULL)
+		err(1, "strdup");
+	len = 0;
+
+	for (n = vary; *n != '\0'; n = e) {
+		while (*n == ',' || isspace((unsigned char)*n))
+			n++;
+		for (e = n; *e != '\0' && *e != ',' &&
+		    !isspace((unsigned char)*e); ++e)
+			;
+		if (e == n)
+			break;
+
+		v = req_header(headers, n, e - n);
+		l = strlen(v);
+		if ((t = realloc(s, len + l + 2)) == NULL)
+			err(1, "realloc");
+		s = t;
+		memcpy(s + len, v, l);
+		len += l;
+		s[len++] = '\n';
+		s[len] = '\0';
+	}
+
+	return s;
+}
+
+/* whether the Cache-Control cc has the directive name.  *val points to
+ * its value, or is NULL if it has none */
+static int
+cc_has(const char *cc, const char *name, const char **val)
+{
+	const char *p, *e;
+	size_t len;
+	int quoted;
+
+	len = strlen(name);
+	for (p = cc; *p != '\0'; p = e) {
+		while (*p == ',' || isspace((unsigned char)*p))
+			++p;
+		for (e = p; *e != '\0' && *e != '=' && *e != ',' &&
+		    !isspace((unsigned char)*e); ++e)
+			;
+		if ((size_t)(e - p) == len && !strncasecmp(p, name, len)) {
+			if (val != NULL)
+				*val = *e == '=' ? e + 1 : NULL;
+			return 1;
+		}
+
+		/* skip the value, that may be a quoted string */
+		for (quoted = 0; *e != '\0' && (quoted || *e != ','); ++e) {
+			if (*e == '"')
+				quoted = !quoted;
+			else if (*e == '\\' && quoted && e[1] != '\0')
+				++e;
+		}
+	}
+	return 0;
+}
+
+/* how long the response stays fresh, as per RFC 9111.  Return -1 if
+ * it mustn't be stored at all. */
+static time_t
+lifetime(const char *h, size_t len, time_t now)
+{
+	char *cc, *exp, *date, *lm, *age, *vary;
+	const char *v;
+	time_t t, d, life;
+	int nostore;
+
+	cc = hdr_list(h, len, "Cache-Control");
+	exp = hdr_value(h, len, "Expires");
+	date = hdr_value(h, len, "Date");
+	lm = hdr_value(h, len, "Last-Modified");
+	age = hdr_value(h, len, "Age");
+	vary = hdr_list(h, len, "Vary");
+
+	d = now;
+	if (date != NULL && (t = curl_getdate(date, NULL)) != -1)
+		d = t;
+
+	nostore = (cc != NULL && cc_has(cc, "no-store", NULL)) ||
+	    (vary != NULL && strchr(vary, '*') != NULL);
+
+	if (cc != NULL && cc_has(cc, "no-cache", NULL))
+		life = 0;
+	else if (cc != NULL && cc_has(cc, "max-age", &v) && v != NULL)
+		life = strtoll(v + (*v == '"'), NULL, 10);
+	else if (exp != NULL)
+		life = curl_getdate(exp, NULL) - d;
+	else if (lm != NULL && (t = curl_getdate(lm, NULL)) != -1 && t < d)
+		life = (d - t) / 10; /* heuristic freshness */
+	else
+		life = 0;
+
+	if (life > 0 && age != NULL)
+		life -= strtoll(age, NULL, 10);
+	if (life < 0)
+		life = 0;
+	if (nostore)
+		life = -1;
+
+	free(cc);
+	free(exp);
+	free(date);
+	free(lm);
+	free(age);
+	free(vary);
+	return life;
+}
+
+static void
+centry_free(struct centry *e)
+{
+	free(e->url);
+	free(e->vary);
+	free(e->varyval);
+	free(e->headers);
+	if (e->map != NULL)
+		munmap(e->map, e->maplen);
+	else
+		free(e->body);
+	free(e->etag);
+	free(e->lastmod);
+	free(e);
+}
+
+/* drop e from the cache.  Called with the lock held */
+static void
+evict(struct centry *e)
+{
+	TAILQ_REMOVE(&lru, e, entry);
+	used -= e->size;
+	if (e->refs == 0)
+		centry_free(e);
+	else
+		e->dead = 1;
+}
+
+/* make room for size bytes.  Called with the lock held */
+static void
+shrink(size_t size)
+{
+	struct centry *e;
+
+	while (used + size > settings.cache_size &&
+	    (e = TAILQ_LAST(&lru, centryq)) != NULL)
+		evict(e);
+}
+
+/* find the entry for url that matches the request headers and take a
+ * reference to it.  Return NULL if there's none. */
+struct centry *
+cache_lookup(const char *url, struct svec *headers)
+{
+	struct centry *e;
+	char *v;
+	int match;
+
+	pthread_mutex_lock(&mtx);
+	TAILQ_FOREACH(e, &lru, entry) {
+		if (strcmp(e->url, url) != 0)
+			continue;
+
+		v = vary_values(e->vary, headers);
+		match = strcmp(v, e->varyval) == 0;
+		free(v);
+		if (match)
+			break;
+	}
+
+	if (e != NULL) {
+		/* most recently used first */
+		TAILQ_REMOVE(&lru, e, entry);
+		TAILQ_INSERT_HEAD(&lru, e, entry);
+		e->refs++;
+	} else if ((e = dcache_load(url, headers)) != NULL) {
+		e->refs = 1;
+		if (e->size <= settings.cache_size) {
+			shrink(e->size);
+			TAILQ_INSERT_HEAD(&lru, e, entry);
+			used += e->size;
+		} else
+			e->dead = 1;	/* only for this request */
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return e;
+}
+
+int
+cache_fresh(struct centry *e)
+{
+	return time(NULL) < e->expires;
+}
+
+void
+cache_release(struct centry *e)
+{
+	pthread_mutex_lock(&mtx);
+	if (--e->refs == 0 && e->dead)
+		centry_free(e);
+	pthread_mutex_unlock(&mtx);
+}
+
+/* store a 200 response, replacing the previous entry for the same
+ * request if any */
+void
+cache_store(const char *url, struct svec *headers, long code,
+    const char *h, size_t hlen, const char *body, size_t blen)
+{
+	struct centry *e, *old;
+	time_t now, life;
+
+	if (code != 200)
+		return;
+
+	now = time(NULL);
+	if ((life = lifetime(h, hlen, now)) == -1)
+		return;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		err(1, "calloc");
+	e->url = xstrndup(url, strlen(url));
+	e->code = code;
+	e->headers = xstrndup(h, hlen);
+	e->hlen = hlen;
+	e->body = xstrndup(body != NULL ? body : "", blen);
+	e->blen = blen;
+	e->etag = hdr_value(h, hlen, "ETag");
+	e->lastmod = hdr_value(h, hlen, "Last-Modified");
+	e->expires = now + life;
+
+	/* nothing to gain from keeping it */
+	if (life == 0 && e->etag == NULL && e->lastmod == NULL) {
+		centry_free(e);
+		return;
+	}
+
+	if ((e->vary = hdr_list(h, hlen, "Vary")) == NULL)
+		e->vary = xstrndup("", 0);
+	e->varyval = vary_values(e->vary, headers);
+	e->size = sizeof(*e) + strlen(url) + hlen + blen;
+	e->doff = -1;
+
+	dcache_store(e);
+
+	pthread_mutex_lock(&mtx);
+	if (e->size > settings.cache_size) {
+		pthread_mutex_unlock(&mtx);
+		centry_free(e);
+		return;
+	}
+
+	TAILQ_FOREACH(old, &lru, entry) {
+		if (!strcmp(old->url, e->url) &&
+		    !strcmp(old->varyval, e->varyval)) {
+			evict(old);
+			break;
+		}
+	}
+
+	shrink(e->size);
+	TAILQ_INSERT_HEAD(&lru, e, entry);
+	used += e->size;
+	pthread_mutex_unlock(&mtx);
+}
+
+/* update the freshness of e after a 304 */
+void
+cache_refresh(struct centry *e, const char *h, size_t hlen)
+{
+	time_t now, life;
+
+	now = time(NULL);
+	if ((life = lifetime(h, hlen, now)) == -1)
+		life = 0;
+
+	pthread_mutex_lock(&mtx);
+	e->expires = now + life;
+	pthread_mutex_unlock(&mtx);
+
+	dcache_refresh(e);
+}
+
+void
+cache_count(int what)
+{
+	pthread_mutex_lock(&mtx);
+	switch (what) {
+	case CACHE_HIT:
+		hits++;
+		break;
+	case CACHE_REVALIDATED:
+		revalidated++;
+		break;
+	case CACHE_MISS:
+		misses++;
+		break;
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+/* called when settings.cache_size changes */
+void
+cache_resize(void)
+{
+	pthread_mutex_lock(&mtx);
+	shrink(0);
+	pthread_mutex_unlock(&mtx);
+}
+
+void
+cache_show(void)
+{
+	struct centry *e;
+	size_t n;
+
+	pthread_mutex_lock(&mtx);
+	n = 0;
+	TAILQ_FOREACH(e, &lru, entry)
+		n++;
+	printf("%zu hits, %zu revalidated, %zu misses, "
+	    "%zu entries, %zu/%zu bytes\n", hits, revalidated, misses,
+	    n, used, settings.cache_size);
+	pthread_mutex_unlock(&mtx);
+
+	dcache_show();
+}
+
+int
+cache_enabled(void)
+{
+	return settings.cache_size != 0 || dcache_enabled();
+}
+
+/* the biggest response worth keeping */
+size_t
+cache_max(void)
+{
+	return dcache_enabled() ? SIZE_MAX : settings.cache_size;
+}
@@ -17,8 +17,11 @@
 #include "crest.h"
 
 #include <err.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 struct svec *headers;
 #define HPUSH(h, v, d)                                                       \
@@ -32,53 +35,31 @@ struct svec *headers;
 
 struct settings settings;
 
-/* wrapper around imsg_compose to send a message to the child.  It will
- * implicitly write */
-void
-csend(struct imsgbuf *ibuf, int type, const void *ptr, size_t len)
-{
-	ssize_t n;
+/* the handle used in single-process mode */
+CURL *easy;
 
-	imsg_compose(ibuf, type, 0, 0, -1, ptr, len);
+/* used by the pool to reply to the parent */
+static struct writer wr;
 
-	/* retry on errno == EAGAIN? */
-	if ((n = msgbuf_write(&ibuf->w)) == -1)
-		err(1, "msgbuf_write");
-	if (n == 0)
-		errx(1, "child vanished");
-}
+/* the index of the disk cache, waiting for the segment */
+static int cache_idx = -1;
 
 static void
-child_do_req(struct imsgbuf *ibuf, struct req *req)
+print_ms(long ms)
 {
-	ssize_t n;
-	struct resp r;
-
-	if (!do_req(req, &r, headers)) {
-		const char *err = "failed";
-		n = strlen(err);
-		imsg_compose(ibuf, IMSG_ERR, 0, 0, -1, err, n);
-	} else {
-		if (r.hlen >= UINT16_MAX || r.blen >= UINT16_MAX)
-			errx(1, "response headers or body too big.");
-		imsg_compose(ibuf, IMSG_STATUS, 0, 0, -1, &r.http_code,
-			sizeof(r.http_code));
-		imsg_compose(ibuf, IMSG_HEAD, 0, 0, -1, r.headers, r.hlen);
-		imsg_compose(ibuf, IMSG_BODY, 0, 0, -1, r.body, r.blen);
-	}
+	if (ms == 0)
+		puts("off");
+	else
+		printf("%ldms\n", ms);
+}
 
-	/* retry on errno == EAGAIN? */
-	if ((n = msgbuf_write(&ibuf->w)) == -1)
-		err(1, "msgbuf_write");
+static void
+print_size(long n)
+{
 	if (n == 0)
-		errx(1, "parent vanished");
-
-	if (r.headers != NULL)
-		free(r.headers);
-	if (r.body != NULL)
-		free(r.body);
-	if (r.err != NULL)
-		free(r.body);
+		puts("default");
+	else
+		printf("%ld\n", n);
 }
 
 static void
@@ -108,6 +89,11 @@ show(enum imsg_type t)
 			printf("%s\n", settings.prefix.s);
 		break;
 
+	case IMSG_SET_UNIX_SOCKET:
+		if (settings.unix_socket.s != NULL)
+			printf("%s\n", settings.unix_socket.s);
+		break;
+
 	case IMSG_SET_HTTPVER:
 		printf("%s\n", httpver2str(settings.http_version));
 		break;
@@ -124,188 +110,566 @@ show(enum imsg_type t)
 			puts("true");
 		break;
 
-	default:
-		errx(1, "unknown show %d", t);
-	}
-}
+	case IMSG_SHOW_QUEUE:
+		printf("%zu bytes queued (peak %zu, high-water mark %zu), "
+		    "%zu coalesced, %zu retried\n", writer_queued(&wr),
+		    wr.peak, wr.hwm, pool_coalesced(), retried());
+		break;
 
-/* return 1 only on IMSG_EXIT */
-static int
-process_messages(struct imsgbuf *ibuf, struct req *req)
-{
-	struct imsg imsg;
-	ssize_t n;
-	size_t datalen;
-	int done;
+	case IMSG_SET_CACHE_SIZE:
+		printf("%zu\n", settings.cache_size);
+		break;
 
-	poll_read(ibuf->fd);
+	case IMSG_SHOW_CACHE:
+		cache_show();
+		break;
 
-	/* retry on errno == EAGAIN */
-	if ((n = imsg_read(ibuf)) == -1)
-		err(1, "imsg_read");
-	if (n == 0)
-		errx(1, "connection closed");
+	case IMSG_SET_CACHE_DIR:
+		if (settings.cache_dir.s != NULL)
+			printf("%s\n", settings.cache_dir.s);
+		break;
 
-	done = 0;
-	for (; !done;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
-			err(1, "imsg_get");
+	case IMSG_SET_RETRY:
+		if (settings.retry.max == 0) {
+			puts("off");
+			break;
+		}
+		printf("%d backoff %ldms..%ldms%s\n", settings.retry.max,
+		    settings.retry.min, settings.retry.cap,
+		    settings.retry.all ? " all" : "");
+		break;
 
-		if (n == 0) /* no more messages */
-			return 0;
+	case IMSG_SET_HEDGE:
+		hedge_show();
+		break;
 
-		datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+	case IMSG_SET_TIMEOUT:
+		print_ms(settings.to.total);
+		break;
 
-		switch (imsg.hdr.type) {
-		case IMSG_EXIT:
-			done = 1;
-			break;
+	case IMSG_SET_CONNECT_TIMEOUT:
+		print_ms(settings.to.connect);
+		break;
 
-		case IMSG_SET_METHOD:
-			if (datalen < sizeof(req->method))
-				err(1, "IMSG_SET_METHOD wrong size");
-			memcpy(&req->method, imsg.data, sizeof(req->method));
-			break;
+	case IMSG_SET_LOW_SPEED:
+		if (settings.to.low_speed == 0)
+			puts("off");
+		else
+			printf("%ld/%ldms\n", settings.to.low_speed,
+			    settings.to.low_time);
+		break;
 
-		case IMSG_SET_URL:
-			req->path = calloc(datalen + 1, 1);
-			if (req->path == NULL)
-				err(1, "calloc");
-			memcpy(req->path, imsg.data, datalen);
-			break;
+	case IMSG_SET_STRATEGY:
+		mux_show();
+		break;
 
-		case IMSG_SET_PAYLOAD:
-			if (datalen == 0) {
-				req->payload = NULL;
-				break;
-			}
+	case IMSG_SET_MAX_STREAMS:
+		if (settings.max_streams == 0)
+			puts("default");
+		else
+			printf("%ld\n", settings.max_streams);
+		break;
 
-			req->payload = calloc(datalen + 1, 1);
-			if (req->payload == NULL)
-				err(1, "calloc");
-			memcpy(req->payload, imsg.data, datalen);
-			break;
+	case IMSG_SET_MAX_HOST_CONNS:
+		if (settings.max_host_conns == 0)
+			puts("unlimited");
+		else
+			printf("%ld\n", settings.max_host_conns);
+		break;
 
-		case IMSG_DO_REQ:
-			child_do_req(ibuf, req);
+	case IMSG_SET_RESOLVE:
+		resolve_show();
+		break;
 
-			free(req->path);
-			if (req->payload != NULL)
-				free(req->payload);
-			req->path = req->payload = NULL;
+	case IMSG_SET_DNS_TTL:
+		if (settings.dns_ttl == -1)
+			puts("forever");
+		else
+			print_ms(settings.dns_ttl);
+		break;
 
-			break;
+	case IMSG_SET_NODELAY:
+		puts(settings.tune.nodelay ? "on" : "off");
+		break;
 
-		case IMSG_SET_UA: {
-			char *h;
-			if ((h = calloc(datalen + 1, 1)) == NULL)
-				err(1, "calloc");
-			memcpy(h, imsg.data, datalen);
-			UPDATE_STR(settings.useragent, h, 1);
-			break;
-		}
+	case IMSG_SET_KEEPALIVE:
+		if (settings.tune.keepidle == 0)
+			puts("off");
+		else
+			printf("%lds/%lds\n", settings.tune.keepidle,
+			    settings.tune.keepintvl);
+		break;
 
-		case IMSG_SET_PREFIX: {
-			char *h;
-			if (datalen == 0) {
-				/* delete the prefix */
-				UPDATE_STR(settings.prefix, NULL, 0);
-				break;
-			}
+	case IMSG_SET_FASTOPEN:
+		puts(settings.tune.fastopen ? "on" : "off");
+		break;
 
-			if ((h = calloc(datalen + 1, 1)) == NULL)
-				err(1, "calloc");
-			memcpy(h, imsg.data, datalen);
-			UPDATE_STR(settings.prefix, h, 1);
-			break;
-		}
+	case IMSG_SET_BUFFERSIZE:
+		print_size(settings.tune.bufsize);
+		break;
 
-		case IMSG_SET_HTTPVER: {
-			if (datalen != sizeof(settings.http_version))
-				errx(1, "http_version: size mismatch");
-			memcpy(&settings.http_version, imsg.data, datalen);
-			break;
-		}
+	case IMSG_SET_UPLOAD_BUFSIZE:
+		print_size(settings.tune.upbufsize);
+		break;
 
-		case IMSG_SET_PORT: {
-			if (datalen != sizeof(settings.port))
-				errx(1, "port: size mismatch");
-			memcpy(&settings.port, imsg.data, datalen);
-			if (settings.port == -1 && settings.port < 0
-				&& settings.port > 65535)
-				errx(1, "invalid port number %ld",
-					settings.port);
+	case IMSG_SET_RCVBUF:
+		print_size(settings.tune.rcvbuf);
+		break;
+
+	default:
+		errx(1, "unknown show %d", t);
+	}
+}
+
+/* close the connections, for the settings used when they're made */
+static void
+reconnect(void)
+{
+	if (easy != NULL) {
+		http_fini();
+		curl_easy_cleanup(easy);
+		if ((easy = curl_easy_init()) == NULL)
+			errx(1, "curl_easy_init failed");
+	}
+	pool_reconnect();
+}
+
+/* handle a single message.  ibuf is NULL when called directly by the
+ * parent in single-process mode: in that case no reply is sent.  Return
+ * 1 only on IMSG_EXIT */
+int
+child_dispatch(struct imsgbuf *ibuf, struct req *req, int type,
+    const void *data, size_t datalen)
+{
+	switch (type) {
+	case IMSG_EXIT:
+		return 1;
+
+	case IMSG_SET_METHOD:
+		if (datalen < sizeof(req->method))
+			err(1, "IMSG_SET_METHOD wrong size");
+		memcpy(&req->method, data, sizeof(req->method));
+		break;
+
+	case IMSG_SET_URL:
+		req->path = calloc(datalen + 1, 1);
+		if (req->path == NULL)
+			err(1, "calloc");
+		memcpy(req->path, data, datalen);
+		break;
+
+	case IMSG_SET_PAYLOAD:
+		if (datalen == 0) {
+			req->payload = NULL;
 			break;
 		}
 
-		case IMSG_SET_PEER_VERIF: {
-			if (datalen
-				!= sizeof(settings.skip_peer_verification))
-				errx(1,
-					"skip_peer_verification: size "
-					"mismatch");
-			memcpy(&settings.skip_peer_verification, imsg.data,
-				datalen);
+		req->payload = calloc(datalen + 1, 1);
+		if (req->payload == NULL)
+			err(1, "calloc");
+		memcpy(req->payload, data, datalen);
+		break;
+
+	case IMSG_DO_REQ:
+		if (datalen == sizeof(int))
+			memcpy(&req->alone, data, datalen);
+		pool_submit(req);
+		break;
+
+	case IMSG_SET_UA: {
+		char *h;
+		if ((h = calloc(datalen + 1, 1)) == NULL)
+			err(1, "calloc");
+		memcpy(h, data, datalen);
+		UPDATE_STR(settings.useragent, h, 1);
+		break;
+	}
+
+	case IMSG_SET_PREFIX: {
+		char *h;
+		if (datalen == 0) {
+			/* delete the prefix */
+			UPDATE_STR(settings.prefix, NULL, 0);
 			break;
 		}
 
-		case IMSG_SHOW:
-			show(*(enum imsg_type *)imsg.data);
-			csend(ibuf, IMSG_DONE, NULL, 0);
-			break;
+		if ((h = calloc(datalen + 1, 1)) == NULL)
+			err(1, "calloc");
+		memcpy(h, data, datalen);
+		UPDATE_STR(settings.prefix, h, 1);
+		break;
+	}
+
+	case IMSG_SET_UNIX_SOCKET: {
+		char *h;
 
-		case IMSG_ADD: {
-			char *h;
+		if (datalen == 0)
+			UPDATE_STR(settings.unix_socket, NULL, 0);
+		else {
 			if ((h = calloc(datalen + 1, 1)) == NULL)
 				err(1, "calloc");
-			memcpy(h, imsg.data, datalen);
-			HPUSH(headers, h, 1);
-			break;
+			memcpy(h, data, datalen);
+			UPDATE_STR(settings.unix_socket, h, 1);
 		}
+		reconnect();
+		break;
+	}
+
+	case IMSG_SET_HTTPVER: {
+		if (datalen != sizeof(settings.http_version))
+			errx(1, "http_version: size mismatch");
+		memcpy(&settings.http_version, data, datalen);
+		break;
+	}
+
+	case IMSG_SET_PORT: {
+		if (datalen != sizeof(settings.port))
+			errx(1, "port: size mismatch");
+		memcpy(&settings.port, data, datalen);
+		if (settings.port == -1 && settings.port < 0
+			&& settings.port > 65535)
+			errx(1, "invalid port number %ld",
+				settings.port);
+		break;
+	}
 
-		case IMSG_DEL: {
-			char *hdr = (char *)imsg.data;
-			if (!svec_del(headers, hdr))
-				warnx("header \"%s\" not present", hdr);
-			csend(ibuf, IMSG_DONE, NULL, 0);
+	case IMSG_SET_PEER_VERIF: {
+		if (datalen
+			!= sizeof(settings.skip_peer_verification))
+			errx(1,
+				"skip_peer_verification: size "
+				"mismatch");
+		memcpy(&settings.skip_peer_verification, data,
+			datalen);
+		break;
+	}
+
+	case IMSG_SET_CACHE_SIZE:
+		if (datalen != sizeof(settings.cache_size))
+			errx(1, "cache_size: size mismatch");
+		memcpy(&settings.cache_size, data, datalen);
+		cache_resize();
+		break;
+
+	case IMSG_SET_CACHE_DIR: {
+		char *h;
+		if (datalen == 0) {
+			UPDATE_STR(settings.cache_dir, NULL, 0);
 			break;
 		}
 
-		default:
-			errx(1, "Unknown message type %d", imsg.hdr.type);
-		}
+		if ((h = calloc(datalen + 1, 1)) == NULL)
+			err(1, "calloc");
+		memcpy(h, data, datalen);
+		UPDATE_STR(settings.cache_dir, h, 1);
+		break;
+	}
 
-		imsg_free(&imsg);
+	case IMSG_CACHE_SEGMENT:
+		/* handled by process_messages */
+		break;
+
+	case IMSG_SET_RETRY:
+		if (datalen != sizeof(settings.retry))
+			errx(1, "retry: size mismatch");
+		memcpy(&settings.retry, data, datalen);
+		break;
+
+	case IMSG_SET_HEDGE:
+		if (datalen != sizeof(settings.hedge))
+			errx(1, "hedge: size mismatch");
+		memcpy(&settings.hedge, data, datalen);
+		break;
+
+	case IMSG_SET_TIMEOUT:
+		if (datalen != sizeof(settings.to.total))
+			errx(1, "timeout: size mismatch");
+		memcpy(&settings.to.total, data, datalen);
+		break;
+
+	case IMSG_SET_CONNECT_TIMEOUT:
+		if (datalen != sizeof(settings.to.connect))
+			errx(1, "connect-timeout: size mismatch");
+		memcpy(&settings.to.connect, data, datalen);
+		break;
+
+	case IMSG_SET_LOW_SPEED:
+		if (datalen != 2 * sizeof(long))
+			errx(1, "low-speed: size mismatch");
+		memcpy(&settings.to.low_speed, data, sizeof(long));
+		memcpy(&settings.to.low_time, (const long *)data + 1,
+		    sizeof(long));
+		break;
+
+	case IMSG_SET_STRATEGY:
+		if (datalen != sizeof(settings.strategy))
+			errx(1, "strategy: size mismatch");
+		memcpy(&settings.strategy, data, datalen);
+		mux_reconf();
+		break;
+
+	case IMSG_SET_MAX_STREAMS:
+		if (datalen != sizeof(settings.max_streams))
+			errx(1, "max-streams: size mismatch");
+		memcpy(&settings.max_streams, data, datalen);
+		mux_reconf();
+		break;
+
+	case IMSG_SET_MAX_HOST_CONNS:
+		if (datalen != sizeof(settings.max_host_conns))
+			errx(1, "max-host-connections: size mismatch");
+		memcpy(&settings.max_host_conns, data, datalen);
+		mux_reconf();
+		break;
+
+	case IMSG_SET_RESOLVE:
+		resolve_set(datalen != 0 ? data : NULL, datalen);
+
+		/* or the connections to the old addresses are reused */
+		reconnect();
+		break;
+
+	case IMSG_SET_DNS_TTL:
+		if (datalen != sizeof(settings.dns_ttl))
+			errx(1, "dns-cache-ttl: size mismatch");
+		memcpy(&settings.dns_ttl, data, datalen);
+		break;
+
+	case IMSG_SET_NODELAY:
+		if (datalen != sizeof(settings.tune.nodelay))
+			errx(1, "tcp-nodelay: size mismatch");
+		memcpy(&settings.tune.nodelay, data, datalen);
+		reconnect();
+		break;
+
+	case IMSG_SET_KEEPALIVE:
+		if (datalen != 2 * sizeof(long))
+			errx(1, "tcp-keepalive: size mismatch");
+		memcpy(&settings.tune.keepidle, data, sizeof(long));
+		memcpy(&settings.tune.keepintvl, (const long *)data + 1,
+		    sizeof(long));
+		reconnect();
+		break;
+
+	case IMSG_SET_FASTOPEN:
+		if (datalen != sizeof(settings.tune.fastopen))
+			errx(1, "tcp-fastopen: size mismatch");
+		memcpy(&settings.tune.fastopen, data, datalen);
+		reconnect();
+		break;
+
+	case IMSG_SET_BUFFERSIZE:
+		if (datalen != sizeof(settings.tune.bufsize))
+			errx(1, "buffer-size: size mismatch");
+		memcpy(&settings.tune.bufsize, data, datalen);
+		break;
+
+	case IMSG_SET_UPLOAD_BUFSIZE:
+		if (datalen != sizeof(settings.tune.upbufsize))
+			errx(1, "upload-buffer-size: size mismatch");
+		memcpy(&settings.tune.upbufsize, data, datalen);
+		break;
+
+	case IMSG_SET_RCVBUF:
+		if (datalen != sizeof(settings.tune.rcvbuf))
+			errx(1, "so-rcvbuf: size mismatch");
+		memcpy(&settings.tune.rcvbuf, data, datalen);
+		reconnect();
+		break;
+
+	case IMSG_SET_RECORD:
+		if (datalen != sizeof(settings.record))
+			errx(1, "record: size mismatch");
+		memcpy(&settings.record, data, datalen);
+		break;
+
+	case IMSG_WARM:
+		warm(data, datalen);
+		if (ibuf != NULL)
+			pool_done(NULL, 0);
+		break;
+
+	case IMSG_REQ_TIMEOUTS:
+		if (datalen != sizeof(req->to))
+			errx(1, "timeouts: size mismatch");
+		memcpy(&req->to, data, datalen);
+		req->has_to = 1;
+		break;
+
+	case IMSG_SHOW:
+		show(*(const enum imsg_type *)data);
+		fflush(stdout);
+		if (ibuf != NULL)
+			pool_done(NULL, 0);
+		break;
+
+	case IMSG_ADD: {
+		char *h;
+		if ((h = calloc(datalen + 1, 1)) == NULL)
+			err(1, "calloc");
+		memcpy(h, data, datalen);
+		HPUSH(headers, h, 1);
+		break;
 	}
 
-	return 1;
+	case IMSG_DEL: {
+		const char *hdr = data;
+		int found;
+
+		/* let the parent complain, or we'd get a warning for
+		 * every worker */
+		found = svec_del(headers, hdr);
+		if (ibuf != NULL)
+			pool_done(&found, sizeof(found));
+		else if (!found)
+			warnx("header \"%s\" not present", hdr);
+		break;
+	}
+
+	default:
+		errx(1, "Unknown message type %d", type);
+	}
+
+	return 0;
 }
 
-int
-child_main(struct imsgbuf *ibuf)
+/* return 1 if the message is about the next request (or exiting) and
+ * so doesn't touch the shared settings */
+static int
+builds_req(int type)
 {
-	struct req req;
+	switch (type) {
+	case IMSG_EXIT:
+	case IMSG_SET_METHOD:
+	case IMSG_SET_URL:
+	case IMSG_SET_PAYLOAD:
+	case IMSG_REQ_TIMEOUTS:
+	case IMSG_DO_REQ:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	memset(&req, 0, sizeof(struct req));
+/* return 1 only on IMSG_EXIT */
+static int
+process_messages(struct imsgbuf *ibuf, struct req *req)
+{
+	struct imsg imsg;
+	ssize_t n;
+	size_t datalen;
+	int done, locked;
+
+	poll_read(ibuf->fd);
+
+	/* the socket is non-blocking because of the writer */
+	if ((n = imsg_read(ibuf)) == -1) {
+		if (errno == EAGAIN)
+			return 0;
+		err(1, "imsg_read");
+	}
+	if (n == 0)
+		errx(1, "connection closed");
+
+	done = 0;
+	for (; !done;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			err(1, "imsg_get");
+
+		if (n == 0) /* no more messages */
+			return 0;
+
+		datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+
+		/* the replies are tagged with the id of the request */
+		if (imsg.hdr.type == IMSG_DO_REQ)
+			req->id = imsg.hdr.peerid;
+
+		/* the workers read the settings and the headers while
+		 * performing the requests */
+		locked = !builds_req(imsg.hdr.type);
+		if (locked)
+			pool_wrlock();
+
+		/* the files of the disk cache come with these */
+		if (imsg.hdr.type == IMSG_SET_CACHE_DIR)
+			cache_idx = imsg.fd;
+		else if (imsg.hdr.type == IMSG_CACHE_SEGMENT)
+			dcache_open(cache_idx, imsg.fd);
 
+		done = child_dispatch(ibuf, req, imsg.hdr.type, imsg.data,
+		    datalen);
+		if (locked)
+			pool_unlock();
+
+		imsg_free(&imsg);
+	}
+
+	return 1;
+}
+
+void
+child_init(void)
+{
 	memset(&settings, 0, sizeof(struct settings));
 	settings.bufsize = 256 * 1024; /* 256 kb */
 	settings.useragent = LITERAL_STR("cREST/0.1");
 	settings.http_version = CURL_HTTP_VERSION_2TLS;
 	settings.port = -1;
+	settings.dns_ttl = 60 * 1000;
+	settings.tune.nodelay = 1;
 
 	headers = NULL;
 
+	/* so the children don't retry in lockstep */
+	srandom(getpid() ^ time(NULL));
+
 	curl_global_init(CURL_GLOBAL_DEFAULT);
+	warm_init();
 
-	while (!process_messages(ibuf, &req))
-		; /* no op */
+	if (single_process && (easy = curl_easy_init()) == NULL)
+		errx(1, "curl_easy_init failed");
+}
+
+void
+child_fini(void)
+{
+	/* drop the cache */
+	settings.cache_size = 0;
+	cache_resize();
+	dcache_open(-1, -1);
 
 	svec_free(headers);
+	headers = NULL;
+	http_fini();
+	if (easy != NULL)
+		curl_easy_cleanup(easy);
+	easy = NULL;
+	warm_fini();
 	curl_global_cleanup();
 
 	FREE_STR(settings.useragent);
 	FREE_STR(settings.prefix);
+	FREE_STR(settings.unix_socket);
+	FREE_STR(settings.cache_dir);
+}
+
+int
+child_main(struct imsgbuf *ibuf)
+{
+	struct req req;
+
+	memset(&req, 0, sizeof(struct req));
+
+	child_init();
+	writer_init(&wr, ibuf, WRITER_HWM);
+	pool_start(&wr, nthreads);
+
+	while (!process_messages(ibuf, &req))
+		; /* no op */
+
+	pool_stop();
+	child_fini();
 
 	return 0;
 }
@@ -22,6 +22,8 @@
 #include <curl/curl.h>
 #include <sys/types.h>
 
+#include <stdatomic.h>
+
 enum imsg_type {
 
 	/* parent -> child
@@ -41,7 +43,8 @@ enum imsg_type {
 	IMSG_SET_PAYLOAD,
 
 	/* parent -> child
-	 * tell the child to perform the request */
+	 * tell the child to perform the request.  It may come with a
+	 * non-zero int if the request mustn't be coalesced */
 	IMSG_DO_REQ,
 
 	/* parent <- child
@@ -88,6 +91,106 @@ enum imsg_type {
 
 	/* parent <- child */
 	IMSG_DONE,
+
+	/* parent <- child
+	 * end of the response: the headers and the body may be split
+	 * across more than one message */
+	IMSG_END,
+
+	/* parent -> child
+	 * only for show: the writer queue */
+	IMSG_SHOW_QUEUE,
+
+	/* parent <- child
+	 * return the timing of the request */
+	IMSG_TIMING,
+
+	/* parent -> child */
+	IMSG_SET_CACHE_SIZE,
+
+	/* parent -> child
+	 * only for show: the cache statistics */
+	IMSG_SHOW_CACHE,
+
+	/* parent -> child
+	 * the path of the cache directory, with the index file */
+	IMSG_SET_CACHE_DIR,
+
+	/* parent -> child
+	 * the segment file of the cache directory */
+	IMSG_CACHE_SEGMENT,
+
+	/* parent -> child */
+	IMSG_SET_RETRY,
+
+	/* parent -> child */
+	IMSG_SET_HEDGE,
+
+	/* parent -> child */
+	IMSG_SET_TIMEOUT,
+
+	/* parent -> child */
+	IMSG_SET_CONNECT_TIMEOUT,
+
+	/* parent -> child
+	 * the minimum speed and for how long it can be lower */
+	IMSG_SET_LOW_SPEED,
+
+	/* parent -> child
+	 * the timeouts of the next request, if they're overridden */
+	IMSG_REQ_TIMEOUTS,
+
+	/* parent -> child */
+	IMSG_SET_STRATEGY,
+
+	/* parent -> child */
+	IMSG_SET_MAX_STREAMS,
+
+	/* parent -> child */
+	IMSG_SET_MAX_HOST_CONNS,
+
+	/* parent -> child
+	 * connect to the given hosts, or to the prefix */
+	IMSG_WARM,
+
+	/* parent -> child
+	 * a host:port:addr to pin, or nothing to drop them all */
+	IMSG_SET_RESOLVE,
+
+	/* parent -> child */
+	IMSG_SET_DNS_TTL,
+
+	/* parent -> child */
+	IMSG_SET_NODELAY,
+
+	/* parent -> child
+	 * the idle time and the interval in seconds, or zeros */
+	IMSG_SET_KEEPALIVE,
+
+	/* parent -> child */
+	IMSG_SET_FASTOPEN,
+
+	/* parent -> child */
+	IMSG_SET_BUFFERSIZE,
+
+	/* parent -> child */
+	IMSG_SET_UPLOAD_BUFSIZE,
+
+	/* parent -> child */
+	IMSG_SET_RCVBUF,
+
+	/* parent -> child
+	 * the path, or nothing to go back to TCP */
+	IMSG_SET_UNIX_SOCKET,
+
+	/* parent -> child
+	 * an int: whether to describe the requests with IMSG_REQ_INFO */
+	IMSG_SET_RECORD,
+
+	/* parent <- child
+	 * the url, a NUL and the request headers, before the end of the
+	 * response */
+	IMSG_REQ_INFO,
 };
 
 enum http_methods {
@@ -102,16 +205,62 @@ enum http_methods {
 	TRACE,
 };
 
+/* in milliseconds and bytes per second, 0 disables them */
+struct timeouts {
+	long connect;
+	long total;
+	long low_speed;
+	long low_time;	/* how long it can go below low_speed */
+};
+
+/* the knobs of the sockets and of curl's buffers */
+struct tuning {
+	int	nodelay;
+	long	keepidle;	/* in seconds, 0 is off */
+	long	keepintvl;
+	int	fastopen;
+	long	bufsize;	/* curl's, 0 for the default */
+	long	upbufsize;
+	long	rcvbuf;		/* SO_RCVBUF, 0 for the kernel's */
+};
+
 struct req {
+	uint32_t id;	/* in the peerid of every message about it */
 	enum http_methods method;
 	char *path;
 	char *payload;
+	int has_to;		/* the fields of to not -1 override the
+				 * settings */
+	struct timeouts to;
+	int alone;		/* never coalesce it with another */
+};
+
+/* send count requests every per milliseconds for dur milliseconds */
+struct rate {
+	long count;
+	long per;
+	long dur;
 };
 
 struct setopt {
 	enum	 imsg_type set;
 	void	*value;
 	size_t	 len;
+	int	 dirty;	/* value was malloc'ed */
+};
+
+/* bind the value at path in the last body to the variable name */
+struct extract {
+	const char	*name;
+	size_t		 nlen;
+	const char	*path;
+};
+
+/* record to path, or stop if it's NULL */
+struct record {
+	const char	*path;
+	int		 zstd;
+	int		 show;	/* only print the status */
 };
 
 enum special_cmd_type {
@@ -128,19 +277,99 @@ struct cmd {
 		CMD_ADD,
 		CMD_DEL,
 		CMD_SPECIAL,
+		CMD_RATE,	/* the request is in req */
+		CMD_WARM,
+		CMD_EXTRACT,
+		CMD_RECORD,
+		CMD_FORMAT,	/* the parent's own, never sent */
 	} type;
+	struct rate rate;
 	union {
 		struct req req;
 		struct setopt opt;
 		enum imsg_type show;
 		const char *hdrname;
+		const char *hosts;
+		struct extract ext;
+		struct record rec;
+		int format;	/* FORMAT_*, or -1 to show it */
 		enum special_cmd_type sp;
 	};
 };
 
+/* in microseconds since the start of the request */
+struct timing {
+	curl_off_t	dns;
+	curl_off_t	connect;
+	curl_off_t	tls;
+	curl_off_t	ttfb;	/* time to first byte */
+	curl_off_t	total;
+	long		attempts;	/* 1 if it wasn't retried */
+};
+
+/* the log of record, see record.c.  The fields are in little endian */
+#define REC_MAGIC	"CRESTREC"
+#define REC_VERSION	1
+#define REC_ZSTD	0x1	/* the data is compressed */
+#define REC_NFIELDS	6
+
+struct rec_file {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	flags;
+};
+
+struct rec_hdr {
+	uint32_t	len;	/* of the rest of the record */
+	uint32_t	flags;
+	uint64_t	at;	/* when it was sent, in us since the epoch */
+	int64_t		status;
+	int64_t		dns, connect, tls, ttfb, total;	/* as in timing */
+	int64_t		attempts;
+	uint32_t	method;
+	uint32_t	zlen;	/* of the data, with REC_ZSTD */
+	/* url, request headers, payload, headers, body and error */
+	uint32_t	lens[REC_NFIELDS];
+};
+
+#define REC_HDRSIZE	sizeof(struct rec_hdr)
+
+/* a log of record being read */
+struct reclog {
+	char	*map;
+	size_t	 len;
+	size_t	 off;
+	char	*buf;	/* the data of the last record, decompressed */
+	size_t	 bufsz;
+};
+
+/* a record, with the data still in the log */
+struct recent {
+	uint32_t	 flags;
+	uint64_t	 at;
+	long		 status;
+	struct timing	 timing;
+	int		 method;
+	size_t		 lens[REC_NFIELDS];
+	const char	*fields[REC_NFIELDS];
+};
+
+#define HIST_SUBBITS	4
+#define HIST_SUB	(1 << HIST_SUBBITS)
+#define HIST_MAXEXP	40	/* about 12 days in microseconds */
+#define HIST_BUCKETS	(HIST_SUB * (HIST_MAXEXP - HIST_SUBBITS + 1) + 1)
+
+struct hist {
+	_Atomic uint64_t	b[HIST_BUCKETS];
+	_Atomic uint64_t	n;
+	_Atomic uint64_t	max;
+};
+
 struct resp {
 	long	http_code;
 
+	struct timing timing;
+
 	size_t	 hlen;
 	char	*headers;
 
@@ -149,6 +378,9 @@ struct resp {
 
 	size_t	 errlen;
 	char	*err;
+
+	size_t	 ilen;
+	char	*info;	/* as in IMSG_REQ_INFO, while recording */
 };
 
 struct str {
@@ -175,37 +407,194 @@ struct svec {
 	struct str *d;
 };
 
+/* a response being received by curl's callbacks, see http.c */
+struct write_result {
+	char *data;
+	size_t pos;
+	size_t size;
+	CURL *curl;
+	struct sink *sink;
+	size_t start;		/* of the last block of headers */
+	int eob;		/* the last line ended a block */
+	struct centry *stale;	/* being revalidated */
+	int fill;		/* keep the body for the cache too */
+	int retry;		/* this attempt can be retried */
+	int sent;		/* the headers went to the sink */
+	struct race *race;	/* when hedged */
+	int copy;		/* 0 for the first copy, 1 for the hedge */
+	curl_off_t late;	/* how long after the first it started */
+};
+
+/* receives a response while it's being transferred.  The callbacks
+ * may block to slow down the transfer, but in the multiplexer, where
+ * that would stall the other transfers too, body returns 0 instead:
+ * the transfer is paused and the same data comes again once it's
+ * resumed.  nap sleeps between two attempts, letting the settings
+ * change, and returns 1 if they did. */
+struct sink {
+	void	*arg;
+	void	(*head)(void*, long, const char*, size_t);
+	int	(*body)(void*, const char*, size_t);
+	int	(*nap)(void*, long);
+};
+
+struct centry {
+	TAILQ_ENTRY(centry) entry;
+	char		*url;
+	char		*vary;		/* the Vary of the response */
+	char		*varyval;	/* the values of those headers */
+	long		 code;
+	char		*headers;
+	size_t		 hlen;
+	char		*body;
+	size_t		 blen;
+	char		*etag;
+	char		*lastmod;
+	time_t		 expires;
+	size_t		 size;
+	int		 refs;
+	int		 dead;		/* evicted while in use */
+	int64_t		 doff;		/* in the disk cache, or -1 */
+	void		*map;		/* the body, if mmap'ed */
+	size_t		 maplen;
+};
+
+enum {
+	CACHE_HIT,
+	CACHE_REVALIDATED,
+	CACHE_MISS,
+};
+
+/* default high-water mark for the writers */
+#define WRITER_HWM (1024 * 1024)
+
+struct writer {
+	struct imsgbuf	*ibuf;
+	_Atomic size_t	 queued;	/* bytes not yet written */
+	size_t		 peak;
+	size_t		 hwm;		/* high-water mark */
+};
+
+/* max number of child processes */
+#define MAX_WORKERS 64
+
+/* max number of threads for every child */
+#define MAX_THREADS 64
+
+struct worker {
+	pid_t		 pid;
+	struct imsgbuf	 ibuf;
+	struct writer	 wr;
+	int		 load;	/* requests in flight */
+	int		 done;	/* IMSG_DONE received */
+	int		 ret;	/* value of the last IMSG_DONE */
+};
+
+/* the retry policy, the delays are in milliseconds */
+struct retry {
+	int	max;	/* how many times, 0 disables it */
+	long	min;
+	long	cap;
+	int	all;	/* retry also the non-idempotent methods */
+};
+
+/* when to send a second copy of a GET that's taking too long: after a
+ * percentile of the time to first byte seen so far, or after a fixed
+ * delay.  Both 0 disables it */
+struct hedge {
+	int	pct;	/* in thousandths */
+	long	delay;	/* in milliseconds */
+};
+
+/* how the parent prints the bodies */
+enum {
+	FORMAT_RAW,
+	FORMAT_JSON,	/* pretty-printed, if it looks like JSON */
+};
+
+/* how the requests in flight to the same host use the connections */
+enum {
+	STRATEGY_MULTIPLEX,	/* as streams of the same connection */
+	STRATEGY_SPREAD,	/* one connection each */
+};
+
 struct settings {
-	size_t bufsize;
+	size_t bufsize;		/* of crest's buffer for the response */
 	struct str useragent;
 	struct str prefix;
 	long http_version;
 	long port; /* it's -1 or uint16_t in reality */
 	int skip_peer_verification;
+	size_t cache_size; /* 0 disables the cache */
+	struct str cache_dir; /* only for show */
+	struct retry retry;
+	struct hedge hedge;
+	struct timeouts to;
+	int strategy;
+	long max_streams;	/* per connection, 0 for curl's default */
+	long max_host_conns;	/* 0 means no limit */
+	struct curl_slist *resolve;	/* see warm.c */
+	long dns_ttl;		/* in milliseconds, -1 is forever */
+	struct tuning tune;
+	struct str unix_socket;
+	int record;		/* fill resp.info */
 };
 
 extern struct settings settings;
 extern const char *prgname;
 extern const char *prompt;
 extern int force_interactive;
+extern int single_process;
+extern struct svec *headers;
+extern struct worker *workers;
+extern int nworkers;
+extern int nthreads;
+extern CURL *easy;
 
 /* parse-related stuff */
 const char	*method2str(enum http_methods);
 const char	*httpver2str(long);
 int		 strsw(const char*, const char*);
 int		 parse(const char*, struct cmd*);
+int		 parse_size(const char*, size_t*);
+int		 parse_duration(const char*, long*);
 
 /* http stuff */
-int		 do_req(const struct req*, struct resp*, struct svec*);
+char		*do_url(const struct req*);
+int		 do_req(CURL*, const struct req*, struct resp*, struct svec*,
+		    struct sink*);
 void		 free_resp(struct resp*);
-
-/* print the prompt and read a line (getline(3)-style) */
-char		*rlf(const char*, FILE*);
+int		 init_res(struct write_result*);
+size_t		 write_res(void*, size_t, size_t, void*);
+size_t		 write_res_header(void*, size_t, size_t, void*);
+void		 nap(long);
+size_t		 retried(void);
+void		 hedge_show(void);
+void		 http_fini(void);
+
+/* read the lines from the file and run them until EOF or until the
+ * function returns 0 */
+void		 read_lines(FILE*, int (*)(char*));
 /* wait until fd becomes ready to read */
 int		 poll_read(int);
 
+/* event loop */
+typedef void (*ev_cb)(int, short, void*);
+void		 ev_add(int, short, ev_cb, void*);
+void		 ev_set(int, short);
+void		 ev_del(int);
+void		 ev_once(int);
+
 /* main loop */
-int		 repl(struct imsgbuf*, FILE*);
+int		 repl(FILE*);
+int		 replay(const char*, long);
+void		 handle_resp(struct worker*, struct imsg*);
+void		 set_recv_timer(void (*)(uint64_t));
+uint32_t	 submit_req(const struct req*);
+const struct resp *done_resp(uint32_t);
+void		 print_done(void);
+void		 set_format(int);
+void		 safe_println(const char*, size_t);
 
 /* svec related */
 struct svec	*svec_add(struct svec*, char*, int);
@@ -213,8 +602,116 @@ int		 svec_del(struct svec*, const char*);
 void		 svec_free(struct svec*);
 struct curl_slist *svec_to_curl(struct svec*);
 
+/* cache related */
+char		*hdr_value(const char*, size_t, const char*);
+struct centry	*cache_lookup(const char*, struct svec*);
+int		 cache_fresh(struct centry*);
+void		 cache_release(struct centry*);
+void		 cache_store(const char*, struct svec*, long, const char*,
+		    size_t, const char*, size_t);
+void		 cache_refresh(struct centry*, const char*, size_t);
+void		 cache_count(int);
+void		 cache_resize(void);
+void		 cache_show(void);
+int		 cache_enabled(void);
+size_t		 cache_max(void);
+char		*vary_values(const char*, struct svec*);
+
+/* disk cache related */
+void		 dcache_open(int, int);
+int		 dcache_enabled(void);
+struct centry	*dcache_load(const char*, struct svec*);
+void		 dcache_store(struct centry*);
+void		 dcache_refresh(struct centry*);
+void		 dcache_show(void);
+int		 dcache_send(const char*);
+
 /* child related */
+void	child_init(void);
+void	child_fini(void);
+int	child_dispatch(struct imsgbuf*, struct req*, int, const void*,
+	    size_t);
 int	child_main(struct imsgbuf*);
-void	csend(struct imsgbuf*, int, const void*, size_t);
+
+/* thread pool related */
+void	pool_start(struct writer*, int);
+void	pool_stop(void);
+void	pool_submit(struct req*);
+void	pool_done(const void*, size_t);
+size_t	pool_coalesced(void);
+void	pool_wrlock(void);
+void	pool_unlock(void);
+void	pool_reconnect(void);
+int	pool_drained(void);
+
+/* warm.c */
+void	 warm_init(void);
+void	 warm_fini(void);
+void	 warm_share(CURL*);
+void	 warm(const char*, size_t);
+void	 resolve_set(const char*, size_t);
+void	 resolve_show(void);
+
+/* record.c */
+struct recreq;
+int		 record_open(const char*, int);
+void		 record_close(void);
+int		 recording(void);
+void		 record_show(void);
+struct recreq	*record_req(const struct req*);
+void		 record_resp(struct recreq*, const struct resp*);
+int		 reclog_open(struct reclog*, const char*);
+void		 reclog_close(struct reclog*);
+int		 reclog_next(struct reclog*, struct recent*);
+
+/* json.c */
+int	 json_print(const char*, size_t, int);
+int	 json_extract(const char*, size_t, const char*, char**, size_t*);
+
+/* tune.c */
+void	 tune(CURL*);
+
+/* unix.c */
+extern int unix_allowed;
+int	 unix_send(const char*, size_t);
+void	 unix_use(CURL*);
+
+/* mux.c */
+void	 mux_start(void);
+void	 mux_stop(void);
+void	 mux_reconf(void);
+CURLcode mux_perform(CURL*);
+int	 mux_thread(void);
+void	 mux_pause(CURL*);
+void	 mux_resume(void);
+void	 mux_show(void);
+
+/* writer related */
+void	writer_init(struct writer*, struct imsgbuf*, size_t);
+void	writer_compose(struct writer*, int, uint32_t, const void*, size_t);
+void	writer_compose_fd(struct writer*, int, int, const void*, size_t);
+void	writer_compose_chunks(struct writer*, int, uint32_t, const char*,
+	    size_t);
+int	writer_flush(struct writer*);
+void	writer_sync(struct writer*);
+size_t	writer_queued(struct writer*);
+
+/* histogram related */
+void		 hist_init(struct hist*);
+void		 hist_add(struct hist*, uint64_t);
+uint64_t	 hist_count(struct hist*);
+uint64_t	 hist_pct(struct hist*, int);
+
+/* worker related */
+void		 spawn_workers(int);
+void		 stop_workers(void);
+void		 worker_send(struct worker*, int, const void*, size_t);
+void		 worker_send_fd(struct worker*, int, int, const void*, size_t);
+void		 worker_flush(struct worker*);
+void		 worker_throttle(struct worker*);
+void		 wsend(int, const void*, size_t);
+void		 warm_all(const char*, size_t);
+struct worker	*least_loaded(void);
+int		 wait_for_done(struct worker*);
 
 #endif
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The on-disk cache, shared by the children and across sessions.  A
+ * cache directory holds two append-only files:
+ *
+ *	segment	the bodies, one after the other, so they can be mmap'ed
+ *	index	a struct drec for every stored or refreshed response,
+ *		followed by its url, vary, vary values and headers
+ *
+ * The last record for a request wins.  The parent opens the files,
+ * since the children can't, and passes them over imsg; every child
+ * reads the records appended by the others before a lookup.  The
+ * appends are serialized with flock(2) on the segment.
+ */
+
+#include "crest.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DREC_MAGIC	0x63726331	/* "crc1" */
+
+struct drec {
+	uint32_t	magic;
+	uint32_t	urllen;
+	uint32_t	varylen;
+	uint32_t	varyvallen;
+	uint32_t	hlen;
+	uint32_t	code;
+	uint64_t	off;	/* of the body in the segment */
+	uint64_t	blen;
+	int64_t		expires;
+};
+
+/* what we know of an index record */
+struct dent {
+	TAILQ_ENTRY(dent) entry;
+	struct drec	 r;
+	char		*url;
+	char		*vary;
+	char		*varyval;
+	char		*headers;
+};
+
+static TAILQ_HEAD(, dent) dents = TAILQ_HEAD_INITIALIZER(dents);
+static size_t	 ndents;
+static int	 idxfd = -1, segfd = -1;
+static off_t	 idxpos;	/* how much of the index was read */
+
+static pthread_mutex_t dmtx = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+readstr(const char **p, size_t len)
+{
+	char *s;
+
+	if ((s = malloc(len + 1)) == NULL)
+		err(1, "malloc");
+	memcpy(s, *p, len);
+	s[len] = '\0';
+	*p += len;
+	return s;
+}
+
+static void
+dent_free(struct dent *d)
+{
+	free(d->url);
+	free(d->vary);
+	free(d->varyval);
+	free(d->headers);
+	free(d);
+}
+
+/* add the record, replacing the previous one for the same request */
+static void
+dent_add(struct dent *d)
+{
+	struct dent *o;
+
+	TAILQ_FOREACH(o, &dents, entry) {
+		if (!strcmp(o->url, d->url) &&
+		    !strcmp(o->varyval, d->varyval)) {
+			TAILQ_REMOVE(&dents, o, entry);
+			dent_free(o);
+			ndents--;
+			break;
+		}
+	}
+
+	TAILQ_INSERT_HEAD(&dents, d, entry);
+	ndents++;
+}
+
+/* read the records appended since the last time.  Called with dmtx
+ * held */
+static void
+catch_up(void)
+{
+	struct stat sb;
+	struct drec r;
+	struct dent *d;
+	char *buf;
+	const char *p;
+	size_t len;
+
+	if (fstat(idxfd, &sb) == -1)
+		err(1, "fstat");
+
+	while (idxpos + (off_t)sizeof(r) <= sb.st_size) {
+		if (pread(idxfd, &r, sizeof(r), idxpos) != sizeof(r))
+			err(1, "pread");
+		if (r.magic != DREC_MAGIC) {
+			warnx("corrupted cache index at %lld, skipping",
+			    (long long)idxpos);
+			idxpos = sb.st_size;
+			break;
+		}
+
+		len = (size_t)r.urllen + r.varylen + r.varyvallen + r.hlen;
+		if (idxpos + (off_t)(sizeof(r) + len) > sb.st_size)
+			break;	/* not completely written yet */
+
+		if ((buf = malloc(len)) == NULL)
+			err(1, "malloc");
+		if (pread(idxfd, buf, len, idxpos + sizeof(r)) !=
+		    (ssize_t)len)
+			err(1, "pread");
+
+		if ((d = calloc(1, sizeof(*d))) == NULL)
+			err(1, "calloc");
+		d->r = r;
+		p = buf;
+		d->url = readstr(&p, r.urllen);
+		d->vary = readstr(&p, r.varylen);
+		d->varyval = readstr(&p, r.varyvallen);
+		d->headers = readstr(&p, r.hlen);
+		free(buf);
+
+		dent_add(d);
+		idxpos += sizeof(r) + len;
+	}
+}
+
+/* called in the child with the files received from the parent, or -1
+ * to close them */
+void
+dcache_open(int idx, int seg)
+{
+	struct dent *d;
+
+	pthread_mutex_lock(&dmtx);
+	if (idxfd != -1)
+		close(idxfd);
+	if (segfd != -1)
+		close(segfd);
+	idxfd = idx;
+	segfd = seg;
+
+	while ((d = TAILQ_FIRST(&dents)) != NULL) {
+		TAILQ_REMOVE(&dents, d, entry);
+		dent_free(d);
+	}
+	ndents = 0;
+	idxpos = 0;
+
+	if (idxfd != -1)
+		catch_up();
+	pthread_mutex_unlock(&dmtx);
+}
+
+int
+dcache_enabled(void)
+{
+	return idxfd != -1;
+}
+
+/* build an entry of the cache from what's on disk for this request.
+ * The body is mmap'ed. */
+struct centry *
+dcache_load(const char *url, struct svec *headers)
+{
+	struct centry *e;
+	struct dent *d;
+	char *v;
+	size_t delta;
+	long pgsz;
+
+	e = NULL;
+	pthread_mutex_lock(&dmtx);
+	if (idxfd == -1)
+		goto done;
+
+	catch_up();
+	TAILQ_FOREACH(d, &dents, entry) {
+		if (strcmp(d->url, url) != 0)
+			continue;
+
+		v = vary_values(d->vary, headers);
+		if (strcmp(v, d->varyval) == 0) {
+			free(v);
+			break;
+		}
+		free(v);
+	}
+	if (d == NULL)
+		goto done;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		err(1, "calloc");
+	if ((e->url = strdup(d->url)) == NULL ||
+	    (e->vary = strdup(d->vary)) == NULL ||
+	    (e->varyval = strdup(d->varyval)) == NULL ||
+	    (e->headers = strdup(d->headers)) == NULL)
+		err(1, "strdup");
+	e->hlen = d->r.hlen;
+	e->code = d->r.code;
+	e->blen = d->r.blen;
+	e->expires = d->r.expires;
+	e->etag = hdr_value(e->headers, e->hlen, "ETag");
+	e->lastmod = hdr_value(e->headers, e->hlen, "Last-Modified");
+	e->size = sizeof(*e) + strlen(url) + e->hlen + e->blen;
+	e->doff = d->r.off;
+
+	/* mmap wants an offset aligned to the page size */
+	pgsz = sysconf(_SC_PAGESIZE);
+	delta = d->r.off % pgsz;
+	e->maplen = delta + e->blen;
+	if (e->blen == 0) {
+		if ((e->body = strdup("")) == NULL)
+			err(1, "strdup");
+	} else {
+		e->map = mmap(NULL, e->maplen, PROT_READ, MAP_SHARED,
+		    segfd, d->r.off - delta);
+		if (e->map == MAP_FAILED)
+			err(1, "mmap");
+		e->body = (char *)e->map + delta;
+	}
+
+done:
+	pthread_mutex_unlock(&dmtx);
+	return e;
+}
+
+/* append a record for e, which is already in the segment at e->doff */
+static void
+append_rec(struct centry *e)
+{
+	struct drec r;
+	struct iovec iov[5];
+	struct dent *d;
+	ssize_t n, tot;
+
+	memset(&r, 0, sizeof(r));
+	r.magic = DREC_MAGIC;
+	r.urllen = strlen(e->url);
+	r.varylen = strlen(e->vary);
+	r.varyvallen = strlen(e->varyval);
+	r.hlen = e->hlen;
+	r.code = e->code;
+	r.off = e->doff;
+	r.blen = e->blen;
+	r.expires = e->expires;
+
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = e->url;
+	iov[1].iov_len = r.urllen;
+	iov[2].iov_base = e->vary;
+	iov[2].iov_len = r.varylen;
+	iov[3].iov_base = e->varyval;
+	iov[3].iov_len = r.varyvallen;
+	iov[4].iov_base = e->headers;
+	iov[4].iov_len = r.hlen;
+
+	tot = sizeof(r) + r.urllen + r.varylen + r.varyvallen + r.hlen;
+	if ((n = writev(idxfd, iov, 5)) == -1)
+		err(1, "writev");
+	if (n != tot)
+		errx(1, "short write on the cache index");
+
+	/* remember it without reading it back */
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		err(1, "calloc");
+	d->r = r;
+	if ((d->url = strdup(e->url)) == NULL ||
+	    (d->vary = strdup(e->vary)) == NULL ||
+	    (d->varyval = strdup(e->varyval)) == NULL ||
+	    (d->headers = strdup(e->headers)) == NULL)
+		err(1, "strdup");
+	dent_add(d);
+}
+
+/* append the body of e to the segment and a record to the index */
+void
+dcache_store(struct centry *e)
+{
+	const char *p;
+	off_t off;
+	size_t left;
+	ssize_t n;
+
+	pthread_mutex_lock(&dmtx);
+	if (idxfd == -1)
+		goto done;
+
+	if (flock(segfd, LOCK_EX) == -1)
+		err(1, "flock");
+
+	/* don't lose what the others wrote before us */
+	catch_up();
+
+	if ((off = lseek(segfd, 0, SEEK_END)) == -1)
+		err(1, "lseek");
+	for (p = e->body, left = e->blen; left != 0; p += n, left -= n) {
+		if ((n = write(segfd, p, left)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			err(1, "write");
+		}
+	}
+
+	e->doff = off;
+	append_rec(e);
+	idxpos = lseek(idxfd, 0, SEEK_END);
+
+	flock(segfd, LOCK_UN);
+
+done:
+	pthread_mutex_unlock(&dmtx);
+}
+
+/* record the new expiration time of e after a 304 */
+void
+dcache_refresh(struct centry *e)
+{
+	pthread_mutex_lock(&dmtx);
+	if (idxfd == -1 || e->doff == -1)
+		goto done;
+
+	if (flock(segfd, LOCK_EX) == -1)
+		err(1, "flock");
+	catch_up();
+	append_rec(e);
+	idxpos = lseek(idxfd, 0, SEEK_END);
+	flock(segfd, LOCK_UN);
+
+done:
+	pthread_mutex_unlock(&dmtx);
+}
+
+void
+dcache_show(void)
+{
+	struct stat sb;
+
+	pthread_mutex_lock(&dmtx);
+	if (idxfd == -1) {
+		pthread_mutex_unlock(&dmtx);
+		return;
+	}
+
+	catch_up();
+	if (fstat(segfd, &sb) == -1)
+		err(1, "fstat");
+	printf("disk: %zu entries, %lld bytes of bodies\n", ndents,
+	    (long long)sb.st_size);
+	pthread_mutex_unlock(&dmtx);
+}
+
+static int
+open_file(int dir, const char *name)
+{
+	int fd;
+
+	if ((fd = openat(dir, name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+	    0644)) == -1)
+		warn("open %s", name);
+	return fd;
+}
+
+static void
+send_files(int i, const char *path, size_t len, int idx, int seg)
+{
+	if (single_process) {
+		child_dispatch(NULL, NULL, IMSG_SET_CACHE_DIR, path, len);
+		dcache_open(idx, seg);
+		return;
+	}
+
+	worker_send_fd(&workers[i], IMSG_SET_CACHE_DIR, idx, path, len);
+	worker_send_fd(&workers[i], IMSG_CACHE_SEGMENT, seg, NULL, 0);
+}
+
+/* called in the parent: open the cache directory and send the files to
+ * the children, or tell them to close the cache if path is NULL.
+ * Every child gets its own open file, or flock(2) wouldn't serialize
+ * them. */
+int
+dcache_send(const char *path)
+{
+	size_t len;
+	int i, n, dir, idx, seg;
+
+	n = single_process ? 1 : nworkers;
+	len = path != NULL ? strlen(path) : 0;
+
+	if (path == NULL) {
+		for (i = 0; i < n; ++i)
+			send_files(i, NULL, 0, -1, -1);
+		return 1;
+	}
+
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		warn("mkdir %s", path);
+		return 0;
+	}
+	if ((dir = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+		warn("open %s", path);
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if ((idx = open_file(dir, "index")) == -1)
+			break;
+		if ((seg = open_file(dir, "segment")) == -1) {
+			close(idx);
+			break;
+		}
+		send_files(i, path, len, idx, seg);
+	}
+
+	close(dir);
+	return i == n;
+}
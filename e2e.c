@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The end-to-end benchmark.  The same requests go through the whole of
+ * crest (parse, the imsgs to a child, its threads, curl, the imsgs
+ * back and the printing) and through a bare libcurl loop, one at a
+ * time and then many at once, against the same crest-mockd.  The
+ * difference is what crest costs per request, and the time spent in
+ * the parent is split by stage.
+ *
+ * The requests go through submit_req, done_resp and print_done as the
+ * repl's do, and set_recv_timer times the receiving.
+ */
+
+#include "crest.h"
+
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS	5
+
+const char *prgname = "crest-e2e";
+const char *prompt;
+int force_interactive;
+int single_process;
+int nthreads = 1;
+
+/* summed over a pass, in nanoseconds */
+struct stages {
+	uint64_t	wall;
+	uint64_t	parse;
+	uint64_t	send;	/* composing and flushing the imsgs */
+	uint64_t	recv;	/* handling the imsgs of the responses */
+	uint64_t	print;
+	uint64_t	curl;	/* as timed by curl, in the child or here */
+};
+
+struct result {
+	struct stages	crest;
+	struct stages	direct;
+};
+
+/* the response of a direct request */
+struct body {
+	char	*s;
+	size_t	 len;
+};
+
+static uint64_t	 recvns;
+
+/* the requests in flight that aren't counted yet */
+static uint32_t	 ids[MAX_THREADS];
+static int	 nids;
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+add_recv(uint64_t ns)
+{
+	recvns += ns;
+}
+
+/* the requests in flight, over all the workers */
+static int
+inflight(void)
+{
+	int i, n;
+
+	for (n = 0, i = 0; i < nworkers; ++i)
+		n += workers[i].load;
+	return n;
+}
+
+/* every request has its own path, or the child would coalesce them */
+static void
+parse_get(size_t i, struct cmd *cmd)
+{
+	char line[64];
+
+	snprintf(line, sizeof(line), "get /e2e/%zu", i);
+	memset(cmd, 0, sizeof(*cmd));
+	if (!parse(line, cmd) || cmd->type != CMD_REQ)
+		errx(1, "can't parse %s", line);
+}
+
+/* account for the completed requests, and print them */
+static void
+collect(struct stages *s)
+{
+	const struct resp *r;
+	uint64_t t;
+	int i;
+
+	/* before print_done frees them */
+	for (i = 0; i < nids; ) {
+		if ((r = done_resp(ids[i])) == NULL) {
+			i++;
+			continue;
+		}
+		if (r->err != NULL)
+			errx(1, "%s", r->err);
+		if (r->http_code != 200)
+			errx(1, "got a %ld", r->http_code);
+		s->curl += r->timing.total * 1000;
+		ids[i] = ids[--nids];
+	}
+
+	t = nsec();
+	print_done();
+	s->print += nsec() - t;
+}
+
+/* n requests through crest, with up to conc of them in flight */
+static void
+crest_pass(size_t n, int conc, struct stages *s)
+{
+	struct cmd cmd;
+	uint64_t start, t0, t1;
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	recvns = 0;
+	start = nsec();
+
+	for (i = 0; i < n; ++i) {
+		while (inflight() >= conc) {
+			ev_once(-1);
+			collect(s);
+		}
+
+		t0 = nsec();
+		parse_get(i, &cmd);
+		t1 = nsec();
+		ids[nids++] = submit_req(&cmd.req);
+		s->parse += t1 - t0;
+		s->send += nsec() - t1;
+		free(cmd.req.path);
+
+		while (conc == 1 && inflight() != 0)
+			ev_once(-1);
+		collect(s);
+	}
+
+	while (inflight() != 0) {
+		ev_once(-1);
+		collect(s);
+	}
+
+	s->wall = nsec() - start;
+	s->recv = recvns;
+}
+
+static size_t
+body_write(char *ptr, size_t size, size_t nmemb, void *arg)
+{
+	struct body *b = arg;
+	char *t;
+
+	if ((t = realloc(b->s, b->len + size * nmemb)) == NULL)
+		err(1, "realloc");
+	memcpy(t + b->len, ptr, size * nmemb);
+	b->s = t;
+	b->len += size * nmemb;
+	return size * nmemb;
+}
+
+static CURL *
+easy_new(struct body *b)
+{
+	CURL *e;
+
+	if ((e = curl_easy_init()) == NULL)
+		errx(1, "curl_easy_init failed");
+	curl_easy_setopt(e, CURLOPT_WRITEFUNCTION, body_write);
+	curl_easy_setopt(e, CURLOPT_WRITEDATA, b);
+	curl_easy_setopt(e, CURLOPT_HEADERFUNCTION, body_write);
+	curl_easy_setopt(e, CURLOPT_HEADERDATA, b);
+	curl_easy_setopt(e, CURLOPT_PRIVATE, b);
+	return e;
+}
+
+static void
+easy_url(CURL *e, const char *prefix, size_t i)
+{
+	char url[512];
+
+	snprintf(url, sizeof(url), "%s/e2e/%zu", prefix, i);
+	curl_easy_setopt(e, CURLOPT_URL, url);
+}
+
+/* account for a direct request that's done */
+static void
+easy_done(CURL *e, CURLcode rc, struct stages *s)
+{
+	struct body *b;
+	curl_off_t t;
+	long code;
+
+	if (rc != CURLE_OK)
+		errx(1, "curl: %s", curl_easy_strerror(rc));
+	curl_easy_getinfo(e, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 200)
+		errx(1, "got a %ld", code);
+	curl_easy_getinfo(e, CURLINFO_TOTAL_TIME_T, &t);
+	s->curl += t * 1000;
+
+	curl_easy_getinfo(e, CURLINFO_PRIVATE, (char **)&b);
+	free(b->s);
+	b->s = NULL;
+	b->len = 0;
+}
+
+/* n requests one after the other on the same handle */
+static void
+direct_seq(CURL *e, const char *prefix, size_t n, struct stages *s)
+{
+	uint64_t start;
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	start = nsec();
+	for (i = 0; i < n; ++i) {
+		easy_url(e, prefix, i);
+		easy_done(e, curl_easy_perform(e), s);
+	}
+	s->wall = nsec() - start;
+}
+
+/* n requests on conc handles of a multi */
+static void
+direct_conc(CURLM *multi, CURL **e, int conc, const char *prefix, size_t n,
+    struct stages *s)
+{
+	CURLMsg *m;
+	uint64_t start;
+	size_t next, done;
+	int i, running, left;
+
+	memset(s, 0, sizeof(*s));
+	start = nsec();
+
+	for (next = 0, i = 0; i < conc && next < n; ++i) {
+		easy_url(e[i], prefix, next++);
+		curl_multi_add_handle(multi, e[i]);
+	}
+
+	for (done = 0; done < n; ) {
+		if (curl_multi_perform(multi, &running) != CURLM_OK)
+			errx(1, "curl_multi_perform failed");
+		while ((m = curl_multi_info_read(multi, &left)) != NULL) {
+			if (m->msg != CURLMSG_DONE)
+				continue;
+			easy_done(m->easy_handle, m->data.result, s);
+			done++;
+			curl_multi_remove_handle(multi, m->easy_handle);
+			if (next == n)
+				continue;
+			easy_url(m->easy_handle, prefix, next++);
+			curl_multi_add_handle(multi, m->easy_handle);
+		}
+		if (done < n && curl_multi_poll(multi, NULL, 0, 1000, NULL)
+		    != CURLM_OK)
+			errx(1, "curl_multi_poll failed");
+	}
+
+	s->wall = nsec() - start;
+}
+
+static double
+per(uint64_t v, size_t n)
+{
+	return (double)v / n;
+}
+
+static double
+overhead(const struct result *r, size_t n)
+{
+	return per(r->crest.wall, n) - per(r->direct.wall, n);
+}
+
+static const struct result *
+median(struct result *r, int nr, size_t n)
+{
+	struct result t;
+	int i, j;
+
+	/* a few rounds, sorted by the overhead */
+	for (i = 1; i < nr; ++i)
+		for (j = i; j > 0 && overhead(&r[j - 1], n) >
+		    overhead(&r[j], n); --j) {
+			t = r[j];
+			r[j] = r[j - 1];
+			r[j - 1] = t;
+		}
+	return &r[nr / 2];
+}
+
+static void
+report(FILE *out, const char *name, const struct result *r, size_t n,
+    int conc)
+{
+	const struct stages *c = &r->crest;
+	uint64_t parent;
+
+	fprintf(out, "{\"name\": \"%s\", \"requests\": %zu, "
+	    "\"concurrency\": %d, \"crest_ns_per_req\": %.1f, "
+	    "\"curl_ns_per_req\": %.1f, \"overhead_ns\": %.1f, "
+	    "\"parse_ns\": %.1f, \"send_ns\": %.1f", name, n, conc,
+	    per(c->wall, n), per(r->direct.wall, n), overhead(r, n),
+	    per(c->parse, n), per(c->send, n));
+
+	/* one at a time, the rest of the wait is in the child */
+	if (conc == 1) {
+		parent = c->parse + c->send + c->recv + c->print;
+		fprintf(out, ", \"child_ns\": %.1f",
+		    per(c->wall, n) - per(parent, n) - per(c->curl, n));
+	}
+
+	fprintf(out, ", \"recv_ns\": %.1f, \"print_ns\": %.1f, "
+	    "\"curl_in_child_ns\": %.1f, \"curl_direct_ns\": %.1f}\n",
+	    per(c->recv, n), per(c->print, n), per(c->curl, n),
+	    per(r->direct.curl, n));
+	fflush(out);
+}
+
+/* start crest-mockd on a free port and read where it listens */
+static pid_t
+mockd_start(const char *path, const char *size, char *url, size_t len)
+{
+	FILE *f;
+	pid_t pid;
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		if (dup2(fds[1], 1) == -1)
+			err(1, "dup2");
+		close(fds[0]);
+		close(fds[1]);
+		execlp(path, path, "-p", "0", "-s", size, (char *)NULL);
+		err(1, "%s", path);
+	}
+
+	close(fds[1]);
+	if ((f = fdopen(fds[0], "r")) == NULL)
+		err(1, "fdopen");
+	if (fgets(url, len, f) == NULL)
+		errx(1, "%s didn't start", path);
+	url[strcspn(url, "\n")] = '\0';
+	fclose(f);
+	return pid;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c concurrency] [-m mockd] [-n requests] "
+	    "[-s size] [-u url]\n", prgname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct result rs[ROUNDS];
+	struct body bodies[MAX_THREADS];
+	CURL *easy1, *e[MAX_THREADS];
+	CURLM *multi;
+	FILE *out;
+	const char *errstr, *mockd, *size;
+	char url[256];
+	size_t n, warm;
+	pid_t pid;
+	int ch, conc, fd, i;
+
+	memset(bodies, 0, sizeof(bodies));
+	conc = 8;
+	n = 1000;
+	mockd = "crest-mockd";
+	size = "1k";
+	*url = '\0';
+
+	while ((ch = getopt(argc, argv, "c:m:n:s:u:")) != -1) {
+		switch (ch) {
+		case 'c':
+			conc = strtonum(optarg, 2, MAX_THREADS, &errstr);
+			if (errstr != NULL)
+				errx(1, "concurrency is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'm':
+			mockd = optarg;
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, 10000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "requests is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			size = optarg;
+			break;
+		case 'u':
+			if ((size_t)snprintf(url, sizeof(url), "%s", optarg) >=
+			    sizeof(url))
+				errx(1, "url too long: %s", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	pid = -1;
+	if (*url == '\0')
+		pid = mockd_start(mockd, size, url, sizeof(url));
+	while (*url != '\0' && url[strlen(url) - 1] == '/')
+		url[strlen(url) - 1] = '\0';
+
+	/* the responses are printed, but nobody reads them */
+	fflush(stdout);
+	if ((fd = dup(1)) == -1 || (out = fdopen(fd, "w")) == NULL)
+		err(1, "dup");
+	if ((fd = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+	if (dup2(fd, 1) == -1)
+		err(1, "dup2");
+	close(fd);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* enough to open the connections and warm the caches */
+	warm = n / 10 < 50 ? 50 : n / 10;
+
+	set_recv_timer(add_recv);
+
+	/* one at a time, as crest runs by default */
+	nthreads = 1;
+	spawn_workers(1);
+	wsend(IMSG_SET_PREFIX, url, strlen(url));
+	if (curl_global_init(CURL_GLOBAL_ALL) != 0)
+		errx(1, "curl_global_init failed");
+	easy1 = easy_new(&bodies[0]);
+
+	crest_pass(warm, 1, &rs[0].crest);
+	direct_seq(easy1, url, warm, &rs[0].direct);
+	for (i = 0; i < ROUNDS; ++i) {
+		crest_pass(n, 1, &rs[i].crest);
+		direct_seq(easy1, url, n, &rs[i].direct);
+	}
+	report(out, "e2e/seq", median(rs, ROUNDS, n), n, 1);
+	stop_workers();
+	curl_easy_cleanup(easy1);
+
+	/* conc at a time, on as many threads */
+	nthreads = conc;
+	spawn_workers(1);
+	wsend(IMSG_SET_PREFIX, url, strlen(url));
+	if ((multi = curl_multi_init()) == NULL)
+		errx(1, "curl_multi_init failed");
+	for (i = 0; i < conc; ++i)
+		e[i] = easy_new(&bodies[i]);
+
+	crest_pass(warm, conc, &rs[0].crest);
+	direct_conc(multi, e, conc, url, warm, &rs[0].direct);
+	for (i = 0; i < ROUNDS; ++i) {
+		crest_pass(n, conc, &rs[i].crest);
+		direct_conc(multi, e, conc, url, n, &rs[i].direct);
+	}
+	report(out, "e2e/conc", median(rs, ROUNDS, n), n, conc);
+	stop_workers();
+
+	for (i = 0; i < conc; ++i)
+		curl_easy_cleanup(e[i]);
+	curl_multi_cleanup(multi);
+	curl_global_cleanup();
+
+	if (pid != -1) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	fclose(out);
+	return 0;
+}
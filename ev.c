@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A tiny poll(2)-based event loop for the parent.  Every file
+ * descriptor the parent is waiting on (the standard input, the
+ * workers, the pipes) is registered here with a callback, and whoever
+ * needs to wait for something just calls ev_once() until it happens.
+ * Callbacks can add and remove events and can call ev_once() again.
+ */
+
+#include "crest.h"
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct event {
+	int	 fd;
+	short	 events;
+	ev_cb	 cb;
+	void	*arg;
+};
+
+static struct event	*evs;
+static size_t		 nevs, capevs;
+
+static struct event *
+ev_find(int fd)
+{
+	size_t i;
+
+	for (i = 0; i < nevs; ++i)
+		if (evs[i].fd == fd)
+			return &evs[i];
+	return NULL;
+}
+
+void
+ev_add(int fd, short events, ev_cb cb, void *arg)
+{
+	struct event *e;
+	size_t c;
+
+	if ((e = ev_find(fd)) == NULL) {
+		if (nevs == capevs) {
+			c = capevs == 0 ? 8 : capevs * 2;
+			e = recallocarray(evs, capevs, c, sizeof(*e));
+			if (e == NULL)
+				err(1, "recallocarray");
+			evs = e;
+			capevs = c;
+		}
+		e = &evs[nevs++];
+	}
+
+	e->fd = fd;
+	e->events = events;
+	e->cb = cb;
+	e->arg = arg;
+}
+
+/* change the events we're interested in.  0 pauses the fd */
+void
+ev_set(int fd, short events)
+{
+	struct event *e;
+
+	if ((e = ev_find(fd)) != NULL)
+		e->events = events;
+}
+
+void
+ev_del(int fd)
+{
+	struct event *e;
+
+	if ((e = ev_find(fd)) == NULL)
+		return;
+
+	memmove(e, e + 1, (nevs - (e - evs) - 1) * sizeof(*e));
+	nevs--;
+}
+
+/* wait at most timeout milliseconds (-1 means forever) for something
+ * to happen and run the callbacks */
+void
+ev_once(int timeout)
+{
+	struct pollfd *pfd;
+	struct event *e;
+	size_t i, n;
+
+	n = nevs;
+	if ((pfd = calloc(n ? n : 1, sizeof(*pfd))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; ++i) {
+		pfd[i].fd = evs[i].events ? evs[i].fd : -1;
+		pfd[i].events = evs[i].events;
+	}
+
+	if (poll(pfd, n, timeout) == -1) {
+		if (errno != EINTR)
+			err(1, "poll");
+		free(pfd);
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (pfd[i].fd == -1 || pfd[i].revents == 0)
+			continue;
+		if (pfd[i].revents & POLLNVAL)
+			errx(1, "bad fd %d", pfd[i].fd);
+
+		/* a previous callback may have removed or paused it */
+		if ((e = ev_find(pfd[i].fd)) == NULL || e->events == 0)
+			continue;
+		e->cb(pfd[i].fd, pfd[i].revents, e->arg);
+	}
+
+	free(pfd);
+}
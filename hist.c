@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A latency histogram with log-linear buckets: the values below
+ * HIST_SUB have a bucket each, then every power of two is split in
+ * HIST_SUB buckets, so the error is at most 1/HIST_SUB of the value.
+ * The counters are atomic, so many threads can add to it.
+ */
+
+#include "crest.h"
+
+#include <string.h>
+
+static size_t
+bucket(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	for (e = 63; !(v & (1ULL << e)); --e)
+		;
+	if (e >= HIST_MAXEXP)
+		return HIST_BUCKETS - 1;
+
+	/* e >= log2(HIST_SUB) here */
+	return HIST_SUB * (e - HIST_SUBBITS + 1) +
+	    ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+/* the highest value that ends up in the bucket b */
+static uint64_t
+value(size_t b)
+{
+	size_t e;
+
+	if (b < HIST_SUB)
+		return b;
+
+	e = b / HIST_SUB + HIST_SUBBITS - 1;
+	return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << (e - HIST_SUBBITS))
+	    - 1;
+}
+
+void
+hist_init(struct hist *h)
+{
+	size_t i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		atomic_init(&h->b[i], 0);
+	atomic_init(&h->n, 0);
+	atomic_init(&h->max, 0);
+}
+
+void
+hist_add(struct hist *h, uint64_t v)
+{
+	uint64_t m;
+
+	atomic_fetch_add_explicit(&h->b[bucket(v)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+
+	m = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (v > m && !atomic_compare_exchange_weak(&h->max, &m, v))
+		;
+}
+
+uint64_t
+hist_count(struct hist *h)
+{
+	return atomic_load_explicit(&h->n, memory_order_relaxed);
+}
+
+/* the value below which there are permille thousandths of the values */
+uint64_t
+hist_pct(struct hist *h, int permille)
+{
+	uint64_t n, want, seen, max;
+	size_t i;
+
+	if ((n = hist_count(h)) == 0)
+		return 0;
+
+	want = (n * permille + 999) / 1000;
+	if (want == 0)
+		want = 1;
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += atomic_load_explicit(&h->b[i], memory_order_relaxed);
+		if (seen >= want)
+			return value(i) < max ? value(i) : max;
+	}
+	return max;
+}
@@ -18,16 +18,33 @@
 
 #include <curl/curl.h>
 #include <err.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-struct write_result {
-	char *data;
-	size_t pos;
-	size_t size;
+/* the copy that received the headers first, or -1 */
+struct race {
+	int winner;
 };
 
-static int
+/* how many hedged GETs to see before trusting the percentiles */
+#define HEDGE_MIN 20
+
+/* how many requests were tried again */
+static _Atomic size_t nretried;
+
+/* the time to first byte of the GETs, and how many were hedged and how
+ * many times the hedge won */
+static struct hist latency;
+static _Atomic size_t nhedged, nwon;
+
+/* used instead of the multiplexer while hedging, so the two copies
+ * of a request can run at the same time on their own connections */
+static _Thread_local CURLM *multi;
+
+int
 init_res(struct write_result *res)
 {
 	memset(res, 0, sizeof(struct write_result));
@@ -60,16 +77,78 @@ resize_res(struct write_result *res)
 	return ns;
 }
 
-static size_t
+/* the transfer errors worth another try */
+static int
+transient(CURLcode code)
+{
+	switch (code) {
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* return 1 if res is the copy that lost the race */
+static int
+lost(struct write_result *res)
+{
+	return res->race != NULL && res->race->winner != -1 &&
+	    res->race->winner != res->copy;
+}
+
+/* return 1 if the response will be retried, and so it's not passed
+ * on.  Not if the server asks to wait longer than the backoff cap */
+static int
+held(struct write_result *res)
+{
+	curl_off_t after;
+	long code;
+
+	if (!res->retry)
+		return 0;
+
+	code = 0;
+	curl_easy_getinfo(res->curl, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 408 && code != 429 && code != 502 && code != 503 &&
+	    code != 504)
+		return 0;
+
+	after = 0;
+	curl_easy_getinfo(res->curl, CURLINFO_RETRY_AFTER, &after);
+	return after <= settings.retry.cap / 1000;
+}
+
+size_t
 write_res_header(void *ptr, size_t size, size_t nmemb, void *s)
 {
 	size_t i;
 	char *p;
+	long code;
 	struct write_result *res = s;
 
 	p = ptr;
 
-	if (res->pos + size * nmemb >= res->size) {
+	if (lost(res))
+		return 0;
+
+	/* a new block of headers, i.e. after a 100 Continue */
+	if (res->eob) {
+		if (res->sink != NULL)
+			res->pos = 0;
+		res->start = res->pos;
+		res->eob = 0;
+	}
+
+	while (res->pos + size * nmemb >= res->size) {
 		if (resize_res(res) == 0)
 			return 0;
 	}
@@ -83,15 +162,58 @@ write_res_header(void *ptr, size_t size, size_t nmemb, void *s)
 	}
 
 	res->data[res->pos] = '\0'; /* NUL-terminate the data */
+
+	/* an empty line ends a block of headers: pass it to the sink
+	 * together with its status code, unless it's the 304 for an
+	 * entry of the cache */
+	if (*p == '\n' || *p == '\r') {
+		res->eob = 1;
+
+		if (res->race != NULL && res->race->winner == -1)
+			res->race->winner = res->copy;
+
+		if (res->sink != NULL && !held(res)) {
+			code = 0;
+			curl_easy_getinfo(res->curl, CURLINFO_RESPONSE_CODE,
+			    &code);
+			if (code != 304 || res->stale == NULL) {
+				res->sink->head(res->sink->arg, code,
+				    res->data, res->pos);
+				res->sent = 1;
+			}
+		}
+	}
+
 	return size * nmemb;
 }
 
-static size_t
+size_t
 write_res(void *ptr, size_t size, size_t nmemb, void *s)
 {
 	struct write_result *res = s;
 
-	if (res->pos + size * nmemb >= res->size) {
+	if (lost(res))
+		return 0;
+
+	if (held(res))
+		return size * nmemb;
+
+	if (res->sink != NULL) {
+		if (!res->sink->body(res->sink->arg, ptr, size * nmemb)) {
+			mux_pause(res->curl);
+			return CURL_WRITEFUNC_PAUSE;
+		}
+
+		/* give up on caching what doesn't fit */
+		if (!res->fill)
+			return size * nmemb;
+		if (res->pos + size * nmemb > cache_max()) {
+			res->fill = 0;
+			return size * nmemb;
+		}
+	}
+
+	while (res->pos + size * nmemb >= res->size) {
 		if (resize_res(res) == 0)
 			return 0;
 	}
@@ -102,7 +224,36 @@ write_res(void *ptr, size_t size, size_t nmemb, void *s)
 	return size * nmemb;
 }
 
-static char *
+/* reply with an entry of the cache */
+static void
+serve(struct centry *e, struct resp *resp, struct sink *sink)
+{
+	size_t i, n;
+
+	resp->http_code = e->code;
+
+	if (sink == NULL) {
+		if ((resp->headers = strdup(e->headers)) == NULL ||
+		    (resp->body = malloc(e->blen + 1)) == NULL)
+			err(1, "malloc");
+		resp->hlen = e->hlen;
+		memcpy(resp->body, e->body, e->blen);
+		resp->body[e->blen] = '\0';
+		resp->blen = e->blen;
+		return;
+	}
+
+	sink->head(sink->arg, e->code, e->headers, e->hlen);
+	for (i = 0; i < e->blen; i += n) {
+		n = e->blen - i;
+		if (n > CURL_MAX_WRITE_SIZE)
+			n = CURL_MAX_WRITE_SIZE;
+		sink->body(sink->arg, e->body + i, n);
+	}
+}
+
+/* the URL for the request, with the prefix */
+char *
 do_url(const struct req *req)
 {
 	char *u, *prefix;
@@ -130,19 +281,269 @@ do_url(const struct req *req)
 	return u;
 }
 
+/* late is added to the times of a hedge, to count from the start of
+ * the request */
+static void
+get_timing(CURL *curl, struct timing *t, curl_off_t late)
+{
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &t->dns);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &t->connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &t->tls);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &t->ttfb);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &t->total);
+
+	t->dns += late;
+	t->connect += late;
+	if (t->tls != 0)
+		t->tls += late;
+	t->ttfb += late;
+	t->total += late;
+}
+
+/* RFC 9110 section 9.2.2 */
+static int
+idempotent(enum http_methods m)
+{
+	return m != POST && m != PATCH && m != CONNECT;
+}
+
+/* how long to wait before trying again, in milliseconds, or -1 if the
+ * attempt that ended with code shouldn't be retried.  prev is the
+ * previous delay */
+static long
+retry_delay(CURLcode code, struct write_result *hdr, long *prev)
+{
+	curl_off_t after;
+	long d, span;
+
+	if (!hdr->retry)
+		return -1;
+
+	after = 0;
+	if (code != CURLE_OK) {
+		/* too late if the response is already on its way */
+		if (hdr->sent || !transient(code))
+			return -1;
+	} else {
+		if (!held(hdr))
+			return -1;
+		curl_easy_getinfo(hdr->curl, CURLINFO_RETRY_AFTER, &after);
+	}
+
+	/* decorrelated jitter: between the minimum and three times the
+	 * previous delay, up to the cap */
+	if (*prev > settings.retry.cap / 3)
+		span = settings.retry.cap - settings.retry.min;
+	else
+		span = *prev * 3 - settings.retry.min;
+	d = settings.retry.min;
+	if (span > 0)
+		d += (unsigned long)random() % ((unsigned long)span + 1);
+	if (d > settings.retry.cap)
+		d = settings.retry.cap;
+	*prev = d;
+
+	if (after * 1000 > d)
+		d = after * 1000;
+	return d;
+}
+
+static curl_off_t
+usec_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000000 +
+	    (now.tv_nsec - t->tv_nsec) / 1000;
+}
+
+/* how long a GET can go without headers before being hedged, in
+ * microseconds, or -1 */
+static curl_off_t
+hedge_after(void)
+{
+	if (settings.hedge.delay != 0)
+		return (curl_off_t)settings.hedge.delay * 1000;
+	if (settings.hedge.pct == 0 || hist_count(&latency) < HEDGE_MIN)
+		return -1;
+	return hist_pct(&latency, settings.hedge.pct);
+}
+
+/* a fresh copy of the attempt s, for the handle curl */
+static void
+copy_res(struct write_result *d, const struct write_result *s, CURL *curl)
+{
+	if (s->data != NULL)
+		init_res(d);
+	else
+		memset(d, 0, sizeof(*d));
+	d->curl = curl;
+	d->sink = s->sink;
+	d->stale = s->stale;
+	d->fill = s->fill;
+	d->retry = s->retry;
+	d->race = s->race;
+	d->copy = 1;
+}
+
+/* perform the request.  While hedging, if the headers don't arrive in
+ * time a copy of it is sent on another connection: the first to get
+ * them wins, the other is cancelled.  The winner is returned in hdr
+ * and res, its handle in used. */
+static CURLcode
+perform(CURL *curl, int hedge, struct write_result *hdr,
+    struct write_result *res, CURL **used)
+{
+	struct write_result h2, r2;
+	struct race race;
+	struct timespec start;
+	CURL *dup;
+	CURLMsg *msg;
+	CURLcode code;
+	curl_off_t after, elapsed;
+	int i, n, running, wait, live[2], won;
+
+	*used = curl;
+	if (settings.hedge.pct == 0 && settings.hedge.delay == 0)
+		return mux_perform(curl);
+
+	if (multi == NULL) {
+		if ((multi = curl_multi_init()) == NULL)
+			errx(1, "curl_multi_init failed");
+		/* the copies must not share a connection */
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
+	}
+
+	after = hedge ? hedge_after() : -1;
+	race.winner = -1;
+	hdr->race = res->race = &race;
+	dup = NULL;
+	live[0] = 1;
+	live[1] = 0;
+	code = CURLE_OK;
+	won = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	curl_multi_add_handle(multi, curl);
+
+	for (;;) {
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &n)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			i = msg->easy_handle != curl;
+			code = msg->data.result;
+			curl_multi_remove_handle(multi, msg->easy_handle);
+			live[i] = 0;
+
+			/* the winner is done, or the only one left failed */
+			if (race.winner == i ||
+			    (race.winner == -1 && !live[!i])) {
+				won = i;
+				goto done;
+			}
+		}
+
+		elapsed = usec_since(&start);
+		wait = 1000;
+		if (dup == NULL && after != -1 && race.winner == -1) {
+			if (elapsed < after)
+				wait = (after - elapsed + 999) / 1000;
+			else {
+				if ((dup = curl_easy_duphandle(curl)) == NULL)
+					errx(1, "curl_easy_duphandle failed");
+				copy_res(&h2, hdr, dup);
+				copy_res(&r2, res, dup);
+				h2.late = r2.late = elapsed;
+				curl_easy_setopt(dup, CURLOPT_HEADERDATA, &h2);
+				curl_easy_setopt(dup, CURLOPT_WRITEDATA, &r2);
+				curl_multi_add_handle(multi, dup);
+				live[1] = 1;
+				atomic_fetch_add(&nhedged, 1);
+				continue;
+			}
+		}
+
+		curl_multi_poll(multi, NULL, 0, wait, NULL);
+	}
+
+done:
+	for (i = 0; i < 2; ++i)
+		if (live[i])
+			curl_multi_remove_handle(multi, i ? dup : curl);
+
+	if (won) {
+		atomic_fetch_add(&nwon, 1);
+		free(hdr->data);
+		free(res->data);
+		*hdr = h2;
+		*res = r2;
+		*used = dup;
+	} else if (dup != NULL) {
+		free(h2.data);
+		free(r2.data);
+		curl_easy_cleanup(dup);
+	}
+
+	hdr->race = res->race = NULL;
+	return code;
+}
+
+void
+nap(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1)
+		; /* EINTR */
+}
+
+/* the url and the headers the request goes out with, for record */
+static void
+describe(struct resp *resp, const char *url, struct svec *headers)
+{
+	FILE *f;
+	size_t i;
+
+	if ((f = open_memstream(&resp->info, &resp->ilen)) == NULL)
+		err(1, "open_memstream");
+	fputs(url, f);
+	fputc('\0', f);
+	if (settings.useragent.s != NULL)
+		fprintf(f, "User-Agent: %s\r\n", settings.useragent.s);
+	for (i = 0; headers != NULL && i < headers->len; ++i)
+		fprintf(f, "%s\r\n", headers->d[i].s);
+	if (fclose(f) == EOF)
+		err(1, "fclose");
+}
+
+/* perform the request with the given handle, which is reset before
+ * being used, so it can be reused to keep the connections alive.  If
+ * sink is not NULL the headers and the body are handed to it while
+ * they're received instead of being stored in resp. */
 int
-do_req(const struct req *req, struct resp *resp, struct svec *headers)
+do_req(CURL *curl, const struct req *req, struct resp *resp,
+    struct svec *headers, struct sink *sink)
 {
-	CURL *curl;
 	CURLcode code;
-	char *url;
-	int ret;
+	char *url, *cond;
+	int ret, caching, retry, changed;
+	long attempt, delay, prev;
+	char errbuf[CURL_ERROR_SIZE];
+	struct timeouts to;
+	CURL *used;
 	struct write_result hdr, res;
 	struct curl_slist *hdrs;
+	struct centry *ce;
 
-	curl = NULL;
 	url = NULL;
 	hdrs = NULL;
+	ce = NULL;
+	used = curl;
 	ret = 0;
 
 	memset(resp, 0, sizeof(struct resp));
@@ -150,11 +551,25 @@ do_req(const struct req *req, struct resp *resp, struct svec *headers)
 	if ((url = do_url(req)) == NULL)
 		return 0;
 
-	if ((curl = curl_easy_init()) == NULL) {
-		warnx("curl_easy_init failed");
+	if (settings.record)
+		describe(resp, url, headers);
+
+	/* fresh entries are served without touching the network, the
+	 * stale ones are revalidated */
+	caching = cache_enabled() && req->method == GET;
+	if (caching && (ce = cache_lookup(url, headers)) != NULL &&
+	    cache_fresh(ce)) {
+		cache_count(CACHE_HIT);
+		serve(ce, resp, sink);
+		ret = 1;
 		goto fail;
 	}
 
+	curl_easy_reset(curl);
+	warm_share(curl);
+	tune(curl);
+	unix_use(curl);
+
 	switch (req->method) {
 	case DELETE:
 		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
@@ -198,6 +613,7 @@ do_req(const struct req *req, struct resp *resp, struct svec *headers)
 
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, settings.useragent);
 	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, settings.http_version);
 
@@ -208,29 +624,111 @@ do_req(const struct req *req, struct resp *resp, struct svec *headers)
 	if (settings.skip_peer_verification)
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
 
-	init_res(&hdr);
-	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &write_res_header);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hdr);
+	/* the ones given with the request win */
+	to = settings.to;
+	if (req->has_to) {
+		if (req->to.connect != -1)
+			to.connect = req->to.connect;
+		if (req->to.total != -1)
+			to.total = req->to.total;
+		if (req->to.low_speed != -1) {
+			to.low_speed = req->to.low_speed;
+			to.low_time = req->to.low_time;
+		}
+	}
+	if (to.connect != 0)
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, to.connect);
+	if (to.total != 0)
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, to.total);
+	if (to.low_speed != 0) {
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, to.low_speed);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+		    to.low_time / 1000 + (to.low_time % 1000 != 0));
+	}
 
-	if (req->method == HEAD)
-		memset(&res, 0, sizeof(struct write_result));
-	else
-		init_res(&res);
+	*errbuf = '\0';
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
 
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &write_res_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hdr);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_res);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &res);
 
 	hdrs = NULL;
-	if (headers != NULL) {
+	if (headers != NULL)
 		hdrs = svec_to_curl(headers);
-		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
+
+	if (ce != NULL && (ce->etag != NULL || ce->lastmod != NULL)) {
+		if (ce->etag != NULL) {
+			if (asprintf(&cond, "If-None-Match: %s",
+			    ce->etag) == -1)
+				err(1, "asprintf");
+			hdrs = curl_slist_append(hdrs, cond);
+			free(cond);
+		}
+		if (ce->lastmod != NULL) {
+			if (asprintf(&cond, "If-Modified-Since: %s",
+			    ce->lastmod) == -1)
+				err(1, "asprintf");
+			hdrs = curl_slist_append(hdrs, cond);
+			free(cond);
+		}
 	}
 
-	code = curl_easy_perform(curl);
+	if (hdrs != NULL)
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
+
+	retry = settings.retry.all || idempotent(req->method);
+	prev = settings.retry.min;
+	changed = 0;
+	for (attempt = 1;; ++attempt) {
+		init_res(&hdr);
+		hdr.curl = curl;
+		hdr.sink = sink;
+		if (ce != NULL && (ce->etag != NULL || ce->lastmod != NULL))
+			hdr.stale = ce;
+
+		if (req->method == HEAD || (sink != NULL && !caching))
+			memset(&res, 0, sizeof(struct write_result));
+		else
+			init_res(&res);
+		res.curl = curl;
+		res.sink = sink;
+		/* the headers may not be the ones it went out with */
+		res.fill = caching && !changed;
+
+		hdr.retry = res.retry = retry &&
+		    attempt <= settings.retry.max;
+
+		code = perform(curl, req->method == GET, &hdr, &res, &used);
+		if ((delay = retry_delay(code, &hdr, &prev)) == -1)
+			break;
+
+		free(hdr.data);
+		free(res.data);
+		if (used != curl)
+			curl_easy_cleanup(used);
+		used = curl;
+		atomic_fetch_add(&nretried, 1);
+
+		/* the request is tried again as it was, but the pinned
+		 * addresses it points to may have been replaced */
+		if (sink == NULL || sink->nap == NULL)
+			nap(delay);
+		else if (sink->nap(sink->arg, delay)) {
+			changed = 1;
+			warm_share(curl);
+		}
+	}
 
 	if (code != CURLE_OK) {
-		warnx("curl_easy_perform(%s): %s", url,
-			curl_easy_strerror(code));
+		/* the timeouts are told apart from the other errors */
+		if (asprintf(&resp->err, "%s: %s: %s",
+		    code == CURLE_OPERATION_TIMEDOUT ? "timeout" : "failed",
+		    url, *errbuf != '\0' ? errbuf : curl_easy_strerror(code))
+		    == -1)
+			err(1, "asprintf");
+		resp->errlen = strlen(resp->err);
 
 		if (res.data != NULL)
 			free(res.data);
@@ -241,26 +739,97 @@ do_req(const struct req *req, struct resp *resp, struct svec *headers)
 		goto fail;
 	} else {
 		curl_easy_getinfo(
-			curl, CURLINFO_RESPONSE_CODE, &resp->http_code);
-		resp->hlen = hdr.pos;
-		resp->headers = hdr.data;
-		resp->blen = res.pos;
-		resp->body = res.data;
+			used, CURLINFO_RESPONSE_CODE, &resp->http_code);
+		get_timing(used, &resp->timing, hdr.late);
+		resp->timing.attempts = attempt;
+		if (req->method == GET)
+			hist_add(&latency, resp->timing.ttfb);
+
+		if (hdr.stale != NULL && resp->http_code == 304) {
+			cache_count(CACHE_REVALIDATED);
+			cache_refresh(ce, hdr.data + hdr.start,
+			    hdr.pos - hdr.start);
+			free(hdr.data);
+			free(res.data);
+			serve(ce, resp, sink);
+			ret = 1;
+			goto fail;
+		}
+
+		if (caching) {
+			cache_count(CACHE_MISS);
+			if (res.fill)
+				cache_store(url, headers, resp->http_code,
+				    hdr.data + hdr.start, hdr.pos - hdr.start,
+				    res.data, res.pos);
+		}
+
+		if (sink != NULL) {
+			/* everything was already passed to the sink */
+			free(hdr.data);
+			free(res.data);
+			hdr.data = res.data = NULL;
+		} else {
+			resp->hlen = hdr.pos;
+			resp->headers = hdr.data;
+			resp->blen = res.pos;
+			resp->body = res.data;
+		}
 	}
 
 	ret = 1;
 
 fail:
+	if (used != curl)
+		curl_easy_cleanup(used);
+	if (ce != NULL)
+		cache_release(ce);
 	if (url != NULL)
 		free(url);
-	if (curl != NULL)
-		curl_easy_cleanup(curl);
 	if (hdrs != NULL)
 		curl_slist_free_all(hdrs);
 
 	return ret;
 }
 
+size_t
+retried(void)
+{
+	return atomic_load(&nretried);
+}
+
+void
+hedge_show(void)
+{
+	curl_off_t after;
+
+	if (settings.hedge.pct == 0 && settings.hedge.delay == 0) {
+		puts("off");
+		return;
+	}
+
+	if (settings.hedge.delay != 0)
+		printf("after=%ldms", settings.hedge.delay);
+	else
+		printf("after=p%d.%d", settings.hedge.pct / 10,
+		    settings.hedge.pct % 10);
+
+	if ((after = hedge_after()) != -1)
+		printf(" (now %lld.%03lld ms)", (long long)after / 1000,
+		    (long long)after % 1000);
+	printf(", %zu hedged, %zu won\n", atomic_load(&nhedged),
+	    atomic_load(&nwon));
+}
+
+/* release the resources of the calling thread */
+void
+http_fini(void)
+{
+	if (multi != NULL)
+		curl_multi_cleanup(multi);
+	multi = NULL;
+}
+
 void
 free_resp(struct resp *r)
 {
@@ -270,4 +839,5 @@ free_resp(struct resp *r)
 		free(r->body);
 	if (r->err != NULL)
 		free(r->err);
+	free(r->info);
 }
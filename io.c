@@ -16,14 +16,17 @@
 
 #include "crest.h"
 
+#include <sys/stat.h>
+
 #include <err.h>
+#include <errno.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-char *
+static char *
 sgl(FILE *in)
 {
 	char *line = NULL;
@@ -40,48 +43,163 @@ sgl(FILE *in)
 	return line;
 }
 
+/* state of the line being read through the event loop */
+static int	 (*run)(char*);
+static int	 eof;
+static char	*lbuf;
+static size_t	 llen, lcap;
+
+static void
+print_prompt(void)
+{
+	printf("%s", prompt);
+	fflush(stdout);
+}
+
+/* run a line, with the input paused: the callbacks may end up calling
+ * ev_once() while waiting for the workers */
+static void
+run_paused(int fd, char *line)
+{
+	ev_set(fd, 0);
+	if (!run(line))
+		eof = 1;
+	ev_set(fd, POLLIN);
+}
+
 #if HAVE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
-char *
-rl(const char *prompt)
+
+static void
+rl_line(char *line)
 {
-	char *line;
+	/* don't keep the prompt around while running the command */
+	rl_callback_handler_remove();
 
-	if (!strcmp(getenv("TERM"), "dumb")) {
-		printf("%s", prompt);
-		fflush(stdout);
-		return sgl(stdin);
+	if (line == NULL) {
+		eof = 1;
+		return;
 	}
 
-	line = readline(prompt);
-	if (line && *line)
+	if (*line)
 		add_history(line);
 
-	return line;
+	run_paused(0, line);
+	free(line);
+
+	if (!eof)
+		rl_callback_handler_install(prompt, rl_line);
 }
-#else
-char *
-rl(const char *prompt)
+
+static void
+rl_readable(int fd, short ev, void *arg)
 {
-	printf("%s", prompt);
-	fflush(stdout);
-	return sgl(stdin);
+	(void)fd;
+	(void)ev;
+	(void)arg;
+
+	rl_callback_read_char();
 }
 #endif
 
-char *
-rlf(const char *prompt, FILE *in)
+/* read what's available on fd and run the complete lines */
+static void
+fd_readable(int fd, short ev, void *arg)
 {
-	if (isatty(fileno(in)))
-		return rl(prompt);
+	ssize_t n;
+	size_t i, start;
+	char *t;
+
+	(void)ev;
+	(void)arg;
+
+	if (llen == lcap) {
+		lcap = lcap == 0 ? BUFSIZ : lcap * 2;
+		if ((t = realloc(lbuf, lcap)) == NULL)
+			err(1, "realloc");
+		lbuf = t;
+	}
 
-	if (force_interactive) {
-		fprintf(in, "%s", prompt);
-		fflush(in);
+	if ((n = read(fd, lbuf + llen, lcap - llen)) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		err(1, "read");
 	}
 
-	return sgl(in);
+	if (n == 0) {
+		/* run the last line even if it's not terminated */
+		if (llen != 0 && llen < lcap) {
+			lbuf[llen] = '\0';
+			llen = 0;
+			run_paused(fd, lbuf);
+		}
+		eof = 1;
+		return;
+	}
+
+	llen += n;
+
+	start = 0;
+	for (i = 0; i < llen && !eof; ++i) {
+		if (lbuf[i] != '\n')
+			continue;
+		lbuf[i] = '\0';
+		run_paused(fd, lbuf + start);
+		start = i + 1;
+
+		if (!eof && i + 1 == llen && (isatty(fd) || force_interactive))
+			print_prompt();
+	}
+
+	memmove(lbuf, lbuf + start, llen - start);
+	llen -= start;
+}
+
+void
+read_lines(FILE *in, int (*fn)(char*))
+{
+	struct stat sb;
+	char *line;
+	int fd, tty;
+
+	run = fn;
+	eof = 0;
+	fd = fileno(in);
+
+	/* regular files never block, so there's no point in going
+	 * through the event loop */
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		while (!eof && (line = sgl(in)) != NULL) {
+			if (!run(line))
+				eof = 1;
+			free(line);
+		}
+		return;
+	}
+
+	tty = isatty(fd);
+
+#if HAVE_READLINE
+	if (tty && getenv("TERM") != NULL && strcmp(getenv("TERM"), "dumb")) {
+		rl_callback_handler_install(prompt, rl_line);
+		ev_add(fd, POLLIN, rl_readable, NULL);
+		while (!eof)
+			ev_once(-1);
+		ev_del(fd);
+		rl_callback_handler_remove();
+		return;
+	}
+#endif
+
+	if (tty || force_interactive)
+		print_prompt();
+
+	llen = 0;
+	ev_add(fd, POLLIN, fd_readable, NULL);
+	while (!eof)
+		ev_once(-1);
+	ev_del(fd);
 }
 
 int
@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A streaming JSON pretty-printer for set format json.  It doesn't
+ * parse: it copies the tokens, dropping the whitespace and adding its
+ * own, so it needs only the state of the token it's in and one bit per
+ * level for whether it's an object.  The runs of a string and of the
+ * whitespace are found 16 bytes at a time where SSE2 is available.
+ * The output is buffered and written with write(2); the control
+ * characters and the bytes past ASCII, C1 controls among them, are
+ * escaped as with vis(3), like the rest of the output.
+ */
+
+#include "crest.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define JF_MAXDEPTH	1024	/* deeper objects are printed as arrays */
+
+#define C_RESET		"\033[0m"
+#define C_NULL		"\033[1;30m"
+#define C_LIT		"\033[0;39m"
+#define C_STR		"\033[0;32m"
+#define C_KEY		"\033[34;1m"
+#define C_PUNCT		"\033[1;39m"
+
+struct jfmt {
+	int		 color;
+	size_t		 depth;
+	int		 instr;		/* in a string */
+	int		 esc;		/* after a backslash */
+	int		 inlit;		/* in a number, true, false or null */
+	int		 open;		/* a container was just opened */
+	int		 key;		/* a string here would be a key */
+	int		 any;		/* a value was printed already */
+	uint64_t	 obj[JF_MAXDEPTH / 64];
+	size_t		 len;
+	char		 buf[16384];
+};
+
+static void
+flush(struct jfmt *j)
+{
+	const char *s;
+	ssize_t n;
+
+	for (s = j->buf; j->len != 0; s += n, j->len -= n)
+		if ((n = write(1, s, j->len)) == -1)
+			err(1, "write");
+}
+
+static void
+put(struct jfmt *j, const char *s, size_t len)
+{
+	size_t n;
+
+	while (len != 0) {
+		if (j->len == sizeof(j->buf))
+			flush(j);
+		n = sizeof(j->buf) - j->len;
+		if (n > len)
+			n = len;
+		memcpy(j->buf + j->len, s, n);
+		j->len += n;
+		s += n;
+		len -= n;
+	}
+}
+
+static void
+puts_c(struct jfmt *j, const char *color)
+{
+	if (j->color)
+		put(j, color, strlen(color));
+}
+
+/* a byte that doesn't go to the terminal as it is */
+static int
+unsafe(unsigned char c)
+{
+	return c < 0x20 || c >= 0x7f;
+}
+
+static void
+put_vis(struct jfmt *j, unsigned char c)
+{
+	char v[5];
+
+	if (!unsafe(c)) {
+		put(j, (char *)&c, 1);
+		return;
+	}
+	vis(v, c, VIS_CSTYLE, 0);
+	put(j, v, strlen(v));
+}
+
+static void
+newline(struct jfmt *j)
+{
+	static const char spaces[] = "                                ";
+	size_t n;
+
+	put(j, "\n", 1);
+	for (n = j->depth * 2; n != 0; n -= n > 32 ? 32 : n)
+		put(j, spaces, n > 32 ? 32 : n);
+}
+
+static int
+in_obj(struct jfmt *j)
+{
+	size_t d;
+
+	if ((d = j->depth - 1) >= JF_MAXDEPTH)
+		return 0;
+	return (j->obj[d / 64] >> (d % 64)) & 1;
+}
+
+/* where a value begins */
+static void
+value(struct jfmt *j)
+{
+	if (j->open) {
+		newline(j);
+		j->open = 0;
+	} else if (j->depth == 0 && j->any)
+		put(j, "\n", 1);
+	j->any = 1;
+}
+
+/* how many bytes from s are in the string, up to a quote, a backslash
+ * or an unsafe byte */
+static size_t
+str_run(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+	__m128i v, m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, del), v));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len; ++i)
+		if (s[i] == '"' || s[i] == '\\' || unsafe(s[i]))
+			break;
+	return i;
+}
+
+static int
+is_ws(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* how many bytes from s are whitespace */
+static size_t
+ws_run(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	__m128i v, m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nl));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, cr));
+		if ((mask = ~_mm_movemask_epi8(m) & 0xffff) != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len && is_ws(s[i]); ++i)
+		;
+	return i;
+}
+
+static int
+ends_lit(char c)
+{
+	return is_ws(c) || (c != '\0' && strchr("{}[],:\"", c) != NULL);
+}
+
+static void
+jfmt_init(struct jfmt *j, int color)
+{
+	memset(j, 0, offsetof(struct jfmt, buf));
+	j->color = color;
+}
+
+/* format the next len bytes */
+static void
+jfmt_feed(struct jfmt *j, const char *s, size_t len)
+{
+	const char *end = s + len;
+	size_t n, d;
+	char c;
+
+	while (s < end) {
+		if (j->instr) {
+			if (j->esc) {
+				put_vis(j, *s++);
+				j->esc = 0;
+				continue;
+			}
+			n = str_run(s, end - s);
+			put(j, s, n);
+			if ((s += n) == end)
+				break;
+			if ((c = *s++) == '"') {
+				put(j, "\"", 1);
+				puts_c(j, C_RESET);
+				j->instr = 0;
+			} else if (c == '\\') {
+				put(j, "\\", 1);
+				j->esc = 1;
+			} else
+				put_vis(j, c);
+			continue;
+		}
+
+		if (j->inlit) {
+			for (n = 0; s + n < end && !ends_lit(s[n]); ++n)
+				put_vis(j, s[n]);
+			if ((s += n) == end)
+				break;
+			puts_c(j, C_RESET);
+			j->inlit = 0;
+		}
+
+		if (is_ws(*s)) {
+			s += ws_run(s, end - s);
+			continue;
+		}
+
+		switch (c = *s++) {
+		case '{':
+		case '[':
+			value(j);
+			puts_c(j, C_PUNCT);
+			put(j, &c, 1);
+			puts_c(j, C_RESET);
+			if ((d = j->depth++) < JF_MAXDEPTH) {
+				if (c == '{')
+					j->obj[d / 64] |= 1ULL << (d % 64);
+				else
+					j->obj[d / 64] &= ~(1ULL << (d % 64));
+			}
+			j->open = 1;
+			j->key = c == '{';
+			break;
+
+		case '}':
+		case ']':
+			if (j->depth != 0)
+				j->depth--;
+			if (!j->open)
+				newline(j);
+			j->open = 0;
+			j->key = 0;
+			puts_c(j, C_PUNCT);
+			put(j, &c, 1);
+			puts_c(j, C_RESET);
+			break;
+
+		case ',':
+			put(j, ",", 1);
+			newline(j);
+			j->key = j->depth != 0 && in_obj(j);
+			break;
+
+		case ':':
+			put(j, ": ", 2);
+			j->key = 0;
+			break;
+
+		case '"':
+			value(j);
+			puts_c(j, j->key ? C_KEY : C_STR);
+			put(j, "\"", 1);
+			j->instr = 1;
+			j->key = 0;
+			break;
+
+		default:
+			value(j);
+			puts_c(j, c == 'n' ? C_NULL : C_LIT);
+			put_vis(j, c);
+			j->inlit = 1;
+			break;
+		}
+	}
+}
+
+static void
+jfmt_end(struct jfmt *j)
+{
+	if (j->instr || j->inlit)
+		puts_c(j, C_RESET);
+	put(j, "\n", 1);
+	flush(j);
+}
+
+/* pretty-print the body if it looks like JSON and return 1, or return
+ * 0 without printing anything */
+int
+json_print(const char *s, size_t len, int color)
+{
+	struct jfmt j;
+	size_t n;
+
+	n = ws_run(s, len);
+	if (n == len || s[n] == '\0' ||
+	    strchr("{[\"-0123456789tfn", s[n]) == NULL)
+		return 0;
+
+	jfmt_init(&j, color);
+	jfmt_feed(&j, s + n, len - n);
+	jfmt_end(&j);
+	return 1;
+}
+
+/*
+ * extract walks the path over the body as it is: at every step the
+ * members or the elements before the one wanted are skipped, and the
+ * containers are skipped by looking only at their strings and
+ * brackets, so nothing is built and the rest of the body isn't read.
+ */
+
+/* how many bytes from s are before a quote or a backslash */
+static size_t
+qb_run(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+	__m128i v;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, q),
+		    _mm_cmpeq_epi8(v, bs)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len && s[i] != '"' && s[i] != '\\'; ++i)
+		;
+	return i;
+}
+
+static int
+is_struct(char c)
+{
+	return c == '"' || c == '{' || c == '}' || c == '[' || c == ']';
+}
+
+/* how many bytes from s are before a quote or a bracket */
+static size_t
+struct_run(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	/* the brackets are 0x5b, 0x5d, 0x7b and 0x7d: with the 0x20 bit
+	 * cleared, a 0x5b or 0x5d */
+	const __m128i q = _mm_set1_epi8('"'), up = _mm_set1_epi8(~0x20);
+	const __m128i ob = _mm_set1_epi8('['), cb = _mm_set1_epi8(']');
+	__m128i v, f, m;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		f = _mm_and_si128(v, up);
+		m = _mm_or_si128(_mm_cmpeq_epi8(f, ob), _mm_cmpeq_epi8(f, cb));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, q));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len && !is_struct(s[i]); ++i)
+		;
+	return i;
+}
+
+static const char *
+skip_ws(const char *s, const char *end)
+{
+	return s + ws_run(s, end - s);
+}
+
+/* the end of the string whose contents start at s */
+static const char *
+skip_str(const char *s, const char *end)
+{
+	while ((s += qb_run(s, end - s)) < end) {
+		if (*s++ == '"')
+			return s;
+		if (s == end)
+			return NULL;
+		s++;	/* the escaped character */
+	}
+	return NULL;
+}
+
+/* the end of the value at s */
+static const char *
+skip_value(const char *s, const char *end)
+{
+	size_t depth;
+
+	if (s >= end)
+		return NULL;
+
+	if (*s == '"')
+		return skip_str(s + 1, end);
+
+	if (*s == '{' || *s == '[') {
+		for (depth = 0; (s += struct_run(s, end - s)) < end;) {
+			switch (*s++) {
+			case '"':
+				if ((s = skip_str(s, end)) == NULL)
+					return NULL;
+				break;
+			case '{':
+			case '[':
+				depth++;
+				break;
+			default:
+				if (--depth == 0)
+					return s;
+			}
+		}
+		return NULL;
+	}
+
+	for (; s < end && !ends_lit(*s); ++s)
+		;
+	return s;
+}
+
+/* the value of the member key of the object at s */
+static const char *
+member(const char *s, const char *end, const char *key, size_t klen)
+{
+	const char *k;
+	int match;
+
+	if (s == end || *s != '{')
+		return NULL;
+
+	for (s = skip_ws(s + 1, end); s < end && *s == '"';) {
+		k = s + 1;
+		if ((s = skip_str(k, end)) == NULL)
+			return NULL;
+		match = (size_t)(s - 1 - k) == klen && !memcmp(k, key, klen);
+		s = skip_ws(s, end);
+		if (s == end || *s != ':')
+			return NULL;
+		s = skip_ws(s + 1, end);
+		if (match)
+			return s;
+		if ((s = skip_value(s, end)) == NULL)
+			return NULL;
+		s = skip_ws(s, end);
+		if (s == end || *s != ',')
+			return NULL;
+		s = skip_ws(s + 1, end);
+	}
+	return NULL;
+}
+
+/* the element idx of the array at s */
+static const char *
+element(const char *s, const char *end, long idx)
+{
+	if (s == end || *s != '[')
+		return NULL;
+
+	s = skip_ws(s + 1, end);
+	if (s == end || *s == ']')
+		return NULL;
+	for (; idx != 0; --idx) {
+		if ((s = skip_value(s, end)) == NULL)
+			return NULL;
+		s = skip_ws(s, end);
+		if (s == end || *s != ',')
+			return NULL;
+		s = skip_ws(s + 1, end);
+	}
+	return s;
+}
+
+static int
+hex4(const char *s, size_t len, unsigned long *u)
+{
+	char t[5];
+	size_t i;
+
+	if (len < 4)
+		return 0;
+	for (i = 0; i < 4; ++i)
+		if (!isxdigit((unsigned char)s[i]))
+			return 0;
+	memcpy(t, s, 4);
+	t[4] = '\0';
+	*u = strtoul(t, NULL, 16);
+	return 1;
+}
+
+static size_t
+utf8(char *d, unsigned long u)
+{
+	if (u >= 0xd800 && u < 0xe000)
+		u = 0xfffd;	/* a lone surrogate */
+	if (u < 0x80) {
+		d[0] = u;
+		return 1;
+	}
+	if (u < 0x800) {
+		d[0] = 0xc0 | (u >> 6);
+		d[1] = 0x80 | (u & 0x3f);
+		return 2;
+	}
+	if (u < 0x10000) {
+		d[0] = 0xe0 | (u >> 12);
+		d[1] = 0x80 | ((u >> 6) & 0x3f);
+		d[2] = 0x80 | (u & 0x3f);
+		return 3;
+	}
+	d[0] = 0xf0 | (u >> 18);
+	d[1] = 0x80 | ((u >> 12) & 0x3f);
+	d[2] = 0x80 | ((u >> 6) & 0x3f);
+	d[3] = 0x80 | (u & 0x3f);
+	return 4;
+}
+
+/* copy the contents of a string to d, without the escapes.  They're
+ * never shorter than what they stand for. */
+static size_t
+unescape(char *d, const char *s, size_t len)
+{
+	const char *end = s + len, *b;
+	unsigned long u, l;
+	size_t n = 0;
+
+	while (s < end) {
+		if ((b = memchr(s, '\\', end - s)) == NULL)
+			b = end;
+		memcpy(d + n, s, b - s);
+		n += b - s;
+		if ((s = b) == end || ++s == end)
+			break;
+
+		switch (*s++) {
+		case 'b':
+			d[n++] = '\b';
+			break;
+		case 'f':
+			d[n++] = '\f';
+			break;
+		case 'n':
+			d[n++] = '\n';
+			break;
+		case 'r':
+			d[n++] = '\r';
+			break;
+		case 't':
+			d[n++] = '\t';
+			break;
+		case 'u':
+			if (!hex4(s, end - s, &u)) {
+				d[n++] = 'u';
+				break;
+			}
+			s += 4;
+			if (u >= 0xd800 && u < 0xdc00 && end - s >= 6 &&
+			    s[0] == '\\' && s[1] == 'u' &&
+			    hex4(s + 2, end - s - 2, &l) &&
+			    l >= 0xdc00 && l < 0xe000) {
+				u = 0x10000 + ((u - 0xd800) << 10) +
+				    (l - 0xdc00);
+				s += 6;
+			}
+			n += utf8(d + n, u);
+			break;
+		default:
+			d[n++] = s[-1];
+		}
+	}
+	return n;
+}
+
+/* find the value at path, one of .key, ."key" or [index] after the
+ * other, in the body.  Return 1 and the value in val, the contents if
+ * it's a string and the text as it is otherwise; 0 if it's not there;
+ * -1 if the path is bad. */
+int
+json_extract(const char *body, size_t len, const char *path, char **val,
+    size_t *vlen)
+{
+	const char *s, *e, *end = body + len, *p, *k;
+	char *ep;
+	long idx;
+	size_t klen;
+
+	s = skip_ws(body, end);
+	for (p = path + 1; *p != '\0' && !isspace((unsigned char)*p);) {
+		if (*p == '[') {
+			errno = 0;
+			idx = strtol(p + 1, &ep, 10);
+			if (ep == p + 1 || *ep != ']' || idx < 0 || errno != 0)
+				goto bad;
+			p = ep + 1;
+			s = element(s, end, idx);
+		} else {
+			if (p != path + 1 && *p++ != '.')
+				goto bad;
+			if (*p == '"') {
+				if ((e = strchr(++p, '"')) == NULL)
+					goto bad;
+				k = p;
+				klen = e - p;
+				p = e + 1;
+			} else {
+				for (k = p; *p != '\0' && *p != '.' &&
+				    *p != '[' && !isspace((unsigned char)*p);
+				    ++p)
+					;
+				if ((klen = p - k) == 0)
+					goto bad;
+			}
+			s = member(s, end, k, klen);
+		}
+		if (s == NULL)
+			return 0;
+	}
+
+	if ((e = skip_value(s, end)) == NULL || e == s)
+		return 0;
+
+	if (*s == '"') {
+		if ((*val = malloc(e - s)) == NULL)
+			err(1, "malloc");
+		*vlen = unescape(*val, s + 1, e - s - 2);
+	} else {
+		if ((*val = malloc(e - s + 1)) == NULL)
+			err(1, "malloc");
+		memcpy(*val, s, e - s);
+		*vlen = e - s;
+	}
+	(*val)[*vlen] = '\0';
+	return 1;
+
+bad:
+	warnx("bad path: %s", path);
+	return -1;
+}
@@ -19,8 +19,10 @@
 #include "crest.h"
 
 #include <curl/curl.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,60 +31,212 @@
 const char *prgname;
 const char *prompt;
 int force_interactive;
+int single_process;
+int nthreads = 1;
+
+/* options given on the command line.  They're collected here and
+ * sent once we know whether we have to fork or not */
+static struct setopt	*opts;
+static size_t		 nopts;
+
+/* the prefixes to warm with -W */
+static char	*wlist;
+static size_t	 wlen;
 
 static void
 usage()
 {
-	printf("USAGE: %s [-i] [-H header] [-P port] [-V http version] "
-	       "[-c jtx] [-h host] [-p prefix] files...\n",
-		prgname);
+	printf("USAGE: %s [-1AiW] [-C cachedir] [-H header] [-P port] "
+	       "[-R log] [-S speed] [-V http version] [-c jtx] [-h host] "
+	       "[-o option=value] [-p prefix] [-t threads] [-w workers] "
+	       "files...\n", prgname);
 }
 
-int
-main(int argc, char **argv)
+/* a speed of replay as Nx, in thousandths, or 0 for max */
+static long
+parse_speed(const char *s)
 {
-	int ch, imsg_fds[2], i;
-	struct imsgbuf ibuf, child_ibuf;
+	char *ep;
+	double d;
+
+	if (!strcmp(s, "max"))
+		return 0;
+	d = strtod(s, &ep);
+	if (ep == s || (*ep != '\0' && strcmp(ep, "x")) || d < 0.001 ||
+	    d > 1000000)
+		return -1;
+	return d * 1000;
+}
 
-	if (argc > 0)
-		prgname = argv[0];
-	else
-		prgname = "crest";
+static void
+push_opt(enum imsg_type type, const void *value, size_t len)
+{
+	struct setopt *o;
+
+	o = recallocarray(opts, nopts, nopts + 1, sizeof(struct setopt));
+	if (o == NULL)
+		err(1, "recallocarray");
+	opts = o;
+
+	o = &opts[nopts++];
+	o->set = type;
+	o->len = len;
+	if ((o->value = malloc(len)) == NULL)
+		err(1, "malloc");
+	memcpy(o->value, value, len);
+}
 
-	prompt = "> ";
+/* -o option=value, as set would take it */
+static void
+push_set(const char *arg)
+{
+	struct cmd cmd;
+	char *line, *p;
+
+	if (asprintf(&line, "set %s", arg) == -1)
+		err(1, "asprintf");
+	p = line + 4 + strcspn(line + 4, "= \t");
+	if (*p == '=')
+		*p = ' ';
+
+	memset(&cmd, 0, sizeof(cmd));
+	if (!parse(line, &cmd) ||
+	    (cmd.type != CMD_SET && cmd.type != CMD_FORMAT))
+		errx(1, "-o: invalid option: %s", arg);
+	if (cmd.type == CMD_FORMAT) {
+		set_format(cmd.format);
+		free(line);
+		return;
+	}
+	if (cmd.opt.set == IMSG_SET_CACHE_DIR)
+		errx(1, "-o: use -C for the cache directory");
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, imsg_fds) == -1)
-		err(1, "socketpair");
+	push_opt(cmd.opt.set, cmd.opt.value, cmd.opt.len);
+	if (cmd.opt.dirty)
+		free(cmd.opt.value);
+	free(line);
+}
 
-	switch (fork()) {
-	case -1:
-		err(1, "fork");
+static void
+push_warm(const char *prefix, size_t len)
+{
+	char *t;
+
+	if ((t = realloc(wlist, wlen + len + 2)) == NULL)
+		err(1, "realloc");
+	wlist = t;
+	memcpy(wlist + wlen, prefix, len);
+	wlen += len;
+	wlist[wlen++] = '\n';
+	wlist[wlen] = '\0';
+}
 
-	case 0:
-		if (unveil("/etc/ssl/", "r") == -1)
-			err(1, "unveil");
-		if (pledge("stdio rpath dns inet", NULL) == -1)
-			err(1, "pledge");
-		close(imsg_fds[0]);
-		imsg_init(&child_ibuf, imsg_fds[1]);
-		return child_main(&child_ibuf);
+/* collect the prefixes set by the scripts */
+static void
+scan_prefixes(const char *path)
+{
+	FILE *f;
+	char *line, *p, *e;
+	size_t cap;
+	ssize_t n;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	line = NULL;
+	cap = 0;
+	while ((n = getline(&line, &cap, f)) != -1) {
+		for (p = line; isspace((unsigned char)*p); ++p)
+			;
+		if (strncmp(p, "set", 3) != 0 || !isspace((unsigned char)p[3]))
+			continue;
+		for (p += 3; isspace((unsigned char)*p); ++p)
+			;
+		if (strncmp(p, "prefix", 6) != 0 ||
+		    !isspace((unsigned char)p[6]))
+			continue;
+		for (p += 6; isspace((unsigned char)*p); ++p)
+			;
+		for (e = line + n; e > p && isspace((unsigned char)e[-1]); --e)
+			;
+		if (e != p)
+			push_warm(p, e - p);
 	}
 
-	if (pledge("exec proc rpath stdio tty", NULL) == -1)
-		err(1, "pledge");
+	free(line);
+	fclose(f);
+}
+
+/* whether a unix socket is given with -o, so the children have to be
+ * able to connect to it */
+static int
+wants_unix(void)
+{
+	size_t i;
+
+	for (i = 0; i < nopts; ++i)
+		if (opts[i].set == IMSG_SET_UNIX_SOCKET && opts[i].len != 0)
+			return 1;
+	return 0;
+}
 
-	close(imsg_fds[1]);
-	imsg_init(&ibuf, imsg_fds[0]);
+static void
+send_opts(void)
+{
+	size_t i;
+
+	for (i = 0; i < nopts; ++i) {
+		if (opts[i].set != IMSG_SET_UNIX_SOCKET)
+			wsend(opts[i].set, opts[i].value, opts[i].len);
+		else if (!unix_send(opts[i].value, opts[i].len))
+			exit(1);
+		free(opts[i].value);
+	}
+
+	free(opts);
+	opts = NULL;
+	nopts = 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i, n, wflag, status;
+	long speed;
+	const char *errstr, *cachedir, *rpath;
 
-	while ((ch = getopt(argc, argv, "AiH:P:V:c:h:p:")) != -1) {
+	if (argc > 0)
+		prgname = argv[0];
+	else
+		prgname = "crest";
+
+	prompt = "> ";
+	n = 1;
+	cachedir = NULL;
+	rpath = NULL;
+	speed = 1000;
+	wflag = 0;
+
+	while ((ch = getopt(argc, argv, "1AC:iH:P:R:S:V:Wc:h:o:p:t:w:")) !=
+	    -1) {
 		switch (ch) {
+#if ENABLE_SINGLE_PROCESS
+		case '1':
+			single_process = 1;
+			break;
+#endif
+
 		case 'A':
-			csend(&ibuf, IMSG_SET_PEER_VERIF, &(int) { 1 },
+			push_opt(IMSG_SET_PEER_VERIF, &(int) { 1 },
 			    sizeof(int));
 			break;
 
+		case 'C':
+			cachedir = optarg;
+			break;
+
 		case 'H':
-			csend(&ibuf, IMSG_ADD, optarg, strlen(optarg));
+			push_opt(IMSG_ADD, optarg, strlen(optarg));
 			break;
 
 		case 'P': {
@@ -92,10 +246,19 @@ main(int argc, char **argv)
 			port = strtonum(optarg, 1, 65535, &errstr);
 			if (errstr != NULL)
 				errx(1, "port is %s: %s", errstr, optarg);
-			csend(&ibuf, IMSG_SET_PORT, &port, sizeof(long));
+			push_opt(IMSG_SET_PORT, &port, sizeof(long));
 			break;
 		}
 
+		case 'R':
+			rpath = optarg;
+			break;
+
+		case 'S':
+			if ((speed = parse_speed(optarg)) == -1)
+				errx(1, "-S: bad speed %s", optarg);
+			break;
+
 		case 'V': {
 			long ver;
 
@@ -127,10 +290,14 @@ main(int argc, char **argv)
 			default:
 				errx(1, "-V: unknown value %s", optarg);
 			}
-			csend(&ibuf, IMSG_SET_HTTPVER, &ver, sizeof(long));
+			push_opt(IMSG_SET_HTTPVER, &ver, sizeof(long));
 			break;
 		}
 
+		case 'W':
+			wflag = 1;
+			break;
+
 		case 'c': {
 			char *h;
 			switch (*optarg) {
@@ -149,7 +316,7 @@ main(int argc, char **argv)
 			default:
 				err(1, "-c: unknown value %s", optarg);
 			}
-			csend(&ibuf, IMSG_ADD, h, strlen(h));
+			push_opt(IMSG_ADD, h, strlen(h));
 			break;
 		}
 
@@ -161,7 +328,7 @@ main(int argc, char **argv)
 			if (len == -1)
 				err(1, "asprintf");
 
-			csend(&ibuf, IMSG_ADD, hdr, len);
+			push_opt(IMSG_ADD, hdr, len);
 			free(hdr);
 
 			break;
@@ -171,14 +338,33 @@ main(int argc, char **argv)
 			force_interactive = 1;
 			break;
 
+		case 'o':
+			push_set(optarg);
+			break;
+
 		case 'p': {
 			size_t len;
 			if ((len = strlen(optarg)) == 0)
 				errx(1, "prefix is empty");
-			csend(&ibuf, IMSG_SET_PREFIX, optarg, len);
+			push_opt(IMSG_SET_PREFIX, optarg, len);
+			push_warm(optarg, len);
 			break;
 		}
 
+		case 't':
+			nthreads = strtonum(optarg, 1, MAX_THREADS, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of threads is %s: %s",
+				    errstr, optarg);
+			break;
+
+		case 'w':
+			n = strtonum(optarg, 1, MAX_WORKERS, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of workers is %s: %s", errstr,
+				    optarg);
+			break;
+
 		default:
 			usage();
 			return 1;
@@ -188,22 +374,65 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (single_process && (n != 1 || nthreads != 1))
+		errx(1, "-1 is mutually exclusive with -t and -w");
+
+	if (single_process) {
+		if (pledge("stdio rpath wpath cpath dns inet unix exec proc "
+		    "tty", NULL) == -1)
+			err(1, "pledge");
+		child_init();
+	} else {
+		unix_allowed = wants_unix();
+		spawn_workers(n);
+		if (pledge("exec proc rpath wpath cpath stdio tty sendfd",
+		    NULL) == -1)
+			err(1, "pledge");
+	}
+
+	/* a command in a pipe may exit without reading all its input */
+	signal(SIGPIPE, SIG_IGN);
+	send_opts();
+
+	if (cachedir != NULL && !dcache_send(cachedir))
+		errx(1, "cannot use the cache directory %s", cachedir);
+
+	if (wflag) {
+		for (i = 0; i < argc; ++i)
+			scan_prefixes(argv[i]);
+		if (wlen != 0)
+			warm_all(wlist, wlen);
+	}
+	free(wlist);
+
+	status = 0;
+	if (rpath != NULL) {
+		if (!replay(rpath, speed))
+			status = 1;
+		argc = 0;
+	}
+
 	for (i = 0; i < argc; ++i) {
 		FILE *f;
 
 		if ((f = fopen(argv[i], "r")) == NULL)
 			err(1, "%s", argv[i]);
 
-		repl(&ibuf, f);
+		repl(f);
 
 		fclose(f);
 	}
 
-	repl(&ibuf, stdin);
-	csend(&ibuf, IMSG_EXIT, NULL, 0);
-	wait(NULL);
+	if (rpath == NULL)
+		repl(stdin);
+	record_close();
+
+	if (single_process)
+		child_fini();
+	else
+		stop_workers();
 
 	printf("bye\n");
 
-	return 0;
+	return status;
 }
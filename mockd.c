@@ -0,0 +1,1709 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * crest-mockd, a server to point crest at when what's measured is
+ * crest itself.  Every request gets the same answer, as told by the
+ * flags: the size of the body, how long to wait before answering, the
+ * statuses to pick from and whether the body comes in one piece, in
+ * chunks or in chunks spaced in time.
+ *
+ * It speaks HTTP/1.1 and HTTP/2 in clear text, with prior knowledge or
+ * after an upgrade.  Of the HTTP/2 requests only the method is looked
+ * at, to not send a body to a HEAD, so the table of the header
+ * compression is set to zero: then the method is either in the static
+ * table or a literal.
+ *
+ * It's a single thread around epoll, or poll where there's no epoll.
+ * The delays are kept in a heap and are as precise as the millisecond
+ * timeout of the loop.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+
+#define INMAX		(128 * 1024)	/* stop reading past this */
+#define OUTMAX		(64 * 1024)	/* the output is made in these steps */
+
+#define H2_PREFACE	"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PRELEN	(sizeof(H2_PREFACE) - 1)
+#define H2_FRAME	16384		/* the largest frame we take */
+#define H2_WINDOW	65535
+
+/* frame types, flags and errors */
+enum { F_DATA, F_HEADERS, F_PRIORITY, F_RST_STREAM, F_SETTINGS,
+       F_PUSH_PROMISE, F_PING, F_GOAWAY, F_WINDOW_UPDATE, F_CONTINUATION };
+#define FL_END_STREAM	0x01
+#define FL_ACK		0x01
+#define FL_END_HEADERS	0x04
+#define FL_PADDED	0x08
+#define FL_PRIORITY	0x20
+#define E_PROTOCOL	0x1
+#define E_FLOW_CONTROL	0x3
+#define E_FRAME_SIZE	0x6
+
+enum { MODE_LENGTH, MODE_CHUNKED, MODE_STREAM };
+enum { D_FIXED, D_UNIFORM, D_EXP };
+enum { R_IDLE, R_WAIT, R_HEAD, R_BODY, R_PAUSE, R_DONE };
+
+struct buf {
+	char	*s;
+	size_t	 off, len, cap;		/* the data is s[off, len) */
+};
+
+struct resp {
+	int	 state;
+	int	 status;
+	int	 nobody;		/* HEAD, 204 or 304 */
+	int	 chunked;		/* send the body in chunks */
+	size_t	 size;			/* the length announced */
+	size_t	 left;			/* what's still to send */
+	size_t	 burst;			/* what's left of this chunk */
+};
+
+struct stream {
+	TAILQ_ENTRY(stream)	 entry;
+	uint32_t		 id;
+	int			 hdone;	/* the header block is complete */
+	int			 ended;	/* the request is all here */
+	int			 head;
+	int64_t			 window;
+	struct buf		 hb;
+	struct resp		 r;
+};
+
+struct conn {
+	int			 fd;
+	uint32_t		 gen;
+	short			 events;
+	int			 h2;
+	int			 eof;		/* no more requests */
+	int			 closing;	/* close once flushed */
+	int			 again;		/* look at the input again */
+	int			 nreq;
+	struct buf		 in, out;
+
+	/* HTTP/1.1 */
+	int			 busy;
+	int			 keepalive;
+	size_t			 skip;		/* the body to discard */
+	struct resp		 r;
+
+	/* HTTP/2 */
+	int			 preface;	/* the client's is still due */
+	int64_t			 window;
+	int64_t			 initwin;
+	size_t			 maxframe;
+	uint32_t		 lastid;
+	uint32_t		 cont;		/* waiting for a CONTINUATION */
+	TAILQ_HEAD(, stream)	 streams;
+};
+
+struct timer {
+	uint64_t	 at;
+	int		 fd;
+	uint32_t	 gen;
+	uint32_t	 id;
+};
+
+struct weight {
+	int		 status;
+	long long	 weight;
+};
+
+/* what the answers are like */
+static size_t		 size;
+static size_t		 chunk = 4096;
+static long		 interval = 10;
+static int		 mode = MODE_LENGTH;
+static int		 dkind = D_FIXED;
+static long		 dmin, dmax;
+static struct weight	*mix;
+static size_t		 nmix;
+static long long	 wtotal;
+static uint64_t		 rng = 1;
+static char		*body;
+
+static int		 lfd = -1;
+static struct conn	 lconn;		/* lfd, in the loop */
+static int		 lfull;		/* out of fds, lfd not watched */
+static int		 tcp;
+static struct conn	**conns;
+static size_t		 nconns;
+static uint32_t		 gens;
+static struct timer	*timers;
+static size_t		 ntimers, captimers;
+
+#if HAVE_EPOLL
+static int		 ep;
+#else
+static struct pollfd	*pfds;
+static size_t		 npfds;
+#endif
+
+static void	serve(struct conn*);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: crest-mockd [-a address] [-c chunk] "
+	    "[-d delay] [-i interval] [-m mode] [-p port] [-r seed] "
+	    "[-s size] [-u path] [-x status[:weight],...]\n");
+	exit(1);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* xorshift64*: the same seed gives the same sequence */
+static uint64_t
+rnd(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+static long
+pick_delay(void)
+{
+	double u;
+
+	switch (dkind) {
+	case D_UNIFORM:
+		return dmin + rnd() % (dmax - dmin + 1);
+	case D_EXP:
+		u = (rnd() >> 11) * 0x1.0p-53;
+		return -log(1.0 - u) * dmin + 0.5;
+	default:
+		return dmin;
+	}
+}
+
+static int
+pick_status(void)
+{
+	long long w;
+	size_t i;
+
+	if (nmix == 0)
+		return 200;
+	w = rnd() % wtotal;
+	for (i = 0; w >= mix[i].weight; ++i)
+		w -= mix[i].weight;
+	return mix[i].status;
+}
+
+static const char *
+reason(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 201: return "Created";
+	case 202: return "Accepted";
+	case 204: return "No Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 408: return "Request Timeout";
+	case 429: return "Too Many Requests";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+	case 505: return "HTTP Version Not Supported";
+	default:  return "Unknown";
+	}
+}
+
+static void
+buf_grow(struct buf *b, size_t n)
+{
+	size_t c;
+	char *t;
+
+	if (b->off != 0 && b->len + n > b->cap) {
+		memmove(b->s, b->s + b->off, b->len - b->off);
+		b->len -= b->off;
+		b->off = 0;
+	}
+	if (b->len + n <= b->cap)
+		return;
+
+	for (c = b->cap ? b->cap : 4096; c < b->len + n; c *= 2)
+		;
+	if ((t = realloc(b->s, c)) == NULL)
+		err(1, "realloc");
+	b->s = t;
+	b->cap = c;
+}
+
+static void
+buf_add(struct buf *b, const void *p, size_t n)
+{
+	buf_grow(b, n);
+	memcpy(b->s + b->len, p, n);
+	b->len += n;
+}
+
+static void
+buf_fmt(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	char t[256];
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(t, sizeof(t), fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= sizeof(t))
+		errx(1, "buf_fmt: too long");
+	buf_add(b, t, n);
+}
+
+static size_t
+buf_len(struct buf *b)
+{
+	return b->len - b->off;
+}
+
+static char *
+buf_data(struct buf *b)
+{
+	return b->s + b->off;
+}
+
+static void
+buf_drop(struct buf *b, size_t n)
+{
+	b->off += n;
+	if (b->off == b->len)
+		b->off = b->len = 0;
+}
+
+static void
+watch(struct conn *c, short ev)
+{
+#if HAVE_EPOLL
+	struct epoll_event e;
+	int op;
+
+	if (c->events == ev)
+		return;
+	memset(&e, 0, sizeof(e));
+	e.data.fd = c->fd;
+	if (ev & POLLIN)
+		e.events |= EPOLLIN;
+	if (ev & POLLOUT)
+		e.events |= EPOLLOUT;
+
+	/* out of the set when idle, or a hangup would wake us forever */
+	if (c->events <= 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = ev == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	if ((c->events > 0 || ev != 0) && epoll_ctl(ep, op, c->fd, &e) == -1)
+		err(1, "epoll_ctl");
+#else
+	size_t n;
+
+	if ((size_t)c->fd >= npfds) {
+		n = npfds ? npfds : 64;
+		while (n <= (size_t)c->fd)
+			n *= 2;
+		if ((pfds = reallocarray(pfds, n, sizeof(*pfds))) == NULL)
+			err(1, "reallocarray");
+		for (; npfds < n; ++npfds)
+			pfds[npfds].fd = -1;
+	}
+	pfds[c->fd].fd = ev ? c->fd : -1;
+	pfds[c->fd].events = ev;
+	pfds[c->fd].revents = 0;
+#endif
+	c->events = ev;
+}
+
+static void
+timer_add(long delay, struct conn *c, uint32_t id)
+{
+	struct timer *t;
+	uint64_t at;
+	size_t i, p, n;
+
+	if (ntimers == captimers) {
+		n = captimers ? captimers * 2 : 64;
+		if ((t = reallocarray(timers, n, sizeof(*t))) == NULL)
+			err(1, "reallocarray");
+		timers = t;
+		captimers = n;
+	}
+
+	at = now() + delay;
+	for (i = ntimers++; i > 0; i = p) {
+		p = (i - 1) / 2;
+		if (timers[p].at <= at)
+			break;
+		timers[i] = timers[p];
+	}
+	timers[i].at = at;
+	timers[i].fd = c->fd;
+	timers[i].gen = c->gen;
+	timers[i].id = id;
+}
+
+static void
+timer_pop(void)
+{
+	struct timer last;
+	size_t i, k;
+
+	last = timers[--ntimers];
+	for (i = 0; (k = 2 * i + 1) < ntimers; i = k) {
+		if (k + 1 < ntimers && timers[k + 1].at < timers[k].at)
+			k++;
+		if (timers[k].at >= last.at)
+			break;
+		timers[i] = timers[k];
+	}
+	timers[i] = last;
+}
+
+/* the answer to a request that's all here */
+static void
+start(struct conn *c, struct resp *r, int head, uint32_t id)
+{
+	long d;
+
+	r->status = pick_status();
+	r->nobody = head || r->status == 204 || r->status == 304;
+	r->size = size;
+	r->chunked = mode != MODE_LENGTH;
+	r->left = r->nobody ? 0 : size;
+	r->burst = chunk;
+	if ((d = pick_delay()) == 0)
+		r->state = R_HEAD;
+	else {
+		r->state = R_WAIT;
+		timer_add(d, c, id);
+	}
+}
+
+static struct conn *
+conn_new(int fd)
+{
+	struct conn *c, **t;
+	size_t n;
+
+	if ((size_t)fd >= nconns) {
+		n = nconns ? nconns : 64;
+		while (n <= (size_t)fd)
+			n *= 2;
+		if ((t = recallocarray(conns, nconns, n, sizeof(*t))) == NULL)
+			err(1, "recallocarray");
+		conns = t;
+		nconns = n;
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	c->fd = fd;
+	c->gen = ++gens;
+	c->events = -1;
+	TAILQ_INIT(&c->streams);
+	conns[fd] = c;
+	watch(c, POLLIN);
+	return c;
+}
+
+static void
+stream_free(struct conn *c, struct stream *st)
+{
+	TAILQ_REMOVE(&c->streams, st, entry);
+	free(st->hb.s);
+	free(st);
+}
+
+static void
+conn_close(struct conn *c)
+{
+	struct stream *st;
+
+	watch(c, 0);
+	close(c->fd);
+	conns[c->fd] = NULL;
+	if (lfull) {
+		lfull = 0;
+		watch(&lconn, POLLIN);
+	}
+	while ((st = TAILQ_FIRST(&c->streams)) != NULL)
+		stream_free(c, st);
+	free(c->in.s);
+	free(c->out.s);
+	free(c);
+}
+
+/* HTTP/2 */
+
+static uint32_t
+be32(const u_char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+h2_frame(struct conn *c, int type, int flags, uint32_t id, const void *p,
+    size_t len)
+{
+	u_char h[9];
+
+	h[0] = len >> 16;
+	h[1] = len >> 8;
+	h[2] = len;
+	h[3] = type;
+	h[4] = flags;
+	h[5] = id >> 24;
+	h[6] = id >> 16;
+	h[7] = id >> 8;
+	h[8] = id;
+	buf_add(&c->out, h, sizeof(h));
+	if (len != 0)
+		buf_add(&c->out, p, len);
+}
+
+static void
+h2_window(struct conn *c, uint32_t id, uint32_t n)
+{
+	u_char p[4];
+
+	p[0] = n >> 24;
+	p[1] = n >> 16;
+	p[2] = n >> 8;
+	p[3] = n;
+	h2_frame(c, F_WINDOW_UPDATE, 0, id, p, sizeof(p));
+}
+
+static void
+h2_goaway(struct conn *c, int code)
+{
+	u_char p[8];
+
+	p[0] = c->lastid >> 24;
+	p[1] = c->lastid >> 16;
+	p[2] = c->lastid >> 8;
+	p[3] = c->lastid;
+	p[4] = p[5] = p[6] = 0;
+	p[7] = code;
+	h2_frame(c, F_GOAWAY, 0, 0, p, sizeof(p));
+	c->closing = 1;
+}
+
+static void
+h2_start(struct conn *c)
+{
+	/* no dynamic table for the header compression */
+	static const u_char settings[] = { 0, 1, 0, 0, 0, 0 };
+
+	c->h2 = 1;
+	c->window = H2_WINDOW;
+	c->initwin = H2_WINDOW;
+	c->maxframe = H2_FRAME;
+	h2_frame(c, F_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+static int
+h2_settings(struct conn *c, const u_char *p, size_t len)
+{
+	struct stream *st;
+	uint32_t v;
+
+	if (len % 6 != 0)
+		return E_FRAME_SIZE;
+
+	for (; len != 0; p += 6, len -= 6) {
+		v = be32(p + 2);
+		switch (p[0] << 8 | p[1]) {
+		case 4:		/* the initial window */
+			if (v > INT32_MAX)
+				return E_FLOW_CONTROL;
+			TAILQ_FOREACH(st, &c->streams, entry)
+				st->window += (int64_t)v - c->initwin;
+			c->initwin = v;
+			break;
+		case 5:		/* the largest frame */
+			if (v < 16384 || v > 16777215)
+				return E_PROTOCOL;
+			c->maxframe = MIN(v, OUTMAX);
+			break;
+		}
+	}
+	return 0;
+}
+
+static struct stream *
+h2_stream(struct conn *c, uint32_t id)
+{
+	struct stream *st;
+
+	TAILQ_FOREACH(st, &c->streams, entry)
+		if (st->id == id)
+			return st;
+	return NULL;
+}
+
+static struct stream *
+stream_new(struct conn *c, uint32_t id)
+{
+	struct stream *st;
+
+	if ((st = calloc(1, sizeof(*st))) == NULL)
+		err(1, "calloc");
+	st->id = id;
+	st->window = c->initwin;
+	TAILQ_INSERT_TAIL(&c->streams, st, entry);
+	c->lastid = id;
+	return st;
+}
+
+static int
+hpack_int(const u_char **p, const u_char *end, int bits, size_t *v)
+{
+	size_t m;
+	int shift;
+
+	if (*p == end)
+		return 0;
+	m = (1 << bits) - 1;
+	if ((*v = *(*p)++ & m) < m)
+		return 1;
+	for (shift = 0; *p != end && shift < 28; shift += 7) {
+		*v += (size_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* whether the method in a header block is HEAD: indexed it can't be,
+ * as a literal it has the name at index 2 and the value as is or in
+ * the Huffman code */
+static int
+hpack_head(const u_char *p, size_t len)
+{
+	static const u_char huff[] = { 0xc7, 0x82, 0x1b, 0xff };
+	const u_char *end = p + len;
+	size_t idx, n;
+	int bits, h, i;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			if (!hpack_int(&p, end, 7, &idx))
+				return 0;
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) {	/* a table size update */
+			if (!hpack_int(&p, end, 5, &idx))
+				return 0;
+			continue;
+		}
+
+		bits = (*p & 0xc0) == 0x40 ? 6 : 4;
+		if (!hpack_int(&p, end, bits, &idx))
+			return 0;
+		for (i = idx == 0 ? 0 : 1; i < 2; ++i) {
+			if (p == end)
+				return 0;
+			h = *p & 0x80;
+			if (!hpack_int(&p, end, 7, &n) || n > (size_t)(end - p))
+				return 0;
+			if (idx == 2)
+				return h ? n == sizeof(huff) &&
+				    !memcmp(p, huff, n) :
+				    n == 4 && !memcmp(p, "HEAD", 4);
+			p += n;
+		}
+	}
+	return 0;
+}
+
+static void
+h2_headers_done(struct conn *c, struct stream *st)
+{
+	if (!st->hdone) {
+		st->hdone = 1;
+		st->head = hpack_head((u_char *)buf_data(&st->hb),
+		    buf_len(&st->hb));
+		free(st->hb.s);
+		memset(&st->hb, 0, sizeof(st->hb));
+	}
+	if (st->ended && st->r.state == R_IDLE)
+		start(c, &st->r, st->head, st->id);
+}
+
+static int
+h2_in(struct conn *c, int type, int flags, uint32_t id, const u_char *p,
+    size_t len)
+{
+	struct stream *st;
+	size_t off, pad;
+	uint32_t v;
+	int e;
+
+	if (c->cont != 0 && (type != F_CONTINUATION || id != c->cont))
+		return E_PROTOCOL;
+
+	st = id != 0 ? h2_stream(c, id) : NULL;
+
+	switch (type) {
+	case F_DATA:
+		if (id == 0)
+			return E_PROTOCOL;
+		if (len != 0) {
+			h2_window(c, 0, len);
+			if (st != NULL && !st->ended &&
+			    !(flags & FL_END_STREAM))
+				h2_window(c, id, len);
+		}
+		if (st != NULL && (flags & FL_END_STREAM)) {
+			st->ended = 1;
+			h2_headers_done(c, st);
+		}
+		break;
+
+	case F_HEADERS:
+		if (id == 0)
+			return E_PROTOCOL;
+		off = pad = 0;
+		if (flags & FL_PADDED) {
+			if (len == 0)
+				return E_PROTOCOL;
+			pad = p[0];
+			off = 1;
+		}
+		if (flags & FL_PRIORITY)
+			off += 5;
+		if (off + pad > len)
+			return E_PROTOCOL;
+
+		if (st == NULL) {
+			if ((id & 1) == 0 || id <= c->lastid)
+				return E_PROTOCOL;
+			st = stream_new(c, id);
+		}
+		if (!st->hdone)
+			buf_add(&st->hb, p + off, len - off - pad);
+		if (flags & FL_END_STREAM)
+			st->ended = 1;
+		if (flags & FL_END_HEADERS)
+			h2_headers_done(c, st);
+		else
+			c->cont = id;
+		break;
+
+	case F_RST_STREAM:
+		if (st != NULL)
+			stream_free(c, st);
+		break;
+
+	case F_SETTINGS:
+		if (id != 0)
+			return E_PROTOCOL;
+		if (flags & FL_ACK)
+			break;
+		if ((e = h2_settings(c, p, len)) != 0)
+			return e;
+		h2_frame(c, F_SETTINGS, FL_ACK, 0, NULL, 0);
+		break;
+
+	case F_PING:
+		if (len != 8)
+			return E_FRAME_SIZE;
+		if (!(flags & FL_ACK))
+			h2_frame(c, F_PING, FL_ACK, 0, p, len);
+		break;
+
+	case F_GOAWAY:
+		c->eof = 1;
+		break;
+
+	case F_WINDOW_UPDATE:
+		if (len != 4)
+			return E_FRAME_SIZE;
+		v = be32(p) & 0x7fffffff;
+		if (id == 0)
+			c->window += v;
+		else if (st != NULL)
+			st->window += v;
+		break;
+
+	case F_CONTINUATION:
+		if (id == 0 || id != c->cont)
+			return E_PROTOCOL;
+		if (st != NULL && !st->hdone)
+			buf_add(&st->hb, p, len);
+		if (flags & FL_END_HEADERS) {
+			c->cont = 0;
+			if (st != NULL)
+				h2_headers_done(c, st);
+		}
+		break;
+	}
+	return 0;
+}
+
+static void
+h2_input(struct conn *c)
+{
+	const u_char *p;
+	size_t n, len;
+	int e;
+
+	if (c->preface) {
+		n = buf_len(&c->in);
+		if (memcmp(buf_data(&c->in), H2_PREFACE, MIN(n, H2_PRELEN))) {
+			h2_goaway(c, E_PROTOCOL);
+			return;
+		}
+		if (n < H2_PRELEN)
+			return;
+		buf_drop(&c->in, H2_PRELEN);
+		c->preface = 0;
+	}
+
+	while (!c->closing && (n = buf_len(&c->in)) >= 9) {
+		p = (u_char *)buf_data(&c->in);
+		len = p[0] << 16 | p[1] << 8 | p[2];
+		if (len > H2_FRAME) {
+			h2_goaway(c, E_FRAME_SIZE);
+			return;
+		}
+		if (n < 9 + len)
+			return;
+		e = h2_in(c, p[3], p[4], be32(p + 5) & 0x7fffffff, p + 9, len);
+		buf_drop(&c->in, 9 + len);
+		if (e != 0)
+			h2_goaway(c, e);
+	}
+}
+
+static void
+h2_head(struct conn *c, struct stream *st)
+{
+	struct resp *r = &st->r;
+	u_char hb[64];
+	size_t n;
+	int l;
+
+	/* literals without indexing: :status, content-length and
+	 * content-type have the names at 8, 28 and 31 */
+	n = 0;
+	hb[n++] = 0x08;
+	hb[n++] = 3;
+	n += snprintf((char *)hb + n, sizeof(hb) - n, "%03d", r->status);
+	if (r->status != 204 && r->status != 304 && !r->chunked) {
+		hb[n++] = 0x0f;
+		hb[n++] = 28 - 15;
+		l = snprintf((char *)hb + n + 1, sizeof(hb) - n - 1, "%zu",
+		    r->size);
+		hb[n++] = l;
+		n += l;
+	}
+	hb[n++] = 0x0f;
+	hb[n++] = 31 - 15;
+	hb[n++] = 10;
+	memcpy(hb + n, "text/plain", 10);
+	n += 10;
+
+	h2_frame(c, F_HEADERS, FL_END_HEADERS |
+	    (r->left == 0 ? FL_END_STREAM : 0), st->id, hb, n);
+}
+
+/* a frame of a stream, if it can: 1 if done something */
+static int
+h2_step(struct conn *c, struct stream *st)
+{
+	struct resp *r = &st->r;
+	int64_t n;
+
+	switch (r->state) {
+	case R_HEAD:
+		h2_head(c, st);
+		if (r->left == 0)
+			stream_free(c, st);
+		else
+			r->state = R_BODY;
+		return 1;
+
+	case R_BODY:
+		n = r->chunked ? MIN(r->left, r->burst) : r->left;
+		n = MIN(n, (int64_t)c->maxframe);
+		n = MIN(n, c->window);
+		n = MIN(n, st->window);
+		if (n <= 0)
+			return 0;
+
+		h2_frame(c, F_DATA, (size_t)n == r->left ? FL_END_STREAM : 0,
+		    st->id, body, n);
+		c->window -= n;
+		st->window -= n;
+		r->left -= n;
+		r->burst -= MIN((size_t)n, r->burst);
+
+		if (r->left == 0)
+			stream_free(c, st);
+		else if (r->chunked && r->burst == 0) {
+			r->burst = chunk;
+			if (mode == MODE_STREAM) {
+				r->state = R_PAUSE;
+				timer_add(interval, c, st->id);
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static void
+h2_fill(struct conn *c)
+{
+	struct stream *st, *t;
+	int more;
+
+	/* after an upgrade, curl takes only so much before the preface */
+	if (c->preface)
+		return;
+
+	do {
+		more = 0;
+		for (st = TAILQ_FIRST(&c->streams); st != NULL; st = t) {
+			t = TAILQ_NEXT(st, entry);
+			if (buf_len(&c->out) >= OUTMAX)
+				return;
+			more |= h2_step(c, st);
+		}
+	} while (more);
+}
+
+/* the settings in the HTTP2-Settings header, in base64url */
+static int
+h2_upgrade_settings(struct conn *c, const char *s, size_t len)
+{
+	static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789-_";
+	u_char p[256];
+	const char *x;
+	size_t i, n;
+	uint32_t acc;
+	int bits;
+
+	n = 0;
+	acc = 0;
+	bits = 0;
+	for (i = 0; i < len && s[i] != '='; ++i) {
+		if (s[i] == '+')
+			x = b64 + 62;
+		else if (s[i] == '/')
+			x = b64 + 63;
+		else if ((x = strchr(b64, s[i])) == NULL || s[i] == '\0')
+			return 0;
+		acc = acc << 6 | (x - b64);
+		if ((bits += 6) >= 8) {
+			bits -= 8;
+			if (n == sizeof(p))
+				return 0;
+			p[n++] = acc >> bits;
+		}
+	}
+	return h2_settings(c, p, n) == 0;
+}
+
+/* HTTP/1.1 */
+
+static int
+has_token(const char *v, size_t len, const char *tok)
+{
+	size_t i, j, n;
+
+	n = strlen(tok);
+	for (i = 0; i < len; i = j + 1) {
+		for (; i < len && (v[i] == ' ' || v[i] == '\t'); ++i)
+			;
+		for (j = i; j < len && v[j] != ','; ++j)
+			;
+		while (j > i && (v[j - 1] == ' ' || v[j - 1] == '\t'))
+			--j;
+		if (j - i == n && !strncasecmp(v + i, tok, n))
+			return 1;
+		for (; j < len && v[j] != ','; ++j)
+			;
+	}
+	return 0;
+}
+
+static void
+h1_fail(struct conn *c, int status)
+{
+	struct resp *r = &c->r;
+
+	memset(r, 0, sizeof(*r));
+	r->status = status;
+	r->nobody = 1;
+	r->state = R_HEAD;
+	c->busy = 1;
+	c->keepalive = 0;
+	c->skip = 0;
+	c->eof = 1;
+}
+
+/* the request in the first len bytes of the input */
+static void
+h1_request(struct conn *c, char *s, size_t len)
+{
+	struct stream *st;
+	const char *errstr, *h2s;
+	char *l, *e, *end, *v;
+	size_t h2slen, vlen;
+	long long n;
+	int v11, head, close, keep, expect, upgrade;
+
+	end = s + len - 2;
+	c->nreq++;
+
+	/* the request line */
+	l = s;
+	e = memmem(l, end - l, "\r\n", 2);
+	*e = '\0';
+	head = !strncmp(l, "HEAD ", 5);
+	if ((v = strrchr(l, ' ')) == NULL || strncmp(v + 1, "HTTP/1.", 7) ||
+	    (v[8] != '0' && v[8] != '1') || v[9] != '\0') {
+		buf_drop(&c->in, len);
+		h1_fail(c, v != NULL && !strncmp(v + 1, "HTTP/", 5) ? 505 :
+		    400);
+		return;
+	}
+	v11 = v[8] == '1';
+
+	close = keep = expect = upgrade = 0;
+	h2s = NULL;
+	h2slen = 0;
+	for (l = e + 2; l < end; l = e + 2) {
+		e = memmem(l, end + 2 - l, "\r\n", 2);
+		if ((v = memchr(l, ':', e - l)) == NULL)
+			continue;
+		for (++v; v < e && (*v == ' ' || *v == '\t'); ++v)
+			;
+		vlen = e - v;
+
+#define IS(name) (!strncasecmp(l, name ":", sizeof(name)))
+		if (IS("Content-Length")) {
+			*e = '\0';
+			n = strtonum(v, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL) {
+				buf_drop(&c->in, len);
+				h1_fail(c, 400);
+				return;
+			}
+			c->skip = n;
+		} else if (IS("Transfer-Encoding")) {
+			if (!has_token(v, vlen, "identity")) {
+				buf_drop(&c->in, len);
+				h1_fail(c, 501);
+				return;
+			}
+		} else if (IS("Connection")) {
+			close |= has_token(v, vlen, "close");
+			keep |= has_token(v, vlen, "keep-alive");
+		} else if (IS("Expect"))
+			expect = has_token(v, vlen, "100-continue");
+		else if (IS("Upgrade"))
+			upgrade = has_token(v, vlen, "h2c");
+		else if (IS("HTTP2-Settings")) {
+			h2s = v;
+			h2slen = vlen;
+		}
+#undef IS
+	}
+
+	buf_drop(&c->in, len);
+	c->keepalive = v11 ? !close : keep;
+	c->busy = 1;
+	if (expect && c->skip != 0)
+		buf_fmt(&c->out, "HTTP/1.1 100 Continue\r\n\r\n");
+
+	/* the upgrade is taken only for requests without a body */
+	if (upgrade && h2s != NULL && c->skip == 0 && v11) {
+		buf_fmt(&c->out, "HTTP/1.1 101 Switching Protocols\r\n"
+		    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+		h2_start(c);
+		c->preface = 1;
+		c->busy = 0;
+		if (!h2_upgrade_settings(c, h2s, h2slen)) {
+			h2_goaway(c, E_PROTOCOL);
+			return;
+		}
+		st = stream_new(c, 1);
+		st->hdone = st->ended = 1;
+		start(c, &st->r, head, st->id);
+		return;
+	}
+
+	start(c, &c->r, head, 0);
+	if (!v11)
+		c->r.chunked = 0;
+}
+
+static void
+h1_input(struct conn *c)
+{
+	char *s, *e;
+	size_t n;
+
+	while (!c->h2 && !c->closing) {
+		n = buf_len(&c->in);
+		if (c->skip != 0) {
+			n = MIN(n, c->skip);
+			buf_drop(&c->in, n);
+			if ((c->skip -= n) != 0)
+				return;
+			continue;
+		}
+		if (c->busy || n == 0)
+			return;
+
+		s = buf_data(&c->in);
+		if (c->nreq == 0 && !memcmp(s, H2_PREFACE, MIN(n, H2_PRELEN))) {
+			if (n < H2_PRELEN)
+				return;
+			buf_drop(&c->in, H2_PRELEN);
+			h2_start(c);
+			return;
+		}
+
+		if ((e = memmem(s, n, "\r\n\r\n", 4)) == NULL) {
+			if (n >= INMAX)
+				h1_fail(c, 431);
+			return;
+		}
+		h1_request(c, s, e + 4 - s);
+	}
+}
+
+static void
+h1_head(struct conn *c)
+{
+	struct resp *r = &c->r;
+
+	buf_fmt(&c->out, "HTTP/1.1 %d %s\r\n", r->status, reason(r->status));
+	if (r->status != 204 && r->status != 304) {
+		if (r->chunked)
+			buf_fmt(&c->out, "Transfer-Encoding: chunked\r\n");
+		else
+			buf_fmt(&c->out, "Content-Length: %zu\r\n", r->size);
+	}
+	buf_fmt(&c->out, "Content-Type: text/plain\r\n%s\r\n",
+	    c->keepalive ? "" : "Connection: close\r\n");
+}
+
+static void
+h1_fill(struct conn *c)
+{
+	struct resp *r = &c->r;
+	size_t n;
+
+	while (buf_len(&c->out) < OUTMAX) {
+		switch (r->state) {
+		case R_HEAD:
+			h1_head(c);
+			r->state = r->nobody ? R_DONE : R_BODY;
+			break;
+
+		case R_BODY:
+			if (!r->chunked) {
+				n = MIN(r->left, OUTMAX);
+				buf_add(&c->out, body, n);
+				if ((r->left -= n) == 0)
+					r->state = R_DONE;
+				break;
+			}
+
+			if (r->left == 0) {
+				buf_fmt(&c->out, "0\r\n\r\n");
+				r->state = R_DONE;
+				break;
+			}
+			n = MIN(MIN(r->left, r->burst), OUTMAX);
+			buf_fmt(&c->out, "%zx\r\n", n);
+			buf_add(&c->out, body, n);
+			buf_fmt(&c->out, "\r\n");
+			r->left -= n;
+			if ((r->burst -= n) == 0) {
+				r->burst = chunk;
+				if (mode == MODE_STREAM && r->left != 0) {
+					r->state = R_PAUSE;
+					timer_add(interval, c, 0);
+					return;
+				}
+			}
+			break;
+
+		case R_DONE:
+			r->state = R_IDLE;
+			c->busy = 0;
+			if (c->keepalive)
+				c->again = 1;
+			else
+				c->closing = 1;
+			return;
+
+		default:
+			return;
+		}
+	}
+}
+
+/* write what's ready: -1 if the connection is gone */
+static int
+output(struct conn *c)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (buf_len(&c->out) < OUTMAX && !c->closing) {
+			if (c->h2)
+				h2_fill(c);
+			else
+				h1_fill(c);
+		}
+		if (buf_len(&c->out) == 0)
+			return 0;
+
+		n = write(c->fd, buf_data(&c->out), buf_len(&c->out));
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf_drop(&c->out, n);
+	}
+}
+
+static void
+serve(struct conn *c)
+{
+	short ev;
+	int idle;
+
+	do {
+		c->again = 0;
+		if (!c->h2)
+			h1_input(c);
+		if (c->h2)
+			h2_input(c);
+		if (output(c) == -1) {
+			conn_close(c);
+			return;
+		}
+	} while (c->again && !c->closing);
+
+	idle = c->h2 ? TAILQ_EMPTY(&c->streams) : !c->busy;
+	if (buf_len(&c->out) == 0 && (c->closing || (c->eof && idle))) {
+		conn_close(c);
+		return;
+	}
+
+	ev = 0;
+	if (!c->eof && !c->closing && buf_len(&c->in) < INMAX)
+		ev |= POLLIN;
+	if (buf_len(&c->out) != 0)
+		ev |= POLLOUT;
+	watch(c, ev);
+}
+
+static void
+conn_event(struct conn *c, int ev)
+{
+	ssize_t n;
+
+	if (ev & POLLERR) {
+		conn_close(c);
+		return;
+	}
+
+	if ((ev & (POLLIN | POLLHUP)) && (c->events & POLLIN)) {
+		buf_grow(&c->in, 16384);
+		n = read(c->fd, c->in.s + c->in.len, c->in.cap - c->in.len);
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			conn_close(c);
+			return;
+		}
+		if (n == 0)
+			c->eof = 1;
+		if (n > 0)
+			c->in.len += n;
+	} else if ((ev & POLLHUP) && !(c->events & POLLOUT)) {
+		/* nobody to answer to anymore */
+		conn_close(c);
+		return;
+	}
+
+	serve(c);
+}
+
+static void
+timer_fire(struct timer *t)
+{
+	struct stream *st;
+	struct resp *r;
+	struct conn *c;
+
+	if ((size_t)t->fd >= nconns || (c = conns[t->fd]) == NULL ||
+	    c->gen != t->gen)
+		return;
+
+	if (t->id == 0)
+		r = &c->r;
+	else if ((st = h2_stream(c, t->id)) != NULL)
+		r = &st->r;
+	else
+		return;
+
+	if (r->state == R_WAIT)
+		r->state = R_HEAD;
+	else if (r->state == R_PAUSE)
+		r->state = R_BODY;
+	else
+		return;
+	serve(c);
+}
+
+/* accept a connection, non-blocking and close-on-exec */
+static int
+accept_nb(int s)
+{
+#if HAVE_ACCEPT4
+	return accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int fd, flags;
+
+	if ((fd = accept(s, NULL, NULL)) == -1)
+		return -1;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "fcntl");
+	return fd;
+#endif
+}
+
+static void
+do_accept(void)
+{
+	int fd, one = 1;
+
+	for (;;) {
+		if ((fd = accept_nb(lfd)) == -1) {
+			/* the pending connection would keep lfd readable,
+			 * so stop watching it until one is closed */
+			if (errno == EMFILE || errno == ENFILE) {
+				warn("accept");
+				lfull = 1;
+				watch(&lconn, 0);
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				err(1, "accept");
+			return;
+		}
+		if (tcp && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+		    sizeof(one)) == -1)
+			warn("setsockopt TCP_NODELAY");
+		conn_new(fd);
+	}
+}
+
+static void
+dispatch(int fd, int ev)
+{
+	if (fd == lfd)
+		do_accept();
+	else if ((size_t)fd < nconns && conns[fd] != NULL)
+		conn_event(conns[fd], ev);
+}
+
+static void
+loop(void)
+{
+#if HAVE_EPOLL
+	struct epoll_event evs[256];
+	int ev;
+#endif
+	struct timer t;
+	uint64_t n;
+	int i, nev, timeout;
+
+	for (;;) {
+		timeout = -1;
+		if (ntimers != 0) {
+			n = now();
+			timeout = timers[0].at <= n ? 0 :
+			    MIN(timers[0].at - n, INT_MAX);
+		}
+
+#if HAVE_EPOLL
+		nev = epoll_wait(ep, evs, 256, timeout);
+		if (nev == -1 && errno != EINTR)
+			err(1, "epoll_wait");
+		for (i = 0; i < nev; ++i) {
+			ev = 0;
+			if (evs[i].events & EPOLLIN)
+				ev |= POLLIN;
+			if (evs[i].events & EPOLLOUT)
+				ev |= POLLOUT;
+			if (evs[i].events & EPOLLHUP)
+				ev |= POLLHUP;
+			if (evs[i].events & EPOLLERR)
+				ev |= POLLERR;
+			dispatch(evs[i].data.fd, ev);
+		}
+#else
+		nev = poll(pfds, npfds, timeout);
+		if (nev == -1 && errno != EINTR)
+			err(1, "poll");
+		for (i = 0; nev > 0 && (size_t)i < npfds; ++i) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0)
+				continue;
+			dispatch(i, pfds[i].revents);
+		}
+#endif
+
+		for (n = now(); ntimers != 0 && timers[0].at <= n; ) {
+			t = timers[0];
+			timer_pop();
+			timer_fire(&t);
+		}
+	}
+}
+
+/* a delay in milliseconds, with an optional ms or s suffix */
+static int
+parse_ms(const char *s, long *r)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (ep == s || n < 0 || errno == ERANGE)
+		return 0;
+	if (!strcmp(ep, "s"))
+		n *= 1000;
+	else if (*ep != '\0' && strcmp(ep, "ms"))
+		return 0;
+	if (n > INT_MAX)
+		return 0;
+	*r = n;
+	return 1;
+}
+
+/* a size with an optional k or m suffix */
+static int
+parse_bytes(const char *s, size_t *r)
+{
+	char *ep;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(s, &ep, 10);
+	if (ep == s || *s == '-' || errno == ERANGE)
+		return 0;
+	switch (*ep) {
+	case 'm':
+	case 'M':
+		n *= 1024;
+		/* fallthrough */
+	case 'k':
+	case 'K':
+		n *= 1024;
+		ep++;
+		break;
+	}
+	if (*ep != '\0' || n > SIZE_MAX / 2)
+		return 0;
+	*r = n;
+	return 1;
+}
+
+/* N, A-B or exp:MEAN */
+static void
+parse_delay(char *s)
+{
+	char *t;
+
+	if (!strncmp(s, "exp:", 4)) {
+		dkind = D_EXP;
+		if (!parse_ms(s + 4, &dmin))
+			errx(1, "invalid delay: %s", s);
+		return;
+	}
+
+	if ((t = strchr(s, '-')) != NULL) {
+		dkind = D_UNIFORM;
+		*t++ = '\0';
+		if (!parse_ms(s, &dmin) || !parse_ms(t, &dmax) || dmin > dmax)
+			errx(1, "invalid delay: %s-%s", s, t);
+		return;
+	}
+
+	dkind = D_FIXED;
+	if (!parse_ms(s, &dmin))
+		errx(1, "invalid delay: %s", s);
+}
+
+/* status[:weight],... */
+static void
+parse_mix(char *s)
+{
+	const char *errstr;
+	char *t, *w;
+
+	free(mix);
+	mix = NULL;
+	nmix = 0;
+	wtotal = 0;
+	while ((t = strsep(&s, ",")) != NULL) {
+		if ((mix = reallocarray(mix, nmix + 1, sizeof(*mix))) == NULL)
+			err(1, "reallocarray");
+		mix[nmix].weight = 1;
+		if ((w = strchr(t, ':')) != NULL) {
+			*w++ = '\0';
+			mix[nmix].weight = strtonum(w, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "weight is %s: %s", errstr, w);
+		}
+		mix[nmix].status = strtonum(t, 200, 599, &errstr);
+		if (errstr != NULL)
+			errx(1, "status is %s: %s", errstr, t);
+		wtotal += mix[nmix++].weight;
+	}
+}
+
+static void
+listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat sb;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s",
+	    path) >= sizeof(sun.sun_path))
+		errx(1, "%s: path too long", path);
+
+	/* a socket left by a previous run */
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode) &&
+	    unlink(path) == -1)
+		err(1, "unlink %s", path);
+
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0)) == -1)
+		err(1, "socket");
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind %s", path);
+	if (listen(lfd, SOMAXCONN) == -1)
+		err(1, "listen");
+	printf("%s\n", path);
+}
+
+static void
+listen_tcp(const char *addr, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	char h[NI_MAXHOST], p[NI_MAXSERV];
+	int e, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((e = getaddrinfo(addr, port, &hints, &res)) != 0)
+		errx(1, "%s:%s: %s", addr, port, gai_strerror(e));
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		lfd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+		    SOCK_CLOEXEC, ai->ai_protocol);
+		if (lfd == -1)
+			continue;
+		setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(lfd);
+		lfd = -1;
+	}
+	if (lfd == -1)
+		err(1, "can't bind %s:%s", addr, port);
+	freeaddrinfo(res);
+
+	if (listen(lfd, SOMAXCONN) == -1)
+		err(1, "listen");
+	tcp = 1;
+
+	/* say where, for a port picked by the system */
+	len = sizeof(ss);
+	if (getsockname(lfd, (struct sockaddr *)&ss, &len) == -1)
+		err(1, "getsockname");
+	if ((e = getnameinfo((struct sockaddr *)&ss, len, h, sizeof(h), p,
+	    sizeof(p), NI_NUMERICHOST | NI_NUMERICSERV)) != 0)
+		errx(1, "getnameinfo: %s", gai_strerror(e));
+	printf(strchr(h, ':') ? "http://[%s]:%s\n" : "http://%s:%s\n", h, p);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *addr = "127.0.0.1", *port = "8080", *upath = NULL;
+	const char *errstr;
+	size_t i, n;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "a:c:d:i:m:p:r:s:u:x:")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'c':
+			if (!parse_bytes(optarg, &chunk) || chunk == 0)
+				errx(1, "invalid chunk size: %s", optarg);
+			break;
+		case 'd':
+			parse_delay(optarg);
+			break;
+		case 'i':
+			if (!parse_ms(optarg, &interval))
+				errx(1, "invalid interval: %s", optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "length"))
+				mode = MODE_LENGTH;
+			else if (!strcmp(optarg, "chunked"))
+				mode = MODE_CHUNKED;
+			else if (!strcmp(optarg, "stream"))
+				mode = MODE_STREAM;
+			else
+				errx(1, "unknown mode: %s", optarg);
+			break;
+		case 'p':
+			strtonum(optarg, 0, 65535, &errstr);
+			if (errstr != NULL)
+				errx(1, "port is %s: %s", errstr, optarg);
+			port = optarg;
+			break;
+		case 'r':
+			rng = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "seed is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			if (!parse_bytes(optarg, &size))
+				errx(1, "invalid size: %s", optarg);
+			break;
+		case 'u':
+			upath = optarg;
+			break;
+		case 'x':
+			parse_mix(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the body of every answer is cut from here */
+	n = MIN(size, OUTMAX);
+	if ((body = malloc(n + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < n; ++i)
+		body[i] = (i % 64) == 63 ? '\n' : 'a' + i % 26;
+
+#if HAVE_EPOLL
+	if ((ep = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(1, "epoll_create1");
+#endif
+
+	if (upath != NULL)
+		listen_unix(upath);
+	else
+		listen_tcp(addr, port);
+	fflush(stdout);
+
+	if (pledge("stdio inet unix", NULL) == -1)
+		err(1, "pledge");
+
+	/* the listening socket goes in the loop as a conn of its own */
+	lconn.fd = lfd;
+	lconn.events = -1;
+	watch(&lconn, POLLIN);
+
+	loop();
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The multiplexer.  When a child has more than one worker, the
+ * transfers of all of them are performed by a single thread through
+ * one curl multi handle, so the requests in flight at the same time
+ * can share the connections: as HTTP/2 streams on one connection, or
+ * one connection each.  A worker hands over its easy handle and
+ * sleeps until the transfer is done, so the callbacks run in the
+ * multiplexer thread.  A transfer whose output the writer can't take
+ * is paused, and the others go on; the writer wakes the multiplexer
+ * up when it catches up, and the paused ones are resumed.
+ */
+
+#include "crest.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+struct xfer {
+	TAILQ_ENTRY(xfer)	 entry;
+	CURL			*curl;
+	CURLcode		 code;
+	int			 done;
+	int			 paused;
+};
+
+/* a copy of the settings, taken by the main thread */
+struct conf {
+	int	 strategy;
+	long	 max_streams;
+	long	 max_host_conns;
+};
+
+static TAILQ_HEAD(, xfer) queue = TAILQ_HEAD_INITIALIZER(queue);
+
+/* only touched by the multiplexer thread */
+static TAILQ_HEAD(, xfer) paused = TAILQ_HEAD_INITIALIZER(paused);
+static _Atomic int	 npaused;
+static pthread_mutex_t	 mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 cond = PTHREAD_COND_INITIALIZER;
+static pthread_t	 thread;
+static CURLM		*multi;
+static int		 started, quit, dirty;
+static struct conf	 conf;
+
+/* how many connections were opened for how many requests */
+static _Atomic size_t	 nconns, nreqs;
+
+/* start over with the current conf.  Nothing is in flight, since the
+ * settings can't change during a request, so the connections of the
+ * previous strategy can go. */
+static void
+configure(void)
+{
+	if (multi != NULL)
+		curl_multi_cleanup(multi);
+	if ((multi = curl_multi_init()) == NULL)
+		errx(1, "curl_multi_init failed");
+
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING,
+	    conf.strategy == STRATEGY_MULTIPLEX ? CURLPIPE_MULTIPLEX :
+	    CURLPIPE_NOTHING);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+	    conf.max_host_conns);
+	if (conf.max_streams != 0)
+		curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+		    conf.max_streams);
+}
+
+static void
+finish(CURLMsg *msg)
+{
+	struct xfer *x;
+	CURLcode code;
+	long n;
+
+	code = msg->data.result;
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&x);
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_NUM_CONNECTS, &n);
+	curl_multi_remove_handle(multi, msg->easy_handle);
+
+	/* it can time out while paused */
+	if (x->paused) {
+		TAILQ_REMOVE(&paused, x, entry);
+		atomic_fetch_sub(&npaused, 1);
+	}
+
+	atomic_fetch_add(&nconns, n);
+	atomic_fetch_add(&nreqs, 1);
+
+	pthread_mutex_lock(&mtx);
+	x->code = code;
+	x->done = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mtx);
+}
+
+static void *
+mux_main(void *arg)
+{
+	struct xfer *x;
+	CURLMsg *msg;
+	int running, left;
+
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&mtx);
+		if (quit) {
+			pthread_mutex_unlock(&mtx);
+			break;
+		}
+		if (dirty) {
+			configure();
+			dirty = 0;
+		}
+		while ((x = TAILQ_FIRST(&queue)) != NULL) {
+			TAILQ_REMOVE(&queue, x, entry);
+			curl_multi_add_handle(multi, x->curl);
+		}
+		pthread_mutex_unlock(&mtx);
+
+		/* a transfer paused again goes to the tail, and only once
+		 * the writer is behind again */
+		while (pool_drained() && (x = TAILQ_FIRST(&paused)) != NULL) {
+			TAILQ_REMOVE(&paused, x, entry);
+			x->paused = 0;
+			atomic_fetch_sub(&npaused, 1);
+			curl_easy_pause(x->curl, CURLPAUSE_CONT);
+		}
+
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+			if (msg->msg == CURLMSG_DONE)
+				finish(msg);
+
+		/* curl_multi_wakeup interrupts it */
+		curl_multi_poll(multi, NULL, 0, 1000, NULL);
+	}
+
+	return NULL;
+}
+
+void
+mux_start(void)
+{
+	mux_reconf();
+	configure();
+	dirty = 0;
+	atomic_init(&nconns, 0);
+	atomic_init(&nreqs, 0);
+
+	if (pthread_create(&thread, NULL, mux_main, NULL))
+		errx(1, "pthread_create");
+	started = 1;
+}
+
+/* called after the workers are gone */
+void
+mux_stop(void)
+{
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&mtx);
+	quit = 1;
+	curl_multi_wakeup(multi);
+	pthread_mutex_unlock(&mtx);
+	pthread_join(thread, NULL);
+
+	curl_multi_cleanup(multi);
+	multi = NULL;
+	started = 0;
+}
+
+/* the settings changed: take them for the next transfers */
+void
+mux_reconf(void)
+{
+	pthread_mutex_lock(&mtx);
+	conf.strategy = settings.strategy;
+	conf.max_streams = settings.max_streams;
+	conf.max_host_conns = settings.max_host_conns;
+	dirty = 1;
+	/* with the lock held, so multi isn't being replaced */
+	if (started)
+		curl_multi_wakeup(multi);
+	pthread_mutex_unlock(&mtx);
+}
+
+/* like curl_easy_perform, but through the multiplexer if it's running */
+CURLcode
+mux_perform(CURL *curl)
+{
+	struct xfer x;
+
+	if (!started)
+		return curl_easy_perform(curl);
+
+	memset(&x, 0, sizeof(x));
+	x.curl = curl;
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, &x);
+
+	/* wait for a connection that may take the stream, instead of
+	 * opening a new one */
+	if (settings.strategy == STRATEGY_MULTIPLEX)
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+
+	pthread_mutex_lock(&mtx);
+	TAILQ_INSERT_TAIL(&queue, &x, entry);
+	curl_multi_wakeup(multi);
+	while (!x.done)
+		pthread_cond_wait(&cond, &mtx);
+	pthread_mutex_unlock(&mtx);
+
+	return x.code;
+}
+
+/* return 1 if called by the multiplexer thread */
+int
+mux_thread(void)
+{
+	return started && pthread_equal(pthread_self(), thread);
+}
+
+/* curl was paused by its write callback, in the multiplexer thread */
+void
+mux_pause(CURL *curl)
+{
+	struct xfer *x;
+
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&x);
+	x->paused = 1;
+	TAILQ_INSERT_TAIL(&paused, x, entry);
+	atomic_fetch_add(&npaused, 1);
+}
+
+/* wake the multiplexer up, if there are transfers to resume */
+void
+mux_resume(void)
+{
+	if (atomic_load(&npaused) == 0)
+		return;
+
+	pthread_mutex_lock(&mtx);
+	if (started)
+		curl_multi_wakeup(multi);
+	pthread_mutex_unlock(&mtx);
+}
+
+void
+mux_show(void)
+{
+	printf("%s", settings.strategy == STRATEGY_MULTIPLEX ? "multiplex" :
+	    "spread");
+	if (started)
+		printf(", %zu connections for %zu requests",
+		    atomic_load(&nconns), atomic_load(&nreqs));
+	putchar('\n');
+}
@@ -19,9 +19,12 @@
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 /* used to return the address in parse_set */
 static long curl_http_versions[] = {
@@ -33,6 +36,7 @@ static long curl_http_versions[] = {
 	CURL_HTTP_VERSION_NONE,
 };
 static int bools[] = { 0, 1 };
+static int strategies[] = { STRATEGY_MULTIPLEX, STRATEGY_SPREAD };
 
 const char *
 method2str(enum http_methods m)
@@ -112,10 +116,23 @@ parse_setting(const char **r, const char **opt, enum imsg_type *mt)
 	 * IMSG_SHOW_HEADERS, since the add command is used only for headers
 	 */
 	const char *opts[] = { "headers", "useragent", "prefix", "http",
-		"http-version", "port", "peer-verification" };
+		"http-version", "port", "peer-verification", "queue", "timing",
+		"cache-size", "cache", "cache-dir", "retry",
+		"hedge", "timeout", "connect-timeout", "low-speed", "strategy",
+		"max-streams", "max-host-connections", "resolve",
+		"dns-cache-ttl", "tcp-nodelay", "tcp-keepalive", "tcp-fastopen",
+		"buffer-size", "upload-buffer-size", "so-rcvbuf",
+		"unix-socket" };
 	const enum imsg_type o2t[] = { IMSG_ADD, IMSG_SET_UA, IMSG_SET_PREFIX,
 		IMSG_SET_HTTPVER, IMSG_SET_HTTPVER, IMSG_SET_PORT,
-		IMSG_SET_PEER_VERIF };
+		IMSG_SET_PEER_VERIF, IMSG_SHOW_QUEUE, IMSG_TIMING,
+		IMSG_SET_CACHE_SIZE, IMSG_SHOW_CACHE, IMSG_SET_CACHE_DIR,
+		IMSG_SET_RETRY, IMSG_SET_HEDGE, IMSG_SET_TIMEOUT,
+		IMSG_SET_CONNECT_TIMEOUT, IMSG_SET_LOW_SPEED, IMSG_SET_STRATEGY,
+		IMSG_SET_MAX_STREAMS, IMSG_SET_MAX_HOST_CONNS, IMSG_SET_RESOLVE,
+		IMSG_SET_DNS_TTL, IMSG_SET_NODELAY, IMSG_SET_KEEPALIVE,
+		IMSG_SET_FASTOPEN, IMSG_SET_BUFFERSIZE, IMSG_SET_UPLOAD_BUFSIZE,
+		IMSG_SET_RCVBUF, IMSG_SET_UNIX_SOCKET };
 	const char *i;
 
 	n = sizeof(opts) / sizeof(char *);
@@ -155,6 +172,233 @@ parse_setting(const char **r, const char **opt, enum imsg_type *mt)
 	return 1;
 }
 
+/* if the setting at *r is the format, that the parent keeps for itself
+ * instead of sending it to the children, skip it and return 1 */
+static int
+format_setting(const char **r)
+{
+	const char *i;
+
+	i = eat_spaces(*r);
+	if (strncasecmp(i, "format", 6) ||
+	    (i[6] != '\0' && !isspace((unsigned char)i[6])))
+		return 0;
+	*r = eat_spaces(i + 6);
+	return 1;
+}
+
+/* return 1 if the option can only be shown */
+static int
+show_only(enum imsg_type t)
+{
+	return t == IMSG_SHOW_QUEUE || t == IMSG_TIMING ||
+	    t == IMSG_SHOW_CACHE;
+}
+
+/* parse a size with an optional k, m or g suffix */
+int
+parse_size(const char *s, size_t *r)
+{
+	char *ep;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(s, &ep, 10);
+	if (ep == s || *s == '-' || errno == ERANGE)
+		return 0;
+
+	switch (tolower((unsigned char)*ep)) {
+	case 'g':
+		n *= 1024;
+		/* fallthrough */
+	case 'm':
+		n *= 1024;
+		/* fallthrough */
+	case 'k':
+		n *= 1024;
+		ep++;
+		break;
+	}
+
+	if (*ep != '\0' || n > SIZE_MAX)
+		return 0;
+	*r = n;
+	return 1;
+}
+
+/* parse a duration in milliseconds, with an optional ms, s or m
+ * suffix */
+int
+parse_duration(const char *s, long *r)
+{
+	char *ep;
+	long long n, mult;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (ep == s || n < 0 || errno == ERANGE)
+		return 0;
+
+	if (!strcmp(ep, "m"))
+		mult = 60 * 1000;
+	else if (!strcmp(ep, "s"))
+		mult = 1000;
+	else if (*ep == '\0' || !strcmp(ep, "ms"))
+		mult = 1;
+	else
+		return 0;
+
+	if (n > LONG_MAX / mult)
+		return 0;
+	*r = n * mult;
+	return 1;
+}
+
+/* check a host:port:addr[,addr...] for set resolve */
+static int
+valid_resolve(const char *s)
+{
+	const char *c;
+	size_t n;
+
+	if ((c = strchr(s, ':')) == NULL || c == s || strchr(s, ' ') != NULL)
+		return 0;
+	for (n = 0, ++c; isdigit((unsigned char)*c) && n <= 65535; ++c)
+		n = n * 10 + (*c - '0');
+	return *c == ':' && n > 0 && n <= 65535 && c[1] != '\0';
+}
+
+/* parse "size/duration", i.e. 1k/10s */
+static int
+parse_low_speed(const char *s, long *limit, long *time)
+{
+	const char *sl;
+	char *t;
+	size_t n;
+	int ok;
+
+	if ((sl = strchr(s, '/')) == NULL)
+		return 0;
+	if ((t = strndup(s, sl - s)) == NULL)
+		err(1, "strndup");
+	ok = parse_size(t, &n) && n > 0 && n <= LONG_MAX &&
+	    parse_duration(sl + 1, time) && *time > 0;
+	free(t);
+	*limit = n;
+	return ok;
+}
+
+/* parse "idle[/interval]", rounded up to seconds; the interval
+ * defaults to the idle time */
+static int
+parse_keepalive(const char *s, long *idle, long *intvl)
+{
+	const char *sl;
+	char *t;
+	int ok;
+
+	if ((sl = strchr(s, '/')) == NULL) {
+		if (!parse_duration(s, idle) || *idle <= 0)
+			return 0;
+		*intvl = *idle;
+	} else {
+		if ((t = strndup(s, sl - s)) == NULL)
+			err(1, "strndup");
+		ok = parse_duration(t, idle) && *idle > 0 &&
+		    parse_duration(sl + 1, intvl) && *intvl > 0;
+		free(t);
+		if (!ok)
+			return 0;
+	}
+
+	*idle = *idle / 1000 + (*idle % 1000 != 0);
+	*intvl = *intvl / 1000 + (*intvl % 1000 != 0);
+	return 1;
+}
+
+/* parse "n [backoff min..max] [all]" */
+static int
+parse_retry(const char *s, struct retry *r)
+{
+	const char *errstr;
+	char *t, *w, *p, *sp;
+	int ok;
+
+	r->max = 0;
+	r->min = 100;
+	r->cap = 5000;
+	r->all = 0;
+
+	if ((t = strdup(s)) == NULL)
+		err(1, "strdup");
+
+	ok = 0;
+	if ((w = strtok_r(t, " \t", &sp)) == NULL)
+		goto done;
+	r->max = strtonum(w, 0, 100, &errstr);
+	if (errstr != NULL) {
+		warnx("retry count is %s: %s", errstr, w);
+		goto done;
+	}
+
+	while ((w = strtok_r(NULL, " \t", &sp)) != NULL) {
+		if (!strcmp(w, "all")) {
+			r->all = 1;
+			continue;
+		}
+		if (strcmp(w, "backoff") ||
+		    (w = strtok_r(NULL, " \t", &sp)) == NULL) {
+			warnx("syntax: set retry n [backoff min..max] [all]");
+			goto done;
+		}
+		if ((p = strstr(w, "..")) == NULL) {
+			warnx("invalid backoff: %s", w);
+			goto done;
+		}
+		*p = '\0';
+		if (!parse_duration(w, &r->min) ||
+		    !parse_duration(p + 2, &r->cap) || r->min > r->cap) {
+			warnx("invalid backoff: %s..%s", w, p + 2);
+			goto done;
+		}
+	}
+	ok = 1;
+
+done:
+	free(t);
+	return ok;
+}
+
+/* parse "after=pNN[.N]" or "after=duration" */
+static int
+parse_hedge(const char *s, struct hedge *h)
+{
+	char *ep;
+	double p;
+
+	h->pct = 0;
+	h->delay = 0;
+
+	if (strncmp(s, "after=", 6) != 0) {
+		warnx("syntax: set hedge after=pNN|duration");
+		return 0;
+	}
+	s += 6;
+
+	/* it's waited in microseconds */
+	if (*s != 'p')
+		return parse_duration(s, &h->delay) && h->delay != 0 &&
+		    h->delay <= LONG_MAX / 1000;
+
+	errno = 0;
+	p = strtod(s + 1, &ep);
+	if (ep == s + 1 || *ep != '\0' || errno == ERANGE || p < 1 ||
+	    p > 99.9)
+		return 0;
+	h->pct = p * 10 + 0.5;
+	return 1;
+}
+
 /* parse a string that starts with "show" */
 static int
 parse_show(const char *i, struct cmd *cmd)
@@ -171,7 +415,10 @@ parse_show(const char *i, struct cmd *cmd)
 
 	i += 4; /* skip the "show" */
 
-	if (!parse_setting(&i, &opt, &cmd->show))
+	if (format_setting(&i)) {
+		cmd->type = CMD_FORMAT;
+		cmd->format = -1;
+	} else if (!parse_setting(&i, &opt, &cmd->show))
 		return 0;
 
 	i = eat_spaces(i);
@@ -196,6 +443,23 @@ parse_set(const char *i, struct cmd *cmd)
 
 	i += 3; /* skip the "set" */
 
+	if (format_setting(&i)) {
+		cmd->type = CMD_FORMAT;
+		if (!strcmp(i, "raw"))
+			cmd->format = FORMAT_RAW;
+		else if (!strcmp(i, "json"))
+			cmd->format = FORMAT_JSON;
+		else if (*i == '\0') {
+			warnx("missing value for set format");
+			return 0;
+		} else {
+			warnx("unknown format %s", i);
+			return 0;
+		}
+		return 1;
+	}
+
+	cmd->opt.dirty = 0;
 	if (!parse_setting(&i, &opt, &cmd->opt.set))
 		return 0;
 
@@ -204,6 +468,11 @@ parse_set(const char *i, struct cmd *cmd)
 		return 0;
 	}
 
+	if (show_only(cmd->opt.set)) {
+		warnx("cannot set %s.", opt);
+		return 0;
+	}
+
 	i = eat_spaces(i);
 	if (*i == '\0') {
 		warnx("missing value for set %s", opt);
@@ -215,10 +484,41 @@ parse_set(const char *i, struct cmd *cmd)
 	switch (cmd->opt.set) {
 	case IMSG_SET_UA:
 	case IMSG_SET_PREFIX:
+	case IMSG_SET_CACHE_DIR:
+	case IMSG_SET_UNIX_SOCKET:
+		cmd->opt.value = (void *)i;
+		cmd->opt.len = strlen(i);
+		return 1;
+
+	case IMSG_SET_RESOLVE:
+		if (!valid_resolve(i)) {
+			warnx("syntax: set resolve host:port:addr[,addr...]");
+			return 0;
+		}
 		cmd->opt.value = (void *)i;
 		cmd->opt.len = strlen(i);
 		return 1;
 
+	case IMSG_SET_DNS_TTL: {
+		long *ms;
+
+		if ((ms = malloc(sizeof(*ms))) == NULL)
+			err(1, "malloc");
+
+		if (!strcmp(i, "forever"))
+			*ms = -1;
+		else if (!parse_duration(i, ms)) {
+			warnx("invalid duration: %s", i);
+			free(ms);
+			return 0;
+		}
+
+		cmd->opt.value = ms;
+		cmd->opt.len = sizeof(*ms);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
 	case IMSG_SET_HTTPVER: {
 		cmd->opt.len = sizeof(long);
 
@@ -258,9 +558,187 @@ parse_set(const char *i, struct cmd *cmd)
 
 		cmd->opt.value = port;
 		cmd->opt.len = sizeof(long);
+		cmd->opt.dirty = 1;
 		return 1;
 	}
 
+	case IMSG_SET_CACHE_SIZE: {
+		size_t *size;
+
+		if ((size = malloc(sizeof(*size))) == NULL)
+			err(1, "malloc");
+
+		if (!parse_size(i, size)) {
+			warnx("invalid size: %s", i);
+			free(size);
+			return 0;
+		}
+
+		cmd->opt.value = size;
+		cmd->opt.len = sizeof(*size);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_RETRY: {
+		struct retry *r;
+
+		if ((r = malloc(sizeof(*r))) == NULL)
+			err(1, "malloc");
+
+		if (!parse_retry(i, r)) {
+			free(r);
+			return 0;
+		}
+
+		cmd->opt.value = r;
+		cmd->opt.len = sizeof(*r);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_HEDGE: {
+		struct hedge *h;
+
+		if ((h = malloc(sizeof(*h))) == NULL)
+			err(1, "malloc");
+
+		if (!parse_hedge(i, h)) {
+			warnx("invalid hedge: %s", i);
+			free(h);
+			return 0;
+		}
+
+		cmd->opt.value = h;
+		cmd->opt.len = sizeof(*h);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_TIMEOUT:
+	case IMSG_SET_CONNECT_TIMEOUT: {
+		long *ms;
+
+		if ((ms = malloc(sizeof(*ms))) == NULL)
+			err(1, "malloc");
+
+		if (!parse_duration(i, ms)) {
+			warnx("invalid duration: %s", i);
+			free(ms);
+			return 0;
+		}
+
+		cmd->opt.value = ms;
+		cmd->opt.len = sizeof(*ms);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_LOW_SPEED: {
+		long *ls;
+
+		if ((ls = malloc(2 * sizeof(*ls))) == NULL)
+			err(1, "malloc");
+
+		if (!parse_low_speed(i, &ls[0], &ls[1])) {
+			warnx("syntax: set low-speed size/duration");
+			free(ls);
+			return 0;
+		}
+
+		cmd->opt.value = ls;
+		cmd->opt.len = 2 * sizeof(*ls);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_STRATEGY:
+		if (!strcmp(i, "multiplex"))
+			cmd->opt.value = &strategies[0];
+		else if (!strcmp(i, "spread"))
+			cmd->opt.value = &strategies[1];
+		else {
+			warnx("unknown strategy %s", i);
+			return 0;
+		}
+		cmd->opt.len = sizeof(int);
+		return 1;
+
+	case IMSG_SET_MAX_STREAMS:
+	case IMSG_SET_MAX_HOST_CONNS: {
+		const char *errstr;
+		long *n;
+
+		if ((n = malloc(sizeof(*n))) == NULL)
+			err(1, "malloc");
+
+		*n = strtonum(i, 1, INT_MAX, &errstr);
+		if (errstr != NULL) {
+			warnx("%s is %s: %s", opt, errstr, i);
+			free(n);
+			return 0;
+		}
+
+		cmd->opt.value = n;
+		cmd->opt.len = sizeof(*n);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_KEEPALIVE: {
+		long *ka;
+
+		if ((ka = calloc(2, sizeof(*ka))) == NULL)
+			err(1, "calloc");
+
+		if (strcmp(i, "off") && !parse_keepalive(i, &ka[0], &ka[1])) {
+			warnx("syntax: set tcp-keepalive off|idle[/interval]");
+			free(ka);
+			return 0;
+		}
+
+		cmd->opt.value = ka;
+		cmd->opt.len = 2 * sizeof(*ka);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_BUFFERSIZE:
+	case IMSG_SET_UPLOAD_BUFSIZE:
+	case IMSG_SET_RCVBUF: {
+		size_t size, min, max;
+		long *n;
+
+		/* what libcurl accepts, or it'd clamp them silently */
+		if (cmd->opt.set == IMSG_SET_BUFFERSIZE) {
+			min = 1024;
+			max = CURL_MAX_READ_SIZE;
+		} else if (cmd->opt.set == IMSG_SET_UPLOAD_BUFSIZE) {
+			min = 16 * 1024;
+			max = 2 * 1024 * 1024;
+		} else {
+			min = 1;
+			max = INT_MAX;
+		}
+
+		if (!parse_size(i, &size) || size < min || size > max) {
+			warnx("%s must be between %zu and %zu bytes: %s", opt,
+			    min, max, i);
+			return 0;
+		}
+
+		if ((n = malloc(sizeof(*n))) == NULL)
+			err(1, "malloc");
+		*n = size;
+
+		cmd->opt.value = n;
+		cmd->opt.len = sizeof(*n);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_NODELAY:
+	case IMSG_SET_FASTOPEN:
 	case IMSG_SET_PEER_VERIF:
 		if (!strcmp(i, "on") || !strcmp(i, "true"))
 			cmd->opt.value = &bools[1];
@@ -290,6 +768,13 @@ parse_unset(const char *i, struct cmd *cmd)
 
 	i += 5; /* skip the "unset" */
 
+	if (format_setting(&i)) {
+		cmd->type = CMD_FORMAT;
+		cmd->format = FORMAT_RAW;
+		return 1;
+	}
+
+	cmd->opt.dirty = 0;
 	if (!parse_setting(&i, &opt, &cmd->opt.set))
 		return 0;
 
@@ -298,13 +783,34 @@ parse_unset(const char *i, struct cmd *cmd)
 		return 0;
 	}
 
+	if (show_only(cmd->opt.set)) {
+		warnx("cannot unset %s.", opt);
+		return 0;
+	}
+
 	switch (cmd->opt.set) {
 	case IMSG_SET_UA:
 	case IMSG_SET_PREFIX:
+	case IMSG_SET_CACHE_DIR:
+	case IMSG_SET_RESOLVE:
+	case IMSG_SET_UNIX_SOCKET:
 		cmd->opt.value = NULL;
 		cmd->opt.len = 0;
 		return 1;
 
+	case IMSG_SET_DNS_TTL: {
+		long *ms;
+
+		if ((ms = malloc(sizeof(*ms))) == NULL)
+			err(1, "malloc");
+
+		*ms = 60 * 1000;	/* libcurl's default */
+		cmd->opt.value = ms;
+		cmd->opt.len = sizeof(*ms);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
 	case IMSG_SET_HTTPVER:
 		cmd->opt.len = sizeof(long);
 		cmd->opt.value = &curl_http_versions[5]; /* none */
@@ -320,14 +826,86 @@ parse_unset(const char *i, struct cmd *cmd)
 
 		cmd->opt.value = port;
 		cmd->opt.len = sizeof(long);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_CACHE_SIZE: {
+		size_t *size;
+
+		if ((size = calloc(1, sizeof(*size))) == NULL)
+			err(1, "calloc");
+
+		cmd->opt.value = size;
+		cmd->opt.len = sizeof(*size);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_RETRY: {
+		struct retry *r;
+
+		if ((r = calloc(1, sizeof(*r))) == NULL)
+			err(1, "calloc");
+
+		cmd->opt.value = r;
+		cmd->opt.len = sizeof(*r);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_HEDGE: {
+		struct hedge *h;
+
+		if ((h = calloc(1, sizeof(*h))) == NULL)
+			err(1, "calloc");
+
+		cmd->opt.value = h;
+		cmd->opt.len = sizeof(*h);
+		cmd->opt.dirty = 1;
+		return 1;
+	}
+
+	case IMSG_SET_STRATEGY:
+		cmd->opt.value = &strategies[0];
+		cmd->opt.len = sizeof(int);
+		return 1;
+
+	case IMSG_SET_TIMEOUT:
+	case IMSG_SET_CONNECT_TIMEOUT:
+	case IMSG_SET_LOW_SPEED:
+	case IMSG_SET_MAX_STREAMS:
+	case IMSG_SET_MAX_HOST_CONNS:
+	case IMSG_SET_KEEPALIVE:
+	case IMSG_SET_BUFFERSIZE:
+	case IMSG_SET_UPLOAD_BUFSIZE:
+	case IMSG_SET_RCVBUF: {
+		long *zero;
+
+		/* room for the two longs of low-speed and tcp-keepalive */
+		if ((zero = calloc(2, sizeof(*zero))) == NULL)
+			err(1, "calloc");
+
+		cmd->opt.value = zero;
+		cmd->opt.len = sizeof(*zero);
+		if (cmd->opt.set == IMSG_SET_LOW_SPEED ||
+		    cmd->opt.set == IMSG_SET_KEEPALIVE)
+			cmd->opt.len *= 2;
+		cmd->opt.dirty = 1;
 		return 1;
 	}
 
+	case IMSG_SET_NODELAY:
 	case IMSG_SET_PEER_VERIF:
 		cmd->opt.value = &bools[1];
 		cmd->opt.len = sizeof(int);
 		return 1;
 
+	case IMSG_SET_FASTOPEN:
+		cmd->opt.value = &bools[0];
+		cmd->opt.len = sizeof(int);
+		return 1;
+
 	default:
 		err(1, "imsg type %d shouldn't be accessible", cmd->opt.set);
 	}
@@ -367,11 +945,116 @@ parse_del(const char *i, struct cmd *cmd)
 	return 1;
 }
 
+static int
+parse_extract(const char *i, struct cmd *cmd)
+{
+	const char *n;
+
+	assert(strsw(i, "extract"));
+
+	/* without arguments, list the variables */
+	if (*(i = eat_spaces(i + 7)) == '\0') {
+		cmd->ext.name = NULL;
+		return 1;
+	}
+
+	for (n = i; isalnum((unsigned char)*i) || *i == '_'; ++i)
+		;
+	if (i == n) {
+		warnx("missing variable name");
+		return 0;
+	}
+	cmd->ext.name = n;
+	cmd->ext.nlen = i - n;
+
+	i = eat_spaces(i);
+	if (*i != '=') {
+		warnx("usage: extract name = .path");
+		return 0;
+	}
+	i = eat_spaces(i + 1);
+	if (*i != '.') {
+		warnx("the path must start with a dot");
+		return 0;
+	}
+	cmd->ext.path = i;
+	return 1;
+}
+
+static int
+parse_record(const char *i, struct cmd *cmd)
+{
+	assert(strsw(i, "record"));
+
+	i = eat_spaces(i + 6);
+	if (*i == '\0') {
+		cmd->rec.show = 1;
+		return 1;
+	}
+	if (!strcmp(i, "off"))
+		return 1;
+
+	if (strsw(i, "-z") && (i[2] == '\0' || isspace((unsigned char)i[2]))) {
+		cmd->rec.zstd = 1;
+		i = eat_spaces(i + 2);
+	}
+	if (*i == '\0') {
+		warnx("missing file to record to");
+		return 0;
+	}
+	cmd->rec.path = i;
+	return 1;
+}
+
+/* parse the name=value words before the url that override the
+ * timeouts for a single request */
+static int
+parse_req_opts(const char **r, struct req *req)
+{
+	const char *i, *e, *v;
+	char *t;
+	int ok;
+
+	for (i = eat_spaces(*r); *i != '\0'; i = eat_spaces(e)) {
+		for (e = i; *e != '\0' && !isspace((unsigned char)*e); ++e)
+			;
+		if (!strsw(i, "timeout=") && !strsw(i, "connect-timeout=") &&
+		    !strsw(i, "low-speed="))
+			break;	/* part of the url */
+		v = strchr(i, '=') + 1;
+
+		if (!req->has_to) {
+			req->has_to = 1;
+			req->to.connect = req->to.total = -1;
+			req->to.low_speed = req->to.low_time = -1;
+		}
+
+		if ((t = strndup(v, e - v)) == NULL)
+			err(1, "strndup");
+		if (strsw(i, "timeout="))
+			ok = parse_duration(t, &req->to.total);
+		else if (strsw(i, "connect-timeout="))
+			ok = parse_duration(t, &req->to.connect);
+		else
+			ok = parse_low_speed(t, &req->to.low_speed,
+			    &req->to.low_time);
+		free(t);
+
+		if (!ok) {
+			warnx("invalid value: %.*s", (int)(e - i), i);
+			return 0;
+		}
+	}
+
+	*r = i;
+	return 1;
+}
+
 static int
 parse_req(const char *i, struct cmd *cmd)
 {
 	/* grammar:
-	 *	{GET|POST|...} url payload?
+	 *	{GET|POST|...} [option=value ...] url payload?
 	 */
 
 	int c, j, v;
@@ -413,6 +1096,9 @@ parse_req(const char *i, struct cmd *cmd)
 		return 0;
 	}
 
+	if (!parse_req_opts(&i, &cmd->req))
+		return 0;
+
 	/* i points to the url */
 	t = i;
 	for (l = 0; *i; ++l) {
@@ -442,6 +1128,100 @@ parse_req(const char *i, struct cmd *cmd)
 	return 1;
 }
 
+/* copy the next word of *r and move past it */
+static char *
+next_word(const char **r)
+{
+	const char *i, *e;
+	char *w;
+
+	i = eat_spaces(*r);
+	for (e = i; *e != '\0' && !isspace((unsigned char)*e); ++e)
+		;
+	if ((w = strndup(i, e - i)) == NULL)
+		err(1, "strndup");
+	*r = e;
+	return w;
+}
+
+/* the most requests in a period and the longest run, so the schedule
+ * in microseconds can't overflow */
+#define RATE_MAX_COUNT	10000000
+#define RATE_MAX_DUR	(7L * 24 * 60 * 60 * 1000)
+
+/* parse "count/duration", where a duration without a number is one
+ * of that unit, i.e. 2000/s or 50/100ms */
+static int
+parse_rate_spec(const char *s, struct rate *rate)
+{
+	const char *sl;
+	char *ep, *t;
+	long long n;
+	int ok;
+
+	if ((sl = strchr(s, '/')) == NULL)
+		return 0;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (ep != sl || n <= 0 || n > RATE_MAX_COUNT || errno == ERANGE)
+		return 0;
+	rate->count = n;
+
+	if (isdigit((unsigned char)sl[1]))
+		return parse_duration(sl + 1, &rate->per) && rate->per > 0;
+
+	if (asprintf(&t, "1%s", sl + 1) == -1)
+		err(1, "asprintf");
+	ok = parse_duration(t, &rate->per);
+	free(t);
+	return ok;
+}
+
+static int
+parse_rate(const char *i, struct cmd *cmd)
+{
+	/* grammar:
+	 *	rate count/duration for duration request
+	 */
+
+	char *w;
+	int ok;
+
+	assert(strsw(i, "rate"));
+	i += 4;
+
+	w = next_word(&i);
+	ok = parse_rate_spec(w, &cmd->rate);
+	if (!ok)
+		warnx("invalid rate: %s", w);
+	free(w);
+	if (!ok)
+		return 0;
+
+	w = next_word(&i);
+	ok = !strcmp(w, "for");
+	free(w);
+	if (!ok) {
+		warnx("missing `for'");
+		return 0;
+	}
+
+	w = next_word(&i);
+	ok = parse_duration(w, &cmd->rate.dur) && cmd->rate.dur > 0 &&
+	    cmd->rate.dur <= RATE_MAX_DUR;
+	if (!ok)
+		warnx("invalid duration: %s", w);
+	else if (!(ok = (long long)cmd->rate.count * cmd->rate.dur >=
+	    cmd->rate.per))
+		warnx("no request would be sent in %s", w);
+	free(w);
+	if (!ok)
+		return 0;
+
+	return parse_req(eat_spaces(i), cmd);
+}
+
 int
 parse(const char *i, struct cmd *cmd)
 {
@@ -488,6 +1268,27 @@ parse(const char *i, struct cmd *cmd)
 		return parse_del(i, cmd);
 	}
 
+	if (!strcmp(i, "warm") || strsw(i, "warm ")) {
+		cmd->type = CMD_WARM;
+		cmd->hosts = eat_spaces(i + 4);
+		return 1;
+	}
+
+	if (!strcmp(i, "extract") || strsw(i, "extract ")) {
+		cmd->type = CMD_EXTRACT;
+		return parse_extract(i, cmd);
+	}
+
+	if (!strcmp(i, "record") || strsw(i, "record ")) {
+		cmd->type = CMD_RECORD;
+		return parse_record(i, cmd);
+	}
+
+	if (strsw(i, "rate ")) {
+		cmd->type = CMD_RATE;
+		return parse_rate(i, cmd);
+	}
+
 	cmd->type = CMD_REQ;
 	return parse_req(i, cmd);
 }
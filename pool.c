@@ -0,0 +1,607 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The child runs a pool of threads.  The main thread reads the
+ * messages from the parent and pushes the requests in the jobs ring;
+ * the workers pick them up and perform them with their own CURL
+ * handle, through the multiplexer (see mux.c) if there's more than
+ * one.  While a response is received, its pieces are pushed as
+ * frames in the out ring, which is drained by a single writer thread,
+ * the only one that touches ibuf->w.  Every frame carries the id of
+ * its request, so the frames of different requests can be interleaved.
+ * While the writer can't keep up, the workers block in the curl
+ * callbacks, or the multiplexer pauses the transfers that have
+ * something to write, which in turn stops reading from their
+ * sockets.
+ *
+ * A GET for the same URL as one that is still waiting for its headers
+ * is not performed again: its id is attached to the first one, and
+ * every frame is sent to all of them.  The settings and headers can't
+ * change while the request is in flight (see pool_wrlock), so it's
+ * the same request.  They can only between two attempts, and then the
+ * request is closed to the others already.
+ */
+
+#include "crest.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_SIZE 1024 /* must be a power of two */
+
+/* bounded lock-free MPMC queue, see
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ * The semaphores are only used to sleep while the ring is empty or
+ * full. */
+struct ring {
+	struct {
+		_Atomic size_t	 seq;
+		void		*data;
+	}		 cells[RING_SIZE];
+	_Atomic size_t	 head;
+	_Atomic size_t	 tail;
+	sem_t		 items;
+	sem_t		 slots;
+};
+
+struct job {
+	int		 type;	/* IMSG_DO_REQ or IMSG_EXIT */
+	struct req	 req;
+
+	/* the requests waiting for this response, req.id included */
+	uint32_t	*ids;
+	size_t		 nids;
+
+	/* a GET can be joined while it's in the inflight list */
+	char		*url;
+	int		 open;
+	TAILQ_ENTRY(job) entry;
+};
+
+/* a message for the parent, the same for every id */
+struct frame {
+	int		 type;
+	size_t		 len;
+	char		*data;
+	size_t		 nids;
+	uint32_t	 ids[];
+};
+
+static struct ring	 jobs, out;
+static pthread_t	 threads[MAX_THREADS], wthread;
+static int		 nthr;
+static struct writer	*wr;
+
+/* bytes in the out ring, not yet seen by the writer */
+static _Atomic size_t	 pending;
+
+/* to wait for the writer to catch up */
+static pthread_mutex_t	 wmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 wcond = PTHREAD_COND_INITIALIZER;
+
+/* protects settings and headers */
+static pthread_rwlock_t	 lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* the GETs that can still be joined */
+static TAILQ_HEAD(, job) inflight = TAILQ_HEAD_INITIALIZER(inflight);
+static size_t		 coalesced;
+static pthread_mutex_t	 imtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* bumped when the workers have to drop their connections */
+static _Atomic unsigned	 conngen;
+
+/* bumped when the settings or the headers change */
+static _Atomic unsigned	 setgen;
+
+static void
+ring_init(struct ring *r)
+{
+	size_t i;
+
+	for (i = 0; i < RING_SIZE; ++i)
+		atomic_init(&r->cells[i].seq, i);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+
+	if (sem_init(&r->items, 0, 0) == -1 ||
+	    sem_init(&r->slots, 0, RING_SIZE) == -1)
+		err(1, "sem_init");
+}
+
+/* return 0 if the ring is full */
+static int
+ring_push(struct ring *r, void *data)
+{
+	size_t pos, s;
+	intptr_t d;
+
+	pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	for (;;) {
+		s = atomic_load_explicit(&r->cells[pos & (RING_SIZE - 1)].seq,
+		    memory_order_acquire);
+		d = (intptr_t)s - (intptr_t)pos;
+		if (d == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->head,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (d < 0)
+			return 0;
+		else
+			pos = atomic_load_explicit(&r->head,
+			    memory_order_relaxed);
+	}
+
+	r->cells[pos & (RING_SIZE - 1)].data = data;
+	atomic_store_explicit(&r->cells[pos & (RING_SIZE - 1)].seq, pos + 1,
+	    memory_order_release);
+
+	sem_post(&r->items);
+	return 1;
+}
+
+/* return NULL if the ring is empty */
+static void *
+ring_pop(struct ring *r)
+{
+	size_t pos, s;
+	intptr_t d;
+	void *data;
+
+	pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	for (;;) {
+		s = atomic_load_explicit(&r->cells[pos & (RING_SIZE - 1)].seq,
+		    memory_order_acquire);
+		d = (intptr_t)s - (intptr_t)(pos + 1);
+		if (d == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->tail,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (d < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&r->tail,
+			    memory_order_relaxed);
+	}
+
+	data = r->cells[pos & (RING_SIZE - 1)].data;
+	atomic_store_explicit(&r->cells[pos & (RING_SIZE - 1)].seq,
+	    pos + RING_SIZE, memory_order_release);
+
+	return data;
+}
+
+/* sleep until there's room in the ring */
+static void
+ring_put(struct ring *r, void *data)
+{
+	while (sem_wait(&r->slots) == -1)
+		; /* EINTR */
+
+	/* a consumer may have freed a later cell but not yet the
+	 * first one */
+	while (!ring_push(r, data))
+		sched_yield();
+}
+
+/* sleep until there's something in the ring */
+static void *
+ring_wait(struct ring *r)
+{
+	void *data;
+
+	while (sem_wait(&r->items) == -1)
+		; /* EINTR */
+
+	/* a producer may have claimed an earlier cell but not yet
+	 * filled it */
+	while ((data = ring_pop(r)) == NULL)
+		sched_yield();
+
+	sem_post(&r->slots);
+	return data;
+}
+
+static struct job *
+new_job(int type)
+{
+	struct job *j;
+
+	if ((j = calloc(1, sizeof(*j))) == NULL)
+		err(1, "calloc");
+	j->type = type;
+	return j;
+}
+
+static size_t
+backlog(void)
+{
+	return atomic_load(&pending) + writer_queued(wr);
+}
+
+/* return 1 if the writer is back under half the high-water mark */
+int
+pool_drained(void)
+{
+	return backlog() < wr->hwm / 2;
+}
+
+/* block while the writer is more than the high-water mark behind,
+ * until it's back under half of it */
+static void
+throttle(void)
+{
+	if (backlog() < wr->hwm)
+		return;
+
+	pthread_mutex_lock(&wmtx);
+	while (backlog() >= wr->hwm / 2)
+		pthread_cond_wait(&wcond, &wmtx);
+	pthread_mutex_unlock(&wmtx);
+}
+
+/* queue a frame for the given ids.  The data is copied once */
+static void
+send_frames(int type, const uint32_t *ids, size_t nids, const void *data,
+    size_t len)
+{
+	struct frame *f;
+	size_t idlen;
+
+	idlen = nids * sizeof(*ids);
+	if ((f = malloc(sizeof(*f) + idlen + len)) == NULL)
+		err(1, "malloc");
+	f->type = type;
+	f->len = len;
+	f->data = (char *)f->ids + idlen;
+	f->nids = nids;
+	memcpy(f->ids, ids, idlen);
+	if (len != 0)
+		memcpy(f->data, data, len);
+
+	atomic_fetch_add(&pending, len * nids);
+	ring_put(&out, f);
+}
+
+static void
+send_frame(int type, uint32_t id, const void *data, size_t len)
+{
+	send_frames(type, &id, 1, data, len);
+}
+
+/* stop accepting other requests for j.  After this j->ids is stable */
+static void
+close_job(struct job *j)
+{
+	pthread_mutex_lock(&imtx);
+	if (j->open) {
+		TAILQ_REMOVE(&inflight, j, entry);
+		j->open = 0;
+	}
+	pthread_mutex_unlock(&imtx);
+}
+
+static void
+sink_head(void *arg, long code, const char *data, size_t len)
+{
+	struct job *j = arg;
+
+	/* the later ones would miss the headers */
+	close_job(j);
+
+	send_frames(IMSG_STATUS, j->ids, j->nids, &code, sizeof(code));
+	send_frames(IMSG_HEAD, j->ids, j->nids, data, len);
+}
+
+/* the multiplexer pauses the transfer rather than blocking all of
+ * them, and resumes it once pool_drained */
+static int
+sink_body(void *arg, const char *data, size_t len)
+{
+	struct job *j = arg;
+
+	if (!mux_thread())
+		throttle();
+	else if (backlog() >= wr->hwm)
+		return 0;
+	send_frames(IMSG_BODY, j->ids, j->nids, data, len);
+	return 1;
+}
+
+/* don't hold the settings during the backoff, or a set would wait
+ * for all of it */
+static int
+sink_nap(void *arg, long ms)
+{
+	unsigned gen;
+
+	(void)arg;
+
+	gen = atomic_load(&setgen);
+	pthread_rwlock_unlock(&lock);
+	nap(ms);
+	pthread_rwlock_rdlock(&lock);
+	return gen != atomic_load(&setgen);
+}
+
+static void *
+worker_main(void *arg)
+{
+	CURL *curl;
+	struct job *j;
+	struct resp r;
+	struct sink sink;
+	const char *msg;
+	unsigned gen;
+	int ok;
+
+	(void)arg;
+
+	if ((curl = curl_easy_init()) == NULL)
+		errx(1, "curl_easy_init failed");
+
+	sink.head = sink_head;
+	sink.body = sink_body;
+	sink.nap = sink_nap;
+	gen = atomic_load(&conngen);
+
+	for (;;) {
+		j = ring_wait(&jobs);
+		if (j->type == IMSG_EXIT) {
+			free(j);
+			break;
+		}
+
+		/* new handles have no connections */
+		if (gen != atomic_load(&conngen)) {
+			gen = atomic_load(&conngen);
+			http_fini();
+			curl_easy_cleanup(curl);
+			if ((curl = curl_easy_init()) == NULL)
+				errx(1, "curl_easy_init failed");
+		}
+
+		sink.arg = j;
+		pthread_rwlock_rdlock(&lock);
+		ok = do_req(curl, &j->req, &r, headers, &sink);
+		pthread_rwlock_unlock(&lock);
+
+		close_job(j);
+		if (r.info != NULL)
+			send_frames(IMSG_REQ_INFO, j->ids, j->nids, r.info,
+			    r.ilen);
+		if (ok) {
+			send_frames(IMSG_TIMING, j->ids, j->nids, &r.timing,
+			    sizeof(r.timing));
+			send_frames(IMSG_END, j->ids, j->nids, NULL, 0);
+		} else {
+			msg = r.err != NULL ? r.err : "failed";
+			send_frames(IMSG_ERR, j->ids, j->nids, msg,
+			    strlen(msg));
+		}
+
+		free_resp(&r);
+		free(j->req.path);
+		free(j->req.payload);
+		free(j->ids);
+		free(j->url);
+		free(j);
+	}
+
+	http_fini();
+	curl_easy_cleanup(curl);
+	return NULL;
+}
+
+static void *
+writer_main(void *arg)
+{
+	struct frame *f;
+	size_t i;
+
+	(void)arg;
+
+	for (;;) {
+		f = ring_wait(&out);
+		if (f->type == IMSG_EXIT) {
+			free(f);
+			break;
+		}
+
+		for (i = 0; i < f->nids; ++i)
+			writer_compose_chunks(wr, f->type, f->ids[i], f->data,
+			    f->len);
+		atomic_fetch_sub(&pending, f->len * f->nids);
+		free(f);
+
+		/* the workers will wait if this takes too long */
+		writer_sync(wr);
+
+		pthread_mutex_lock(&wmtx);
+		pthread_cond_broadcast(&wcond);
+		pthread_mutex_unlock(&wmtx);
+		if (pool_drained())
+			mux_resume();
+	}
+
+	return NULL;
+}
+
+void
+pool_start(struct writer *w, int n)
+{
+	int i;
+
+	ring_init(&jobs);
+	ring_init(&out);
+
+	wr = w;
+	atomic_init(&pending, 0);
+
+	/* with only one worker there's nothing to share */
+	if (n > 1)
+		mux_start();
+
+	nthr = n;
+	for (i = 0; i < nthr; ++i)
+		if (pthread_create(&threads[i], NULL, worker_main, NULL))
+			errx(1, "pthread_create");
+
+	if (pthread_create(&wthread, NULL, writer_main, NULL))
+		errx(1, "pthread_create");
+}
+
+/* wait for the requests in flight, then stop the threads */
+void
+pool_stop(void)
+{
+	int i;
+
+	for (i = 0; i < nthr; ++i)
+		ring_put(&jobs, new_job(IMSG_EXIT));
+	for (i = 0; i < nthr; ++i)
+		pthread_join(threads[i], NULL);
+	mux_stop();
+
+	send_frame(IMSG_EXIT, 0, NULL, 0);
+	pthread_join(wthread, NULL);
+
+	sem_destroy(&jobs.items);
+	sem_destroy(&jobs.slots);
+	sem_destroy(&out.items);
+	sem_destroy(&out.slots);
+}
+
+/* add id to the GET for url in flight, if any */
+static int
+join(const char *url, uint32_t id)
+{
+	struct job *j;
+	uint32_t *t;
+
+	TAILQ_FOREACH(j, &inflight, entry)
+		if (!strcmp(j->url, url))
+			break;
+	if (j == NULL)
+		return 0;
+
+	if ((t = realloc(j->ids, (j->nids + 1) * sizeof(*t))) == NULL)
+		err(1, "realloc");
+	j->ids = t;
+	j->ids[j->nids++] = id;
+	coalesced++;
+	return 1;
+}
+
+/* hand the request to the workers.  The path and the payload are now
+ * owned by the pool */
+void
+pool_submit(struct req *req)
+{
+	struct job *j;
+	char *url;
+
+	url = NULL;
+	/* the timeouts are part of the request */
+	if (req->method == GET && req->payload == NULL && !req->has_to &&
+	    !req->alone)
+		url = do_url(req);
+
+	pthread_mutex_lock(&imtx);
+	if (url != NULL && join(url, req->id)) {
+		pthread_mutex_unlock(&imtx);
+		free(url);
+		free(req->path);
+		memset(req, 0, sizeof(*req));
+		return;
+	}
+
+	j = new_job(IMSG_DO_REQ);
+	memcpy(&j->req, req, sizeof(*req));
+	memset(req, 0, sizeof(*req));
+
+	if ((j->ids = malloc(sizeof(*j->ids))) == NULL)
+		err(1, "malloc");
+	j->ids[0] = j->req.id;
+	j->nids = 1;
+
+	if ((j->url = url) != NULL) {
+		j->open = 1;
+		TAILQ_INSERT_TAIL(&inflight, j, entry);
+	}
+	pthread_mutex_unlock(&imtx);
+
+	ring_put(&jobs, j);
+}
+
+/* queue an IMSG_DONE for the parent */
+void
+pool_done(const void *data, size_t len)
+{
+	send_frame(IMSG_DONE, 0, data, len);
+}
+
+/* how many requests were attached to another one */
+size_t
+pool_coalesced(void)
+{
+	size_t n;
+
+	pthread_mutex_lock(&imtx);
+	n = coalesced;
+	pthread_mutex_unlock(&imtx);
+	return n;
+}
+
+/* close the connections, so the next requests make new ones.  Called
+ * with the write lock held */
+void
+pool_reconnect(void)
+{
+	atomic_fetch_add(&conngen, 1);
+	mux_reconf();
+}
+
+/* the settings or the headers are about to change: the requests from
+ * now on are different from the ones in flight */
+void
+pool_wrlock(void)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&imtx);
+	while ((j = TAILQ_FIRST(&inflight)) != NULL) {
+		TAILQ_REMOVE(&inflight, j, entry);
+		j->open = 0;
+	}
+	pthread_mutex_unlock(&imtx);
+
+	pthread_rwlock_wrlock(&lock);
+	atomic_fetch_add(&setgen, 1);
+}
+
+void
+pool_unlock(void)
+{
+	pthread_rwlock_unlock(&lock);
+}
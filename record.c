@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The log of record.  The parent only lays out every exchange in a
+ * buffer and queues it: a thread of its own compresses and appends
+ * them, so a slow disk doesn't hold up the responses.  Past REC_HWM
+ * bytes queued the parent waits for it, rather than growing the queue
+ * without bound.
+ *
+ * The file is the header of struct rec_file and then the records, all
+ * in little endian.  A record is a struct rec_hdr and the data: the
+ * url, the request headers, the payload, the response headers, the
+ * body and the error, one after the other, with the lengths in the
+ * header.  With REC_ZSTD the data is a zstd frame of zlen bytes.  The
+ * records are padded to 8 bytes and len is what follows it, so the
+ * file can be mapped and the headers read in place, and it's indexed
+ * by skipping from one to the next.
+ */
+
+#include "crest.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* high-water mark of the queue */
+#define REC_HWM (16 * 1024 * 1024)
+
+struct recreq {
+	uint64_t	 at;
+	int		 method;
+	char		*path;
+	char		*payload;
+};
+
+struct recbuf {
+	TAILQ_ENTRY(recbuf)	 entry;
+	size_t			 len;
+	size_t			 dlen;	/* of the data, without padding */
+	char			 data[];
+};
+
+static TAILQ_HEAD(, recbuf) queue = TAILQ_HEAD_INITIALIZER(queue);
+static pthread_mutex_t	 mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 drained = PTHREAD_COND_INITIALIZER;
+static pthread_t	 thread;
+static int		 fd = -1, zstd, quit;
+static size_t		 nrecs;
+static size_t		 queued, peak, nwaits;	/* queued is in bytes */
+
+static void
+le32(char *d, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i, v >>= 8)
+		d[i] = v & 0xff;
+}
+
+static void
+le64(char *d, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; ++i, v >>= 8)
+		d[i] = v & 0xff;
+}
+
+static void
+write_all(const char *d, size_t len)
+{
+	ssize_t n;
+
+	for (; len != 0; d += n, len -= n)
+		if ((n = write(fd, d, len)) == -1)
+			err(1, "record: write");
+}
+
+static uint32_t
+rd32(const char *s)
+{
+	const unsigned char *u = (const unsigned char *)s;
+
+	return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static uint64_t
+rd64(const char *s)
+{
+	return rd32(s) | (uint64_t)rd32(s + 4) << 32;
+}
+
+#if HAVE_ZSTD
+/* compress the data of the record in b, if it's worth it */
+static struct recbuf *
+compress(ZSTD_CCtx *z, struct recbuf *b)
+{
+	struct recbuf *c;
+	const char *src;
+	size_t n, bound, pad;
+
+	src = b->data + REC_HDRSIZE;
+	n = b->dlen;
+	bound = ZSTD_compressBound(n);
+	if ((c = malloc(sizeof(*c) + REC_HDRSIZE + bound + 8)) == NULL)
+		err(1, "malloc");
+	bound = ZSTD_compressCCtx(z, c->data + REC_HDRSIZE, bound, src, n,
+	    3);
+	if (ZSTD_isError(bound) || bound >= n) {
+		free(c);
+		return b;
+	}
+
+	memcpy(c->data, b->data, REC_HDRSIZE);
+	pad = -bound & 7;
+	memset(c->data + REC_HDRSIZE + bound, 0, pad);
+	c->len = REC_HDRSIZE + bound + pad;
+	le32(c->data + offsetof(struct rec_hdr, len), c->len - 8);
+	le32(c->data + offsetof(struct rec_hdr, flags), REC_ZSTD);
+	le32(c->data + offsetof(struct rec_hdr, zlen), bound);
+	free(b);
+	return c;
+}
+#endif
+
+static void *
+record_main(void *arg)
+{
+	struct recbuf *b;
+	size_t len;
+#if HAVE_ZSTD
+	ZSTD_CCtx *z;
+
+	if ((z = ZSTD_createCCtx()) == NULL)
+		errx(1, "ZSTD_createCCtx failed");
+#endif
+
+	(void)arg;
+
+	pthread_mutex_lock(&mtx);
+	for (;;) {
+		while (!quit && TAILQ_EMPTY(&queue))
+			pthread_cond_wait(&cond, &mtx);
+		if ((b = TAILQ_FIRST(&queue)) == NULL)
+			break;
+		TAILQ_REMOVE(&queue, b, entry);
+		pthread_mutex_unlock(&mtx);
+
+		len = b->len;
+#if HAVE_ZSTD
+		if (zstd)
+			b = compress(z, b);
+#endif
+		write_all(b->data, b->len);
+		free(b);
+
+		pthread_mutex_lock(&mtx);
+		queued -= len;
+		pthread_cond_signal(&drained);
+	}
+	pthread_mutex_unlock(&mtx);
+
+#if HAVE_ZSTD
+	ZSTD_freeCCtx(z);
+#endif
+	return NULL;
+}
+
+/* wait for the records queued so far */
+static void
+stop(void)
+{
+	pthread_mutex_lock(&mtx);
+	quit = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mtx);
+	pthread_join(thread, NULL);
+
+	close(fd);
+	fd = -1;
+	quit = 0;
+}
+
+void
+record_close(void)
+{
+	int off = 0;
+
+	if (fd == -1)
+		return;
+	stop();
+	wsend(IMSG_SET_RECORD, &off, sizeof(off));
+}
+
+/* append the exchanges to path, compressed with z */
+/* the end of the last whole record of the log f, whose size is size.
+ * What's after it was cut off while being written */
+static off_t
+log_end(int f, off_t size)
+{
+	char b[4];
+	off_t off;
+	uint64_t len;
+
+	off = sizeof(struct rec_file);
+	for (; (uint64_t)(size - off) >= REC_HDRSIZE; off += len + 8) {
+		if (pread(f, b, sizeof(b), off + offsetof(struct rec_hdr, len))
+		    != sizeof(b))
+			return -1;
+		len = rd32(b);
+		if (len + 8 < REC_HDRSIZE || len + 8 > (uint64_t)(size - off))
+			break;
+	}
+	return off;
+}
+
+int
+record_open(const char *path, int z)
+{
+	char hdr[sizeof(struct rec_file)];
+	off_t off, end;
+	ssize_t n;
+	int f, on = 1;
+
+#if ! HAVE_ZSTD
+	if (z) {
+		warnx("built without zstd");
+		return 0;
+	}
+#endif
+
+	if ((f = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0644)) == -1) {
+		warn("%s", path);
+		return 0;
+	}
+	if ((off = lseek(f, 0, SEEK_END)) == -1) {
+		warn("%s", path);
+		close(f);
+		return 0;
+	}
+
+	/* only append to a log of the same version */
+	if (off != 0) {
+		if ((n = pread(f, hdr, sizeof(hdr), 0)) == -1) {
+			warn("%s", path);
+			close(f);
+			return 0;
+		}
+		if ((size_t)n != sizeof(hdr) ||
+		    memcmp(hdr, REC_MAGIC, sizeof(REC_MAGIC) - 1) ||
+		    rd32(hdr + offsetof(struct rec_file, version)) !=
+		    REC_VERSION) {
+			warnx("%s: not a log of record of version %d", path,
+			    REC_VERSION);
+			close(f);
+			return 0;
+		}
+
+		/* or the records after a partial one couldn't be read */
+		if ((end = log_end(f, off)) == -1) {
+			warn("%s", path);
+			close(f);
+			return 0;
+		}
+		if (end != off) {
+			warnx("%s: dropping the %lld bytes of a partial record",
+			    path, (long long)(off - end));
+			if (ftruncate(f, end) == -1) {
+				warn("%s", path);
+				close(f);
+				return 0;
+			}
+		}
+	}
+
+	if (fd != -1)
+		stop();
+	fd = f;
+	zstd = z;
+	nrecs = 0;
+	peak = nwaits = 0;
+
+	if (off == 0) {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, REC_MAGIC, sizeof(REC_MAGIC) - 1);
+		le32(hdr + offsetof(struct rec_file, version), REC_VERSION);
+		write_all(hdr, sizeof(hdr));
+	}
+
+	if (pthread_create(&thread, NULL, record_main, NULL))
+		errx(1, "pthread_create");
+
+	/* the children describe the requests from now on */
+	wsend(IMSG_SET_RECORD, &on, sizeof(on));
+	return 1;
+}
+
+int
+recording(void)
+{
+	return fd != -1;
+}
+
+void
+record_show(void)
+{
+	if (fd == -1)
+		puts("off");
+	else
+		printf("%zu exchanges%s, up to %zu bytes queued, %zu "
+		    "waited for the disk\n", nrecs,
+		    zstd ? ", compressed" : "", peak, nwaits);
+}
+
+/* take what's needed of the request before it's sent */
+struct recreq *
+record_req(const struct req *req)
+{
+	struct recreq *r;
+	struct timespec ts;
+
+	if (fd == -1)
+		return NULL;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, "calloc");
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->at = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	r->method = req->method;
+	if ((r->path = strdup(req->path)) == NULL)
+		err(1, "strdup");
+	if (req->payload != NULL &&
+	    (r->payload = strdup(req->payload)) == NULL)
+		err(1, "strdup");
+	return r;
+}
+
+static char *
+put(char *d, const char *s, size_t len)
+{
+	if (len != 0)
+		memcpy(d, s, len);
+	return d + len;
+}
+
+/* queue the exchange and free r */
+void
+record_resp(struct recreq *r, const struct resp *resp)
+{
+	struct recbuf *b;
+	const struct timing *t = &resp->timing;
+	const char *url, *rh;
+	char *h, *d;
+	size_t len[REC_NFIELDS], n, i;
+
+	if (r == NULL)
+		return;
+
+	/* the child tells the url and the headers, if it got that far */
+	url = r->path;
+	rh = NULL;
+	len[1] = 0;
+	if (resp->info != NULL) {
+		url = resp->info;
+		if ((rh = memchr(resp->info, '\0', resp->ilen)) != NULL)
+			len[1] = resp->info + resp->ilen - ++rh;
+	}
+	len[0] = strlen(url);
+	len[2] = r->payload != NULL ? strlen(r->payload) : 0;
+	len[3] = resp->headers != NULL ? resp->hlen : 0;
+	len[4] = resp->body != NULL ? resp->blen : 0;
+	len[5] = resp->err != NULL ? strlen(resp->err) : 0;
+
+	for (n = 0, i = 0; i < REC_NFIELDS; ++i)
+		n += len[i];
+
+	if (REC_HDRSIZE + n + 7 - 8 > UINT32_MAX) {
+		warnx("record: exchange too big, skipped");
+		goto done;
+	}
+	if ((b = calloc(1, sizeof(*b) + REC_HDRSIZE + n + 7)) == NULL)
+		err(1, "calloc");
+	b->dlen = n;
+	b->len = REC_HDRSIZE + n + (-n & 7);
+
+	h = b->data;
+	le32(h + offsetof(struct rec_hdr, len), b->len - 8);
+	le64(h + offsetof(struct rec_hdr, at), r->at);
+	le64(h + offsetof(struct rec_hdr, status), resp->http_code);
+	le64(h + offsetof(struct rec_hdr, dns), t->dns);
+	le64(h + offsetof(struct rec_hdr, connect), t->connect);
+	le64(h + offsetof(struct rec_hdr, tls), t->tls);
+	le64(h + offsetof(struct rec_hdr, ttfb), t->ttfb);
+	le64(h + offsetof(struct rec_hdr, total), t->total);
+	le64(h + offsetof(struct rec_hdr, attempts), t->attempts);
+	le32(h + offsetof(struct rec_hdr, method), r->method);
+	for (i = 0; i < REC_NFIELDS; ++i)
+		le32(h + offsetof(struct rec_hdr, lens) + i * 4, len[i]);
+
+	d = put(h + REC_HDRSIZE, url, len[0]);
+	d = put(d, rh, len[1]);
+	d = put(d, r->payload, len[2]);
+	d = put(d, resp->headers, len[3]);
+	d = put(d, resp->body, len[4]);
+	put(d, resp->err, len[5]);
+
+	pthread_mutex_lock(&mtx);
+	if (queued != 0 && queued + b->len > REC_HWM) {
+		nwaits++;
+		while (queued != 0 && queued + b->len > REC_HWM)
+			pthread_cond_wait(&drained, &mtx);
+	}
+	TAILQ_INSERT_TAIL(&queue, b, entry);
+	queued += b->len;
+	if (queued > peak)
+		peak = queued;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mtx);
+	nrecs++;
+
+done:
+	free(r->path);
+	free(r->payload);
+	free(r);
+}
+
+/* map the log at path */
+int
+reclog_open(struct reclog *l, const char *path)
+{
+	struct stat sb;
+	int f;
+
+	memset(l, 0, sizeof(*l));
+	if ((f = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		warn("%s", path);
+		return 0;
+	}
+	if (fstat(f, &sb) == -1) {
+		warn("%s", path);
+		close(f);
+		return 0;
+	}
+	if ((size_t)sb.st_size < sizeof(struct rec_file) ||
+	    (l->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, f,
+	    0)) == MAP_FAILED) {
+		warnx("%s: not a log of record", path);
+		close(f);
+		return 0;
+	}
+	close(f);
+
+	l->len = sb.st_size;
+	if (memcmp(l->map, REC_MAGIC, sizeof(REC_MAGIC) - 1) ||
+	    rd32(l->map + offsetof(struct rec_file, version)) !=
+	    REC_VERSION) {
+		warnx("%s: not a log of record", path);
+		reclog_close(l);
+		return 0;
+	}
+	l->off = sizeof(struct rec_file);
+	return 1;
+}
+
+void
+reclog_close(struct reclog *l)
+{
+	if (l->map != NULL)
+		munmap(l->map, l->len);
+	free(l->buf);
+	memset(l, 0, sizeof(*l));
+}
+
+/* read the next record, valid until the one after it is read.  Return
+ * 0 at the end, -1 if the log is truncated or can't be read. */
+int
+reclog_next(struct reclog *l, struct recent *e)
+{
+	const char *h, *data;
+	size_t i, n, len;
+
+	if (l->off == l->len)
+		return 0;
+	if (l->len - l->off < REC_HDRSIZE)
+		return -1;
+
+	h = l->map + l->off;
+	len = rd32(h + offsetof(struct rec_hdr, len));
+	if (len + 8 < REC_HDRSIZE || len + 8 > l->len - l->off)
+		return -1;
+
+	e->flags = rd32(h + offsetof(struct rec_hdr, flags));
+	e->at = rd64(h + offsetof(struct rec_hdr, at));
+	e->status = rd64(h + offsetof(struct rec_hdr, status));
+	e->timing.dns = rd64(h + offsetof(struct rec_hdr, dns));
+	e->timing.connect = rd64(h + offsetof(struct rec_hdr, connect));
+	e->timing.tls = rd64(h + offsetof(struct rec_hdr, tls));
+	e->timing.ttfb = rd64(h + offsetof(struct rec_hdr, ttfb));
+	e->timing.total = rd64(h + offsetof(struct rec_hdr, total));
+	e->timing.attempts = rd64(h + offsetof(struct rec_hdr, attempts));
+	e->method = rd32(h + offsetof(struct rec_hdr, method));
+	for (n = 0, i = 0; i < REC_NFIELDS; ++i) {
+		e->lens[i] = rd32(h + offsetof(struct rec_hdr, lens) + i * 4);
+		n += e->lens[i];
+	}
+
+	data = h + REC_HDRSIZE;
+	if (e->flags & REC_ZSTD) {
+#if HAVE_ZSTD
+		if (n > l->bufsz) {
+			free(l->buf);
+			if ((l->buf = malloc(n)) == NULL)
+				err(1, "malloc");
+			l->bufsz = n;
+		}
+		i = rd32(h + offsetof(struct rec_hdr, zlen));
+		if (i > len + 8 - REC_HDRSIZE ||
+		    ZSTD_decompress(l->buf, n, data, i) != n)
+			return -1;
+		data = l->buf;
+#else
+		warnx("the log is compressed, but built without zstd");
+		return -1;
+#endif
+	} else if (n > len + 8 - REC_HDRSIZE)
+		return -1;
+
+	for (i = 0; i < REC_NFIELDS; ++i) {
+		e->fields[i] = data;
+		data += e->lens[i];
+	}
+
+	l->off += len + 8;
+	return 1;
+}
@@ -16,15 +16,98 @@
 
 #include "crest.h"
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+/* max number of requests in flight for every worker, unless it has
+ * more threads than that */
+#define MAX_LOAD 16
+
+/* the most requests of a run in flight on a worker, well under the
+ * jobs ring of the child */
+#define RUN_MAX_LOAD 512
+
+/* how far behind the schedule a request of a rate can be sent before
+ * it's counted as late, in microseconds */
+#define LATE 1000
+
+/* the results of a rate command.  The latency is measured both from
+ * when the request should have been sent, as the users would see it,
+ * and from when it was actually sent. */
+struct run {
+	struct hist	 lat;
+	struct hist	 svc;
+	size_t		 sent;
+	size_t		 done;
+	size_t		 errors;
+	size_t		 non2xx;
+	size_t		 late;
+	size_t		 held;	/* were due while at the cap */
+	uint64_t	 lag;	/* the most a request was late */
+	uint64_t	 freed;	/* when the last wait at the cap ended */
+	struct replayed	*rp;	/* only for a replay, by seq */
+};
+
+/* a request of a replay, and how it went when it was recorded */
+struct replayed {
+	int		 method;
+	char		*url;
+	long		 status;	/* -1 if it failed */
+	curl_off_t	 total;
+	long		 nstatus;
+	curl_off_t	 ntotal;
+};
+
+struct pending {
+	TAILQ_ENTRY(pending)	 entry;
+	uint32_t		 id;
+	struct worker		*w;
+	struct resp		 r;
+	int			 done;
+	struct run		*run;		/* not printed if not NULL */
+	uint64_t		 intended;	/* for the run */
+	uint64_t		 sent;
+	size_t			 seq;		/* in the run */
+	struct recreq		*rec;		/* while recording */
+};
+
+static TAILQ_HEAD(, pending) pending = TAILQ_HEAD_INITIALIZER(pending);
+
+/* the last response printed, for the pipes */
+static struct resp last;
+
+/* how the bodies are printed */
+static int format;
+
+/* the variables bound by extract */
+struct var {
+	char	*name;
+	char	*value;
+};
+static struct var	*vars;
+static size_t		 nvars;
+
+/* non-zero if the requests can be pipelined */
+static int batch;
+
+/* id of the next request */
+static uint32_t nextid;
+
+/* told how long every reply took to handle, see set_recv_timer */
+static void (*recv_timer)(uint64_t);
+
 static void
 help()
 {
@@ -32,22 +115,75 @@ help()
 	puts(" - set opt val : set an option");
 	puts(" - unset opt   : unset an option");
 	puts(" - show opt    : show the value of an option");
+	puts(" - warm [host] : connect ahead of the requests");
 	puts(" - add hdr     : add an header");
 	puts(" - del hdr     : delete an header");
+	puts(" - extract var = .path");
+	puts("               : bind ${var} to a value in the last body");
+	puts(" - record [-z] file | off");
+	puts("               : log the requests and responses to file");
 	puts(" - quit/exit   : to quit");
 	puts("");
 	puts("available options are:");
 	puts("  headers, useragent, prefix, http, port, peer-verification");
+	puts("  cache-size, cache-dir, retry, hedge");
+	puts("  timeout, connect-timeout, low-speed");
+	puts("  strategy, max-streams, max-host-connections");
+	puts("  resolve, dns-cache-ttl");
+	puts("  tcp-nodelay, tcp-keepalive, tcp-fastopen, so-rcvbuf");
+	puts("  buffer-size, upload-buffer-size, unix-socket, format");
+	puts("  cache, queue, timing (only for show)");
 	puts("");
 	puts("perform an HTTP request with: (the payload is optional)");
 	puts("  http-verb url payload");
 	puts("For example:");
 	puts("  post /user/5 {\"name\": \"foobar\"}");
+	puts("");
+	puts("send requests at a constant rate with:");
+	puts("  rate count/duration for duration http-verb url payload");
+	puts("For example:");
+	puts("  rate 2000/s for 60s get /search?q=x");
+}
+
+struct pipe_write {
+	const char	*data;
+	size_t		 len;
+	int		 done;
+};
+
+/* feed the body to the command as it's ready to read it */
+static void
+pipe_writable(int fd, short ev, void *arg)
+{
+	struct pipe_write *pw = arg;
+	ssize_t n;
+
+	(void)ev;
+
+	if (pw->len != 0) {
+		if ((n = write(fd, pw->data, pw->len)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			if (errno != EPIPE)
+				warn("write");
+			pw->len = 0;
+		} else {
+			pw->data += n;
+			pw->len -= n;
+		}
+	}
+
+	if (pw->len == 0) {
+		ev_del(fd);
+		close(fd);
+		pw->done = 1;
+	}
 }
 
 static void
 do_pipe(char *cmd, char *data, size_t len)
 {
+	struct pipe_write pw;
 	pid_t p;
 	int fds[2];
 
@@ -59,6 +195,8 @@ do_pipe(char *cmd, char *data, size_t len)
 	switch (p = fork()) {
 	case -1:
 		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
 		break;
 
 	case 0: {
@@ -82,15 +220,26 @@ do_pipe(char *cmd, char *data, size_t len)
 		close(fds[0]);
 		close(fds[1]);
 
+		/* the parent ignores it */
+		signal(SIGPIPE, SIG_DFL);
+
 		execl(shell, sh, "-c", cmd, NULL);
 		err(1, "execl");
 	}
 
 	default:
-		write(fds[1], data, len);
-		close(fds[1]);
 		close(fds[0]);
-		wait(NULL);
+		if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+
+		pw.data = data;
+		pw.len = len;
+		pw.done = 0;
+		ev_add(fds[1], POLLOUT, pipe_writable, &pw);
+		while (!pw.done)
+			ev_once(-1);
+
+		waitpid(p, NULL, 0);
 	}
 }
 
@@ -123,51 +272,74 @@ safe_println(const char *text, size_t len)
 	free(s);
 }
 
+static size_t
+pow2(size_t n)
+{
+	size_t p;
+
+	for (p = 64; p < n; p *= 2)
+		;
+	return p;
+}
+
+/* append n bytes to a NUL-terminated buffer of *len bytes.  The
+ * buffer grows in powers of two, so a big body that comes in many
+ * messages isn't copied over and over. */
+static void
+append(char **buf, size_t *len, const void *data, size_t n)
+{
+	char *t;
+
+	t = *buf;
+	if (t == NULL || pow2(*len + n + 1) != pow2(*len + 1)) {
+		if ((t = realloc(t, pow2(*len + n + 1))) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(t + *len, data, n);
+	*len += n;
+	t[*len] = '\0';
+	*buf = t;
+}
+
 /* 0 on end, 1 on continue */
 int
-recv_into(struct imsgbuf *ibuf, struct resp *r)
+recv_into(struct imsg *imsg, struct resp *r)
 {
 	ssize_t n;
-	struct imsg imsg;
 	int rtype, ret;
 
 	ret = 1;
 
-	if ((n = imsg_get(ibuf, &imsg)) == -1)
-		err(1, "imsg_get");
-	if (n == 0)
-		return 0;
-
-	n = imsg.hdr.len - IMSG_HEADER_SIZE;
-	rtype = imsg.hdr.type;
+	n = imsg->hdr.len - IMSG_HEADER_SIZE;
+	rtype = imsg->hdr.type;
 
 	switch (rtype) {
 	case IMSG_STATUS:
 		if (n != sizeof(r->http_code))
 			errx(1, "http_code: wrong size");
-		memcpy(&r->http_code, imsg.data, n);
+		memcpy(&r->http_code, imsg->data, n);
 		break;
 
+	/* the headers and the body may be split in more messages */
 	case IMSG_HEAD:
-		if (r->headers != NULL)
-			errx(1, "headers already recv'd");
-
-		r->headers = calloc(n + 1, 1);
-		if (r->headers == NULL)
-			err(1, "calloc");
-		memcpy(r->headers, imsg.data, n);
-		r->hlen = n;
+		append(&r->headers, &r->hlen, imsg->data, n);
 		break;
 
 	case IMSG_BODY:
-		if (r->body != NULL)
-			errx(1, "body already recv'd");
+		append(&r->body, &r->blen, imsg->data, n);
+		break;
 
-		r->body = calloc(n + 1, 1);
-		if (r->body == NULL)
-			err(1, "calloc");
-		memcpy(r->body, imsg.data, n);
-		r->blen = n;
+	case IMSG_REQ_INFO:
+		append(&r->info, &r->ilen, imsg->data, n);
+		break;
+
+	case IMSG_TIMING:
+		if (n != sizeof(r->timing))
+			errx(1, "timing: wrong size");
+		memcpy(&r->timing, imsg->data, n);
+		break;
+
+	case IMSG_END:
 		ret = 0;
 		break;
 
@@ -177,7 +349,7 @@ recv_into(struct imsgbuf *ibuf, struct resp *r)
 		r->err = calloc(n + 1, 1);
 		if (r->err == NULL)
 			err(1, "calloc");
-		memcpy(r->err, imsg.data, n);
+		memcpy(r->err, imsg->data, n);
 		r->blen = n;
 		ret = 0;
 		break;
@@ -186,17 +358,22 @@ recv_into(struct imsgbuf *ibuf, struct resp *r)
 		err(1, "unexpected response type %d", rtype);
 	}
 
-	imsg_free(&imsg);
 	return ret;
 }
 
-int
-exec_req(struct imsgbuf *ibuf, const struct req *req, struct resp *r)
+static uint64_t
+now_usec(void)
 {
-	size_t pathlen, paylen;
-	ssize_t n;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	memset(r, 0, sizeof(struct resp));
+static void
+send_req(struct worker *w, const struct req *req, uint32_t id)
+{
+	size_t pathlen, paylen;
 
 	pathlen = paylen = 0;
 
@@ -204,157 +381,903 @@ exec_req(struct imsgbuf *ibuf, const struct req *req, struct resp *r)
 	if (req->payload != NULL)
 		paylen = strlen(req->payload);
 
-	if (pathlen >= UINT16_MAX || paylen >= UINT16_MAX)
-		err(1, "url or payload too big");
+	if (pathlen >= MAX_IMSGSIZE - IMSG_HEADER_SIZE ||
+	    paylen >= MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+		errx(1, "url or payload too big");
 
-	imsg_compose(ibuf, IMSG_SET_METHOD, 0, 0, -1, &req->method,
+	writer_compose(&w->wr, IMSG_SET_METHOD, id, &req->method,
 		sizeof(enum http_methods));
-	imsg_compose(ibuf, IMSG_SET_URL, 0, 0, -1, req->path, pathlen);
-	imsg_compose(ibuf, IMSG_SET_PAYLOAD, 0, 0, -1, req->payload, paylen);
-	imsg_compose(ibuf, IMSG_DO_REQ, 0, 0, -1, NULL, 0);
-
-	/* retry on errno == EAGAIN? */
-	if ((n = msgbuf_write(&ibuf->w)) == -1)
-		err(1, "msgbuf_write");
-	if (n == 0)
-		err(1, "child vanished");
-
-	/* read the response */
-	poll_read(ibuf->fd);
-	for (;;) {
-		errno = 0;
-		n = imsg_read(ibuf);
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			continue;
-		if (n == -1)
-			err(1, "imsg_read");
-		if (n == 0)
-			errx(1, "child vanished");
-		break;
+	writer_compose(&w->wr, IMSG_SET_URL, id, req->path, pathlen);
+	writer_compose(&w->wr, IMSG_SET_PAYLOAD, id, req->payload, paylen);
+	if (req->has_to)
+		writer_compose(&w->wr, IMSG_REQ_TIMEOUTS, id, &req->to,
+		    sizeof(req->to));
+	if (req->alone)
+		writer_compose(&w->wr, IMSG_DO_REQ, id, &req->alone,
+		    sizeof(req->alone));
+	else
+		writer_compose(&w->wr, IMSG_DO_REQ, id, NULL, 0);
+	worker_flush(w);
+	worker_throttle(w);
+}
+
+/* account for a completed request of a run */
+static void
+run_record(struct run *run, const struct resp *r, uint64_t intended,
+    uint64_t sent, size_t seq)
+{
+	uint64_t now;
+
+	now = now_usec();
+	hist_add(&run->lat, now - intended);
+	hist_add(&run->svc, now - sent);
+
+	if (run->rp != NULL) {
+		run->rp[seq].nstatus = r->err != NULL ? -1 : r->http_code;
+		run->rp[seq].ntotal = r->timing.total;
 	}
-	while (recv_into(ibuf, r))
-		; /* no-op */
 
-	safe_println(r->headers, r->hlen);
-	safe_println(r->body, r->blen);
+	run->done++;
+	if (r->err != NULL)
+		run->errors++;
+	else if (r->http_code < 200 || r->http_code > 299)
+		run->non2xx++;
+}
 
-	return 0;
+/* route a reply from a worker to its pending request */
+static void
+route_resp(struct worker *w, struct imsg *imsg)
+{
+	struct pending *p;
+
+	/* the replies to different requests may be interleaved */
+	TAILQ_FOREACH(p, &pending, entry) {
+		if (p->id == imsg->hdr.peerid)
+			break;
+	}
+	if (p == NULL || p->w != w || p->done)
+		errx(1, "unexpected message %d for request %u",
+		    imsg->hdr.type, imsg->hdr.peerid);
+
+	/* nobody will read the responses of a run */
+	if (p->run != NULL && (imsg->hdr.type == IMSG_HEAD ||
+	    imsg->hdr.type == IMSG_BODY))
+		return;
+
+	if (recv_into(imsg, &p->r) == 0) {
+		p->done = 1;
+		w->load--;
+	}
+
+	if (p->done && p->run != NULL) {
+		run_record(p->run, &p->r, p->intended, p->sent, p->seq);
+		TAILQ_REMOVE(&pending, p, entry);
+		free_resp(&p->r);
+		free(p);
+	}
+}
+
+void
+handle_resp(struct worker *w, struct imsg *imsg)
+{
+	struct timespec a, b;
+
+	if (recv_timer == NULL) {
+		route_resp(w, imsg);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	route_resp(w, imsg);
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	recv_timer((uint64_t)(b.tv_sec - a.tv_sec) * 1000000000 +
+	    b.tv_nsec - a.tv_nsec);
+}
+
+/* call f with the nanoseconds every reply takes to handle, or stop if
+ * it's NULL.  For crest-e2e */
+void
+set_recv_timer(void (*f)(uint64_t))
+{
+	recv_timer = f;
+}
+
+void
+set_format(int f)
+{
+	format = f;
 }
 
 static void
-wait_for_done(struct imsgbuf *ibuf)
+print_resp(struct resp *r)
 {
-	ssize_t n;
-	struct imsg imsg;
+	if (r->err != NULL)
+		warnx("%s", r->err);
+
+	safe_println(r->headers, r->hlen);
+	if (format != FORMAT_JSON || r->body == NULL ||
+	    !json_print(r->body, r->blen, isatty(1)))
+		safe_println(r->body, r->blen);
+
+	/* keep it around for the pipes */
+	free_resp(&last);
+	memcpy(&last, r, sizeof(struct resp));
+}
 
-	poll_read(ibuf->fd);
+/* print the completed responses, in the same order as the requests */
+void
+print_done(void)
+{
+	struct pending *p;
+
+	while ((p = TAILQ_FIRST(&pending)) != NULL && p->done) {
+		TAILQ_REMOVE(&pending, p, entry);
+		record_resp(p->rec, &p->r);
+		print_resp(&p->r);
+		free(p);
+	}
+}
+
+/* wait until every request in flight is completed and printed */
+static void
+drain(void)
+{
 	for (;;) {
-		errno = 0;
-		n = imsg_read(ibuf);
-		if (errno == EAGAIN)
-			continue;
-		if (n == -1)
-			err(1, "imsg_read");
-		if (n == 0)
-			errx(1, "child vanished");
-		break;
+		print_done();
+		if (TAILQ_EMPTY(&pending))
+			return;
+		ev_once(-1);
 	}
+}
 
-	if ((n = imsg_get(ibuf, &imsg)) == -1)
-		err(1, "imsg_get");
-	if (n == 0)
-		errx(1, "no messages");
-	if (imsg.hdr.type != IMSG_DONE)
-		errx(1, "unexpected message %d", imsg.hdr.type);
+/* send the request to the least loaded worker, without waiting for
+ * it.  Return its id */
+uint32_t
+submit_req(const struct req *req)
+{
+	struct pending *p;
+	struct worker *w;
+
+	w = least_loaded();
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, "calloc");
+	p->id = nextid++;
+	p->w = w;
+	p->rec = record_req(req);
+
+	send_req(w, req, p->id);
+	w->load++;
+	TAILQ_INSERT_TAIL(&pending, p, entry);
+	return p->id;
 }
 
-int
-repl(struct imsgbuf *ibuf, FILE *in)
+/* the response to the request id, if it's complete and not printed
+ * yet */
+const struct resp *
+done_resp(uint32_t id)
 {
-	struct cmd cmd;
+	struct pending *p;
+
+	TAILQ_FOREACH(p, &pending, entry) {
+		if (p->id == id)
+			return p->done ? &p->r : NULL;
+	}
+	return NULL;
+}
+
+/* perform the request on the least loaded worker.  If async is
+ * non-zero don't wait for the response: it'll be printed as soon as
+ * the ones before it are. */
+void
+exec_req(const struct req *req, int async)
+{
+	struct worker *w;
+	struct recreq *rec;
 	struct resp r;
 
-	char *line = NULL;
+	/* single-process mode: no need to go through imsg */
+	if (single_process) {
+		rec = record_req(req);
+		if (!do_req(easy, req, &r, headers, NULL) && r.err == NULL) {
+			if ((r.err = strdup("failed")) == NULL)
+				err(1, "strdup");
+		}
+		record_resp(rec, &r);
+		print_resp(&r);
+		return;
+	}
+
+	while ((w = least_loaded())->load >= MAX_LOAD &&
+	    w->load >= nthreads) {
+		ev_once(-1);
+		print_done();
+	}
+
+	submit_req(req);
+
+	if (async) {
+		ev_once(0);
+		print_done();
+	} else
+		drain();
+}
+
+/* send a request of the run without waiting for anything */
+static void
+rate_send(struct run *run, const struct req *req, uint64_t intended)
+{
+	struct pending *p;
+	struct resp r;
+	uint64_t now;
+	size_t seq;
+
+	/* while the server stalls the requests wait here, not in the
+	 * queues to the children, but their latency still counts from
+	 * the schedule */
+	if (!single_process && least_loaded()->load >= RUN_MAX_LOAD) {
+		while (least_loaded()->load >= RUN_MAX_LOAD)
+			ev_once(-1);
+		run->freed = now_usec();
+	}
+	if (intended < run->freed)
+		run->held++;
+
+	now = now_usec();
+	if (now - intended > LATE)
+		run->late++;
+	if (now - intended > run->lag)
+		run->lag = now - intended;
+	seq = run->sent++;
+
+	/* single-process mode: it can only be done synchronously, but
+	 * the latency is still measured from the schedule */
+	if (single_process) {
+		memset(&r, 0, sizeof(r));
+		if (!do_req(easy, req, &r, headers, NULL) && r.err == NULL) {
+			if ((r.err = strdup("failed")) == NULL)
+				err(1, "strdup");
+		}
+		run_record(run, &r, intended, now, seq);
+		free_resp(&r);
+		return;
+	}
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, "calloc");
+	p->id = nextid++;
+	p->w = least_loaded();
+	p->run = run;
+	p->intended = intended;
+	p->sent = now;
+	p->seq = seq;
+
+	send_req(p->w, req, p->id);
+	p->w->load++;
+	TAILQ_INSERT_TAIL(&pending, p, entry);
+}
+
+static void
+print_pct(const char *what, struct run *run, int permille)
+{
+	uint64_t a, b;
+
+	a = hist_pct(&run->lat, permille);
+	b = hist_pct(&run->svc, permille);
+	printf("%-8s %8llu.%03llu ms %8llu.%03llu ms\n", what,
+	    (unsigned long long)a / 1000, (unsigned long long)a % 1000,
+	    (unsigned long long)b / 1000, (unsigned long long)b % 1000);
+}
+
+static void
+run_report(struct run *run, uint64_t elapsed)
+{
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("%zu requests in %llu.%03llu s, %llu/s, %zu errors, "
+	    "%zu non-2xx\n", run->done,
+	    (unsigned long long)elapsed / 1000000,
+	    (unsigned long long)elapsed / 1000 % 1000,
+	    (unsigned long long)(run->done * 1000000 / elapsed),
+	    run->errors, run->non2xx);
+	if (run->done != 0) {
+		printf("%-8s %14s %14s\n", "", "from schedule",
+		    "from send");
+		print_pct("p50:", run, 500);
+		print_pct("p90:", run, 900);
+		print_pct("p99:", run, 990);
+		print_pct("p99.9:", run, 999);
+		print_pct("max:", run, 1000);
+	}
+	printf("%zu sent late, up to %llu.%03llu ms, %zu held with %d in "
+	    "flight\n", run->late, (unsigned long long)run->lag / 1000,
+	    (unsigned long long)run->lag % 1000, run->held, RUN_MAX_LOAD);
+	fflush(stdout);
+}
+
+/* send the request on a fixed timetable for the whole duration of the
+ * rate, regardless of how long the responses take: a server that
+ * stalls doesn't slow down the sender, and the time the requests
+ * would have waited counts in their latency. */
+static void
+exec_rate(const struct rate *rate, struct req *req)
+{
+	struct run *run;
+	uint64_t start, next, now, elapsed;
+	size_t i, total;
+	int wait;
+
+	if ((run = calloc(1, sizeof(*run))) == NULL)
+		err(1, "calloc");
+	hist_init(&run->lat);
+	hist_init(&run->svc);
+
+	/* the load must reach the server */
+	req->alone = 1;
 
-	memset(&r, 0, sizeof(struct resp));
+	total = (uint64_t)rate->count * rate->dur / rate->per;
+	next = start = now_usec();
 
-	while ((line = rlf(prompt, in)) != NULL) {
-		if (*line == '#') /* ignore comments */
+	for (i = 0; i < total;) {
+		/* send everything that's due, then look at the replies */
+		now = now_usec();
+		while (i < total) {
+			next = start + (uint64_t)i * rate->per * 1000 /
+			    rate->count;
+			if (next > now)
+				break;
+			rate_send(run, req, next);
+			i++;
+		}
+
+		if (i == total)
+			break;
+		now = now_usec();
+		wait = next > now ? (next - now + 999) / 1000 : 0;
+		if (single_process)
+			poll(NULL, 0, wait);
+		else
+			ev_once(wait);
+	}
+
+	while (run->done < run->sent)
+		ev_once(-1);
+	elapsed = now_usec() - start;
+
+	run_report(run, elapsed);
+	free(run);
+}
+
+/* the first CRLF between s and end, or end */
+static const char *
+crlf(const char *s, const char *end)
+{
+	const char *e;
+
+	for (; (e = memchr(s, '\r', end - s)) != NULL; s = e + 1)
+		if (e + 1 < end && e[1] == '\n')
+			return e;
+	return end;
+}
+
+/* make the children send the headers of a record, but the User-Agent
+ * that's a setting.  Only when they change, since the requests sent
+ * before have to be done first, or they could go out with the new
+ * ones. */
+static void
+replay_headers(struct run *run, char **cur, const char *h, size_t len)
+{
+	const char *s, *e, *end;
+	char *t, *c;
+	size_t n;
+	int i;
+
+	if ((t = malloc(len + 3)) == NULL)
+		err(1, "malloc");
+	end = h + len;
+	for (n = 0, s = h; s < end; s = e == end ? end : e + 2) {
+		e = crlf(s, end);
+		if (e == s ||
+		    (e - s >= 11 && !strncasecmp(s, "User-Agent:", 11)))
 			continue;
+		memcpy(t + n, s, e - s);
+		memcpy(t + n + (e - s), "\r\n", 2);
+		n += e - s + 2;
+	}
+	t[n] = '\0';
+
+	if (*cur != NULL && !strcmp(*cur, t)) {
+		free(t);
+		return;
+	}
+
+	while (run->done < run->sent)
+		ev_once(-1);
 
-		if (*line == '|') {
-			do_pipe(line + 1, r.body, r.blen);
+	for (c = *cur; c != NULL && *c != '\0'; c = strstr(c, "\r\n") + 2) {
+		n = strcspn(c, ":\r");
+		if ((s = strndup(c, n)) == NULL)
+			err(1, "strndup");
+		wsend(IMSG_DEL, s, n + 1);
+		for (i = 0; !single_process && i < nworkers; ++i)
+			wait_for_done(&workers[i]);
+		free((char *)s);
+	}
+	for (c = t; *c != '\0'; c = strstr(c, "\r\n") + 2)
+		wsend(IMSG_ADD, c, strcspn(c, "\r"));
+
+	free(*cur);
+	*cur = t;
+}
+
+static void
+print_outcome(long status, curl_off_t t)
+{
+	if (status == -1)
+		printf("failed");
+	else
+		printf("%ld in %lld.%03lld ms", status, (long long)t / 1000,
+		    (long long)t % 1000);
+}
+
+/* how every request went, as recorded and replayed */
+static void
+replay_report(struct run *run)
+{
+	struct replayed *r;
+	size_t i;
+
+	for (i = 0; i < run->sent; ++i) {
+		r = &run->rp[i];
+		printf("%s %s: ", method2str(r->method), r->url);
+		print_outcome(r->status, r->total);
+		printf(", replayed ");
+		print_outcome(r->nstatus, r->ntotal);
+		putchar('\n');
+	}
+}
+
+/* send the requests of the log again, with the same time between them
+ * divided by speed in thousandths, or as fast as they're served if
+ * speed is 0.  Return 0 if the log can't be read. */
+int
+replay(const char *path, long speed)
+{
+	struct reclog l;
+	struct recent e;
+	struct run *run;
+	struct worker *w;
+	struct req req;
+	struct replayed *rp;
+	uint64_t start, first, intended, now;
+	char *cur;
+	int r, wait;
+
+	if (!reclog_open(&l, path))
+		return 0;
+
+	if ((run = calloc(1, sizeof(*run))) == NULL)
+		err(1, "calloc");
+	hist_init(&run->lat);
+	hist_init(&run->svc);
+
+	/* the urls were recorded whole */
+	wsend(IMSG_SET_PREFIX, NULL, 0);
+
+	cur = NULL;
+	first = 0;
+	start = now_usec();
+	while ((r = reclog_next(&l, &e)) == 1) {
+		if (e.method < CONNECT || e.method > TRACE ||
+		    e.lens[0] == 0)
 			continue;
+		if (run->sent == 0)
+			first = e.at;
+
+		replay_headers(run, &cur, e.fields[1], e.lens[1]);
+
+		memset(&req, 0, sizeof(req));
+		req.method = e.method;
+		req.alone = 1;
+		if ((req.path = strndup(e.fields[0], e.lens[0])) == NULL)
+			err(1, "strndup");
+		if (e.lens[2] != 0 &&
+		    (req.payload = strndup(e.fields[2], e.lens[2])) == NULL)
+			err(1, "strndup");
+
+		rp = reallocarray(run->rp, run->sent + 1, sizeof(*rp));
+		if (rp == NULL)
+			err(1, "reallocarray");
+		run->rp = rp;
+		rp = &run->rp[run->sent];
+		memset(rp, 0, sizeof(*rp));
+		rp->method = e.method;
+		rp->status = e.lens[5] != 0 ? -1 : e.status;
+		rp->total = e.timing.total;
+		if ((rp->url = strdup(req.path)) == NULL)
+			err(1, "strdup");
+
+		if (speed == 0) {
+			while (!single_process &&
+			    (w = least_loaded())->load >= MAX_LOAD &&
+			    w->load >= nthreads)
+				ev_once(-1);
+			intended = now_usec();
+		} else {
+			intended = start + (e.at > first ? e.at - first : 0) *
+			    1000 / speed;
+			while ((now = now_usec()) < intended) {
+				wait = (intended - now + 999) / 1000;
+				if (single_process)
+					poll(NULL, 0, wait);
+				else
+					ev_once(wait);
+			}
 		}
 
-		memset(&cmd, 0, sizeof(struct cmd));
-		if (!parse(line, &cmd)) {
-			if (cmd.type == CMD_REQ && cmd.req.path != NULL)
-				free(cmd.req.path);
-			if (cmd.type == CMD_REQ && cmd.req.payload != NULL)
-				free(cmd.req.payload);
-			continue;
+		rate_send(run, &req, intended);
+		free(req.path);
+		free(req.payload);
+	}
+	if (r == -1)
+		warnx("%s: truncated or unreadable after %zu records", path,
+		    run->sent);
+
+	while (run->done < run->sent)
+		ev_once(-1);
+
+	replay_report(run);
+	run_report(run, now_usec() - start);
+
+	while (run->sent != 0)
+		free(run->rp[--run->sent].url);
+	free(run->rp);
+	free(run);
+	free(cur);
+	reclog_close(&l);
+	return 1;
+}
+
+/* ask every worker to show something, since it's not shared */
+static void
+show_workers(enum imsg_type t)
+{
+	int i;
+
+	if (single_process) {
+		child_dispatch(NULL, NULL, IMSG_SHOW, &t, sizeof(t));
+		return;
+	}
+
+	for (i = 0; i < nworkers; ++i) {
+		if (nworkers > 1) {
+			printf("worker %d: ", i);
+			fflush(stdout);
 		}
+		worker_send(&workers[i], IMSG_SHOW, &t, sizeof(t));
+		wait_for_done(&workers[i]);
+	}
+}
 
-		switch (cmd.type) {
-		case CMD_REQ:
-			free_resp(&r);
-			exec_req(ibuf, &cmd.req, &r);
+/* print how many bytes are waiting to be written in both directions */
+static void
+show_queue(void)
+{
+	enum imsg_type t = IMSG_SHOW_QUEUE;
+	int i;
 
-			free(cmd.req.path);
-			if (cmd.req.payload != NULL)
-				free(cmd.req.payload);
-			break;
+	if (single_process) {
+		puts("no queues in single-process mode");
+		fflush(stdout);
+		return;
+	}
+
+	for (i = 0; i < nworkers; ++i) {
+		printf("worker %d: %zu bytes queued (peak %zu), replies: ",
+		    i, writer_queued(&workers[i].wr), workers[i].wr.peak);
+		fflush(stdout);
+		worker_send(&workers[i], IMSG_SHOW, &t, sizeof(t));
+		wait_for_done(&workers[i]);
+	}
+}
+
+static void
+print_usec(const char *what, curl_off_t t)
+{
+	printf("%-12s %lld.%03lld ms\n", what, (long long)t / 1000,
+	    (long long)t % 1000);
+}
+
+/* print the timing of the last response */
+static void
+show_timing(void)
+{
+	print_usec("dns:", last.timing.dns);
+	print_usec("connect:", last.timing.connect);
+	print_usec("tls:", last.timing.tls);
+	print_usec("first byte:", last.timing.ttfb);
+	print_usec("total:", last.timing.total);
+	printf("%-12s %ld\n", "attempts:", last.timing.attempts);
+	fflush(stdout);
+}
+
+/* return 1 if the requests read from in can be sent without waiting
+ * for the previous ones: only when reading a script and there's more
+ * than one worker process or thread. */
+static int
+can_pipeline(FILE *in)
+{
+	struct stat sb;
 
-		case CMD_SET:
-			csend(ibuf, cmd.opt.set, cmd.opt.value, cmd.opt.len);
+	if (single_process || nworkers * nthreads < 2)
+		return 0;
+	if (fstat(fileno(in), &sb) == -1)
+		return 0;
+	return S_ISREG(sb.st_mode);
+}
+
+static struct var *
+var_find(const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < nvars; ++i)
+		if (strlen(vars[i].name) == len &&
+		    !strncmp(vars[i].name, name, len))
+			return &vars[i];
+	return NULL;
+}
+
+static void
+do_extract(struct extract *x)
+{
+	struct var *v;
+	char *val;
+	size_t i, vlen;
+	int r;
+
+	if (x->name == NULL) {
+		for (i = 0; i < nvars; ++i)
+			printf("%s = %s\n", vars[i].name, vars[i].value);
+		return;
+	}
+
+	if (last.body == NULL ||
+	    (r = json_extract(last.body, last.blen, x->path, &val,
+	    &vlen)) == 0) {
+		warnx("%s: not found", x->path);
+		return;
+	}
+	if (r == -1)
+		return;
+
+	if ((v = var_find(x->name, x->nlen)) == NULL) {
+		if ((v = reallocarray(vars, nvars + 1, sizeof(*v))) == NULL)
+			err(1, "reallocarray");
+		vars = v;
+		v = &vars[nvars++];
+		if ((v->name = strndup(x->name, x->nlen)) == NULL)
+			err(1, "strndup");
+	} else
+		free(v->value);
+	v->value = val;
+}
+
+/* replace every ${var} in the line with its value.  Return NULL if
+ * one isn't bound. */
+static char *
+expand(const char *line)
+{
+	struct var *v;
+	const char *s, *d, *e;
+	char *r;
+	size_t len;
+	FILE *f;
 
-			if (cmd.opt.set == IMSG_SET_PORT)
-				free(cmd.opt.value);
+	if ((f = open_memstream(&r, &len)) == NULL)
+		err(1, "open_memstream");
+	for (s = line; (d = strstr(s, "${")) != NULL; s = e + 1) {
+		fwrite(s, 1, d - s, f);
+		if ((e = strchr(d + 2, '}')) == NULL)
 			break;
+		if ((v = var_find(d + 2, e - d - 2)) == NULL) {
+			warnx("unknown variable %.*s", (int)(e - d - 2), d + 2);
+			fclose(f);
+			free(r);
+			return NULL;
+		}
+		fputs(v->value, f);
+	}
+	fputs(s, f);
+	if (fclose(f) == EOF)
+		err(1, "fclose");
+	return r;
+}
+
+/* only the safe methods of RFC 9110 section 9.2.1, that don't change
+ * anything, may be sent out of order */
+static int
+safe(enum http_methods m)
+{
+	return m == GET || m == HEAD || m == OPTIONS;
+}
 
-		case CMD_SHOW:
-			csend(ibuf, IMSG_SHOW, &cmd.show, sizeof(cmd.show));
-			wait_for_done(ibuf);
+/* run a command.  Return 0 to stop */
+static int
+run_cmd(char *line)
+{
+	struct cmd cmd;
+	int async, found, i;
+
+	memset(&cmd, 0, sizeof(struct cmd));
+	if (!parse(line, &cmd)) {
+		if ((cmd.type == CMD_REQ || cmd.type == CMD_RATE) &&
+		    cmd.req.path != NULL)
+			free(cmd.req.path);
+		if ((cmd.type == CMD_REQ || cmd.type == CMD_RATE) &&
+		    cmd.req.payload != NULL)
+			free(cmd.req.payload);
+		return 1;
+	}
+
+	/* only the requests in a batch may not wait for the previous
+	 * ones to complete */
+	async = cmd.type == CMD_REQ && batch && safe(cmd.req.method);
+	if (!async)
+		drain();
+
+	switch (cmd.type) {
+	case CMD_REQ:
+		exec_req(&cmd.req, async);
+
+		free(cmd.req.path);
+		if (cmd.req.payload != NULL)
+			free(cmd.req.payload);
+		break;
+
+	case CMD_RATE:
+		exec_rate(&cmd.rate, &cmd.req);
+
+		free(cmd.req.path);
+		if (cmd.req.payload != NULL)
+			free(cmd.req.payload);
+		break;
+
+	case CMD_SET:
+		/* the children can't open the directory by themselves */
+		if (cmd.opt.set == IMSG_SET_CACHE_DIR)
+			dcache_send(cmd.opt.value);
+		/* and the socket has to be checked first */
+		else if (cmd.opt.set == IMSG_SET_UNIX_SOCKET)
+			unix_send(cmd.opt.value, cmd.opt.len);
+		else
+			wsend(cmd.opt.set, cmd.opt.value, cmd.opt.len);
+
+		if (cmd.opt.dirty)
+			free(cmd.opt.value);
+		break;
+
+	case CMD_SHOW:
+		if (cmd.show == IMSG_SHOW_QUEUE) {
+			show_queue();
 			break;
+		}
 
-		case CMD_ADD:
-			csend(ibuf, IMSG_ADD, cmd.hdrname,
-				strlen(cmd.hdrname));
+		if (cmd.show == IMSG_TIMING) {
+			show_timing();
 			break;
+		}
 
-		case CMD_DEL:
-			/* copy also the NUL-terminator. */
-			csend(ibuf, IMSG_DEL, cmd.hdrname,
-				strlen(cmd.hdrname) + 1);
-			wait_for_done(ibuf);
+		if (cmd.show == IMSG_SHOW_CACHE) {
+			show_workers(IMSG_SHOW_CACHE);
 			break;
+		}
 
-		case CMD_SPECIAL:
-			switch (cmd.sp) {
-			case SC_HELP:
-				help();
-				break;
-			case SC_QUIT:
-				goto end;
-				break;
-			case SC_VERSION:
-				warnx("version ?");
-				break;
-			}
+		/* the workers share the same settings, so ask only the
+		 * first one */
+		if (single_process) {
+			child_dispatch(NULL, NULL, IMSG_SHOW, &cmd.show,
+			    sizeof(cmd.show));
 			break;
+		}
+		worker_send(&workers[0], IMSG_SHOW, &cmd.show,
+		    sizeof(cmd.show));
+		wait_for_done(&workers[0]);
+		break;
 
-		default:
-			err(1, "invalid cmd.type %d", cmd.type);
+	case CMD_FORMAT:
+		if (cmd.format == -1)
+			puts(format == FORMAT_JSON ? "json" : "raw");
+		else
+			set_format(cmd.format);
+		break;
+
+	case CMD_WARM:
+		warm_all(cmd.hosts, strlen(cmd.hosts));
+		break;
+
+	case CMD_EXTRACT:
+		do_extract(&cmd.ext);
+		break;
+
+	case CMD_RECORD:
+		if (cmd.rec.show)
+			record_show();
+		else if (cmd.rec.path == NULL)
+			record_close();
+		else
+			record_open(cmd.rec.path, cmd.rec.zstd);
+		break;
+
+	case CMD_ADD:
+		wsend(IMSG_ADD, cmd.hdrname, strlen(cmd.hdrname));
+		break;
+
+	case CMD_DEL:
+		/* copy also the NUL-terminator. */
+		wsend(IMSG_DEL, cmd.hdrname, strlen(cmd.hdrname) + 1);
+		found = 1;
+		for (i = 0; !single_process && i < nworkers; ++i)
+			found = wait_for_done(&workers[i]);
+		if (!found)
+			warnx("header \"%s\" not present", cmd.hdrname);
+		break;
+
+	case CMD_SPECIAL:
+		switch (cmd.sp) {
+		case SC_HELP:
+			help();
+			break;
+		case SC_QUIT:
+			return 0;
+		case SC_VERSION:
+			warnx("version ?");
+			break;
 		}
+		break;
+
+	default:
+		err(1, "invalid cmd.type %d", cmd.type);
 	}
-end:
-	free_resp(&r);
 
-	if (line && *line == '\0')
-		putchar('\n');
-	if (line)
-		free(line);
+	return 1;
+}
+
+/* run a line.  Return 0 to stop */
+static int
+run_line(char *line)
+{
+	char *x;
+	int r;
+
+	if (*line == '#') /* ignore comments */
+		return 1;
+
+	/* the shell has its own ${} */
+	if (*line == '|') {
+		drain();
+		do_pipe(line + 1, last.body, last.blen);
+		return 1;
+	}
+
+	if (strstr(line, "${") == NULL)
+		return run_cmd(line);
+
+	/* extract waits for the responses before it, so the values
+	 * are there already */
+	if ((x = expand(line)) == NULL)
+		return 1;
+	r = run_cmd(x);
+	free(x);
+	return r;
+}
+
+int
+repl(FILE *in)
+{
+	batch = can_pipeline(in);
+
+	read_lines(in, run_line);
+	drain();
 
 	return !ferror(in);
 }
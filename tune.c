@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The socket options and the sizes of curl's buffers.  They're read
+ * when a connection is made, so the child closes its connections when
+ * one of the socket options changes.
+ */
+
+#include "crest.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+
+static int
+sockopt_cb(void *arg, curl_socket_t fd, curlsocktype purpose)
+{
+	int n;
+
+	(void)arg;
+
+	/* before connect, or the window scale would be fixed already */
+	if (purpose == CURLSOCKTYPE_IPCXN && settings.tune.rcvbuf != 0) {
+		n = settings.tune.rcvbuf;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n)) == -1)
+			warn("setsockopt SO_RCVBUF");
+	}
+	return CURL_SOCKOPT_OK;
+}
+
+void
+tune(CURL *curl)
+{
+	struct tuning *t = &settings.tune;
+
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, (long)t->nodelay);
+	curl_easy_setopt(curl, CURLOPT_TCP_FASTOPEN, (long)t->fastopen);
+
+	if (t->keepidle != 0) {
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, t->keepidle);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, t->keepintvl);
+	}
+
+	if (t->bufsize != 0)
+		curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, t->bufsize);
+	if (t->upbufsize != 0)
+		curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, t->upbufsize);
+
+	curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_cb);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The targets behind a unix domain socket.  curl connects to them by
+ * itself, so where pledge(2) is real the children need "unix".  A
+ * pledge can't be widened later, so they're given it only when the
+ * socket is on the command line, and a set unix-socket is refused if
+ * they weren't.
+ */
+
+#include "crest.h"
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __OpenBSD__
+#define CONFINED 1
+#else
+#define CONFINED 0
+#endif
+
+/* set before spawning the children if they may connect to a socket */
+int	unix_allowed;
+
+/* called in the parent: make the children connect to the socket p, or
+ * over TCP again if len is 0 */
+int
+unix_send(const char *p, size_t len)
+{
+	struct stat sb;
+	char *t;
+
+	if (len != 0) {
+		if ((t = strndup(p, len)) == NULL)
+			err(1, "strndup");
+		if (stat(t, &sb) == -1) {
+			warn("%s", t);
+			free(t);
+			return 0;
+		}
+		if (!S_ISSOCK(sb.st_mode)) {
+			warnx("%s: not a socket", t);
+			free(t);
+			return 0;
+		}
+		free(t);
+
+		if (!single_process && CONFINED && !unix_allowed) {
+			warnx("unix-socket can only be given with -o here");
+			return 0;
+		}
+	}
+
+	wsend(IMSG_SET_UNIX_SOCKET, p, len);
+	return 1;
+}
+
+void
+unix_use(CURL *curl)
+{
+	if (settings.unix_socket.s != NULL)
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH,
+		    settings.unix_socket.s);
+}
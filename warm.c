@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Every handle of a child shares the DNS cache and the TLS sessions, so
+ * warm can connect to the hosts ahead of the first request: the names
+ * are resolved and the TLS sessions are ready to be resumed.  libcurl
+ * never reuses a connection made with CURLOPT_CONNECT_ONLY, so they're
+ * closed once established.
+ *
+ * The addresses pinned with set resolve go in the same DNS cache, where
+ * they stay until they're removed, so the list given to curl also
+ * removes the ones that were pinned before and aren't anymore.
+ */
+
+#include "crest.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct target {
+	CURL	*curl;
+	char	*url;
+	char	 errbuf[CURL_ERROR_SIZE];
+};
+
+static CURLSH		*share;
+static pthread_mutex_t	 locks[CURL_LOCK_DATA_LAST];
+
+/* the host:port:addr entries of set resolve, and every host:port ever
+ * pinned */
+static char		**pins, **keys;
+static size_t		 npins, nkeys;
+
+static void
+lock_cb(CURL *h, curl_lock_data data, curl_lock_access a, void *arg)
+{
+	(void)h;
+	(void)a;
+	(void)arg;
+
+	pthread_mutex_lock(&locks[data]);
+}
+
+static void
+unlock_cb(CURL *h, curl_lock_data data, void *arg)
+{
+	(void)h;
+	(void)arg;
+
+	pthread_mutex_unlock(&locks[data]);
+}
+
+void
+warm_init(void)
+{
+	int i;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+		pthread_mutex_init(&locks[i], NULL);
+
+	if ((share = curl_share_init()) == NULL)
+		errx(1, "curl_share_init failed");
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_cb);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_cb);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+/* called when no handle is using the share anymore */
+void
+warm_fini(void)
+{
+	size_t j;
+	int i;
+
+	for (j = 0; j < nkeys; ++j)
+		free(keys[j]);
+	free(keys);
+	keys = NULL;
+	nkeys = 0;
+	resolve_set(NULL, 0);
+
+	curl_share_cleanup(share);
+	share = NULL;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+		pthread_mutex_destroy(&locks[i]);
+}
+
+/* make curl use the caches of the child and the pinned addresses */
+void
+warm_share(CURL *curl)
+{
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT,
+	    settings.dns_ttl == -1 ? -1L :
+	    settings.dns_ttl / 1000 + (settings.dns_ttl % 1000 != 0));
+	if (settings.resolve != NULL)
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, settings.resolve);
+}
+
+/* the length of the host:port part of a resolve entry */
+static size_t
+keylen(const char *entry)
+{
+	const char *c;
+
+	if ((c = strchr(entry, ':')) == NULL ||
+	    (c = strchr(c + 1, ':')) == NULL)
+		return strlen(entry);
+	return c - entry;
+}
+
+static int
+has_key(char **v, size_t n, const char *key, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		if (keylen(v[i]) == len && !strncmp(v[i], key, len))
+			return 1;
+	return 0;
+}
+
+static void
+push(char ***v, size_t *n, const char *s, size_t len)
+{
+	char **t;
+
+	if ((t = realloc(*v, (*n + 1) * sizeof(*t))) == NULL)
+		err(1, "realloc");
+	*v = t;
+	if ((t[*n] = strndup(s, len)) == NULL)
+		err(1, "strndup");
+	(*n)++;
+}
+
+/* rebuild the list for curl: the removal of what's not pinned anymore,
+ * then the pins */
+static void
+rebuild(void)
+{
+	struct curl_slist *l, *t;
+	char *r;
+	size_t i;
+
+	l = NULL;
+	for (i = 0; i < nkeys; ++i) {
+		if (has_key(pins, npins, keys[i], strlen(keys[i])))
+			continue;
+		if (asprintf(&r, "-%s", keys[i]) == -1)
+			err(1, "asprintf");
+		if ((t = curl_slist_append(l, r)) == NULL)
+			err(1, "curl_slist_append");
+		l = t;
+		free(r);
+	}
+	for (i = 0; i < npins; ++i) {
+		if ((t = curl_slist_append(l, pins[i])) == NULL)
+			err(1, "curl_slist_append");
+		l = t;
+	}
+
+	curl_slist_free_all(settings.resolve);
+	settings.resolve = l;
+}
+
+/* pin the addresses for a host:port, replacing the previous ones, or
+ * drop all the pins if entry is NULL */
+void
+resolve_set(const char *entry, size_t len)
+{
+	size_t i, k;
+
+	if (entry == NULL) {
+		for (i = 0; i < npins; ++i)
+			free(pins[i]);
+		free(pins);
+		pins = NULL;
+		npins = 0;
+		rebuild();
+		return;
+	}
+
+	k = keylen(entry);
+	for (i = 0; i < npins; ++i) {
+		if (keylen(pins[i]) == k && !strncmp(pins[i], entry, k)) {
+			free(pins[i]);
+			if ((pins[i] = strndup(entry, len)) == NULL)
+				err(1, "strndup");
+			break;
+		}
+	}
+	if (i == npins)
+		push(&pins, &npins, entry, len);
+	if (!has_key(keys, nkeys, entry, k))
+		push(&keys, &nkeys, entry, k);
+	rebuild();
+}
+
+void
+resolve_show(void)
+{
+	size_t i;
+
+	for (i = 0; i < npins; ++i)
+		puts(pins[i]);
+}
+
+static void
+warm_setup(struct target *t)
+{
+	if ((t->curl = curl_easy_init()) == NULL)
+		errx(1, "curl_easy_init failed");
+
+	warm_share(t->curl);
+	tune(t->curl);
+	unix_use(t->curl);
+	curl_easy_setopt(t->curl, CURLOPT_URL, t->url);
+	curl_easy_setopt(t->curl, CURLOPT_CONNECT_ONLY, 1L);
+	curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(t->curl, CURLOPT_HTTP_VERSION, settings.http_version);
+	curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER, t->errbuf);
+
+	if (settings.port != -1)
+		curl_easy_setopt(t->curl, CURLOPT_PORT, settings.port);
+	if (settings.skip_peer_verification)
+		curl_easy_setopt(t->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	if (settings.to.connect != 0)
+		curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT_MS,
+		    settings.to.connect);
+}
+
+static void
+warm_report(struct target *t, CURLcode code)
+{
+	curl_off_t c, tls;
+
+	if (code != CURLE_OK) {
+		warnx("warm: %s: %s", t->url, *t->errbuf != '\0' ?
+		    t->errbuf : curl_easy_strerror(code));
+		return;
+	}
+
+	curl_easy_getinfo(t->curl, CURLINFO_CONNECT_TIME_T, &c);
+	curl_easy_getinfo(t->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+	if (tls != 0)
+		c = tls;
+	printf("%s: connected in %lld.%03lld ms\n", t->url,
+	    (long long)c / 1000, (long long)c % 1000);
+}
+
+/* connect in parallel to the hosts in the space-separated list, or
+ * to the prefix if it's empty */
+void
+warm(const char *list, size_t len)
+{
+	struct target *t, *d;
+	CURLM *multi;
+	CURLMsg *msg;
+	const char *s, *e, *end;
+	size_t i, n;
+	int running, left;
+
+	t = NULL;
+	n = 0;
+	end = list + len;
+	for (s = list; s < end; s = e) {
+		for (; s < end && isspace((unsigned char)*s); ++s)
+			;
+		for (e = s; e < end && !isspace((unsigned char)*e); ++e)
+			;
+		if (e == s)
+			continue;
+		if ((t = realloc(t, (n + 1) * sizeof(*t))) == NULL)
+			err(1, "realloc");
+		memset(&t[n], 0, sizeof(*t));
+		if ((t[n++].url = strndup(s, e - s)) == NULL)
+			err(1, "strndup");
+	}
+
+	if (n == 0) {
+		if (settings.prefix.s == NULL) {
+			warnx("warm: no prefix");
+			return;
+		}
+		if ((t = calloc(1, sizeof(*t))) == NULL)
+			err(1, "calloc");
+		if ((t->url = strdup(settings.prefix.s)) == NULL)
+			err(1, "strdup");
+		n = 1;
+	}
+
+	if ((multi = curl_multi_init()) == NULL)
+		errx(1, "curl_multi_init failed");
+	for (i = 0; i < n; ++i) {
+		warm_setup(&t[i]);
+		curl_easy_setopt(t[i].curl, CURLOPT_PRIVATE, &t[i]);
+		curl_multi_add_handle(multi, t[i].curl);
+	}
+
+	do {
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+			    (char **)&d);
+			warm_report(d, msg->data.result);
+		}
+		if (running)
+			curl_multi_poll(multi, NULL, 0, 1000, NULL);
+	} while (running);
+
+	for (i = 0; i < n; ++i) {
+		curl_multi_remove_handle(multi, t[i].curl);
+		curl_easy_cleanup(t[i].curl);
+		free(t[i].url);
+	}
+	curl_multi_cleanup(multi);
+	free(t);
+	fflush(stdout);
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "crest.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct worker	*workers;
+int		 nworkers;
+
+/* read what's available from a worker.  The IMSG_DONE are recorded in
+ * the worker, everything else is a reply to one of its requests */
+static void
+worker_read(struct worker *w)
+{
+	struct imsg imsg;
+	ssize_t n;
+
+	if ((n = imsg_read(&w->ibuf)) == -1 && errno != EAGAIN)
+		err(1, "imsg_read");
+	if (n == 0)
+		errx(1, "child vanished");
+
+	for (;;) {
+		if ((n = imsg_get(&w->ibuf, &imsg)) == -1)
+			err(1, "imsg_get");
+		if (n == 0)
+			return;
+
+		if (imsg.hdr.type == IMSG_DONE) {
+			w->ret = 1;
+			if (imsg.hdr.len - IMSG_HEADER_SIZE == sizeof(int))
+				memcpy(&w->ret, imsg.data, sizeof(int));
+			w->done++;
+		} else
+			handle_resp(w, &imsg);
+
+		imsg_free(&imsg);
+	}
+}
+
+static void
+worker_event(int fd, short ev, void *arg)
+{
+	struct worker *w = arg;
+
+	(void)fd;
+
+	if (ev & POLLOUT)
+		worker_flush(w);
+	if (ev & (POLLIN | POLLHUP))
+		worker_read(w);
+}
+
+/* fork n children, each with its own socketpair.  Return only in the
+ * parent: the children exit through child_main */
+void
+spawn_workers(int n)
+{
+	int i, j, imsg_fds[2];
+	pid_t pid;
+	struct imsgbuf child_ibuf;
+
+	if ((workers = calloc(n, sizeof(struct worker))) == NULL)
+		err(1, "calloc");
+	nworkers = n;
+
+	for (i = 0; i < n; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, imsg_fds)
+		    == -1)
+			err(1, "socketpair");
+
+		switch (pid = fork()) {
+		case -1:
+			err(1, "fork");
+
+		case 0:
+			/* don't keep the other workers' sockets open */
+			for (j = 0; j < i; ++j)
+				close(workers[j].ibuf.fd);
+
+			if (unveil("/etc/ssl/", "r") == -1)
+				err(1, "unveil");
+			if (pledge(unix_allowed ?
+			    "stdio rpath dns inet recvfd unix" :
+			    "stdio rpath dns inet recvfd", NULL) == -1)
+				err(1, "pledge");
+			close(imsg_fds[0]);
+			imsg_init(&child_ibuf, imsg_fds[1]);
+			exit(child_main(&child_ibuf));
+		}
+
+		close(imsg_fds[1]);
+		workers[i].pid = pid;
+		workers[i].load = 0;
+		imsg_init(&workers[i].ibuf, imsg_fds[0]);
+		writer_init(&workers[i].wr, &workers[i].ibuf, WRITER_HWM);
+		ev_add(imsg_fds[0], POLLIN, worker_event, &workers[i]);
+	}
+}
+
+/* tell every worker to exit and wait for them */
+void
+stop_workers(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; ++i) {
+		ev_del(workers[i].ibuf.fd);
+		writer_compose(&workers[i].wr, IMSG_EXIT, 0, NULL, 0);
+		writer_sync(&workers[i].wr);
+	}
+
+	for (i = 0; i < nworkers; ++i) {
+		waitpid(workers[i].pid, NULL, 0);
+		close(workers[i].ibuf.fd);
+		imsg_clear(&workers[i].ibuf);
+	}
+
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+/* try to write what's queued for the worker, and wait for the socket
+ * to be writable if something's left */
+void
+worker_flush(struct worker *w)
+{
+	if (writer_flush(&w->wr))
+		ev_set(w->ibuf.fd, POLLIN);
+	else
+		ev_set(w->ibuf.fd, POLLIN | POLLOUT);
+}
+
+/* while more than the high-water mark is queued for the worker, wait
+ * for it to drain to half of it.  The replies are still read in the
+ * meantime, so the child isn't stuck writing them */
+void
+worker_throttle(struct worker *w)
+{
+	if (writer_queued(&w->wr) < w->wr.hwm)
+		return;
+	while (writer_queued(&w->wr) >= w->wr.hwm / 2)
+		ev_once(-1);
+}
+
+void
+worker_send(struct worker *w, int type, const void *ptr, size_t len)
+{
+	writer_compose(&w->wr, type, 0, ptr, len);
+	worker_flush(w);
+}
+
+void
+worker_send_fd(struct worker *w, int type, int fd, const void *ptr,
+    size_t len)
+{
+	writer_compose_fd(&w->wr, type, fd, ptr, len);
+	worker_flush(w);
+}
+
+/* send a message to every worker, so they all share the same settings
+ * and headers.  In single-process mode the message is handed directly
+ * to the child code instead. */
+void
+wsend(int type, const void *ptr, size_t len)
+{
+	int i;
+
+	if (single_process) {
+		child_dispatch(NULL, NULL, type, ptr, len);
+		return;
+	}
+
+	for (i = 0; i < nworkers; ++i)
+		worker_send(&workers[i], type, ptr, len);
+}
+
+/* make every worker connect to the hosts, and wait for them */
+void
+warm_all(const char *hosts, size_t len)
+{
+	int i;
+
+	wsend(IMSG_WARM, hosts, len);
+	for (i = 0; !single_process && i < nworkers; ++i)
+		wait_for_done(&workers[i]);
+}
+
+/* return the worker with the fewest requests in flight */
+struct worker *
+least_loaded(void)
+{
+	int i;
+	struct worker *w;
+
+	w = &workers[0];
+	for (i = 1; i < nworkers; ++i)
+		if (workers[i].load < w->load)
+			w = &workers[i];
+
+	return w;
+}
+
+/* wait for the IMSG_DONE from the given worker.  Return the int that
+ * comes with it, or 1 if there's none. */
+int
+wait_for_done(struct worker *w)
+{
+	/* the child code already ran synchronously */
+	if (single_process)
+		return 1;
+
+	while (w->done == 0)
+		ev_once(-1);
+
+	w->done--;
+	return w->ret;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019 Omar Polo <op@xglobe.in>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A writer wraps the write side of an imsgbuf.  The socket is put in
+ * non-blocking mode: messages are queued and flushed as the socket
+ * becomes writable, keeping track of how many bytes are waiting so
+ * the producers can slow down when the peer doesn't keep up.
+ */
+
+#include "crest.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+
+/* the biggest payload that fits in a single message */
+#define MAX_PAYLOAD (MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+
+void
+writer_init(struct writer *w, struct imsgbuf *ibuf, size_t hwm)
+{
+	int flags;
+
+	if ((flags = fcntl(ibuf->fd, F_GETFL)) == -1)
+		err(1, "fcntl");
+	if (fcntl(ibuf->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	w->ibuf = ibuf;
+	atomic_init(&w->queued, 0);
+	w->peak = 0;
+	w->hwm = hwm;
+}
+
+void
+writer_compose(struct writer *w, int type, uint32_t peerid,
+    const void *data, size_t len)
+{
+	size_t q;
+
+	if (imsg_compose(w->ibuf, type, peerid, 0, -1, data, len) == -1)
+		err(1, "imsg_compose");
+
+	q = atomic_fetch_add(&w->queued, IMSG_HEADER_SIZE + len);
+	q += IMSG_HEADER_SIZE + len;
+	if (q > w->peak)
+		w->peak = q;
+}
+
+/* like writer_compose, but pass also the file descriptor fd */
+void
+writer_compose_fd(struct writer *w, int type, int fd, const void *data,
+    size_t len)
+{
+	if (imsg_compose(w->ibuf, type, 0, 0, fd, data, len) == -1)
+		err(1, "imsg_compose");
+
+	atomic_fetch_add(&w->queued, IMSG_HEADER_SIZE + len);
+}
+
+/* like writer_compose, but split the data in as many messages as
+ * needed.  At least one message is always queued. */
+void
+writer_compose_chunks(struct writer *w, int type, uint32_t peerid,
+    const char *data, size_t len)
+{
+	size_t n;
+
+	do {
+		n = len > MAX_PAYLOAD ? MAX_PAYLOAD : len;
+		writer_compose(w, type, peerid, data, n);
+		data += n;
+		len -= n;
+	} while (len != 0);
+}
+
+/* write what can be written without blocking.  Return 1 if the queue
+ * is now empty. */
+int
+writer_flush(struct writer *w)
+{
+	struct ibuf *buf;
+	size_t q;
+	int n;
+
+	while (w->ibuf->w.queued != 0) {
+		if ((n = msgbuf_write(&w->ibuf->w)) == -1) {
+			if (errno == EAGAIN)
+				break;
+			err(1, "msgbuf_write");
+		}
+		if (n == 0)
+			errx(1, "peer vanished");
+	}
+
+	q = 0;
+	TAILQ_FOREACH(buf, &w->ibuf->w.bufs, entry)
+		q += buf->wpos - buf->rpos;
+	atomic_store(&w->queued, q);
+
+	return q == 0;
+}
+
+/* block until everything is written */
+void
+writer_sync(struct writer *w)
+{
+	struct pollfd pfd;
+
+	while (!writer_flush(w)) {
+		pfd.fd = w->ibuf->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			err(1, "poll");
+	}
+}
+
+size_t
+writer_queued(struct writer *w)
+{
+	return atomic_load(&w->queued);
+}